@@ -0,0 +1,67 @@
+import sys
+import numpy as np
+
+# Reader for the indexed snapshots written by Simulation::save_snapshot / SaveIndexedSnapshot.
+# The particle records are memory mapped, a query only reads the blocks of the index that overlap the box.
+
+PAGE = 4096
+HEADER = np.dtype([("magic", "S8"), ("num_particles", "<u8"), ("mass", "<f8"), ("level", "<u8"), ("table_offset", "<u8"), ("data_offset", "<u8")])
+PARTICLE = np.dtype([("position", "<f8", 3), ("velocity", "<f8", 3)])
+
+
+def spread_bits(value):
+    key = 0
+    for bit in range(21):
+        key |= ((value >> bit) & 1) << (3 * bit)
+    return key
+
+
+def block_key(i, j, k):
+    # same interleaving as MortonKey, x takes the most significant bit of each triplet
+    return (spread_bits(i) << 2) | (spread_bits(j) << 1) | spread_bits(k)
+
+
+class IndexedSnapshot:
+    def __init__(self, filename):
+        header = np.fromfile(filename, dtype=HEADER, count=1)[0]
+        if header["magic"] != b"PMSNAP01":
+            raise ValueError(filename + " is not an indexed snapshot")
+        self.num_particles = int(header["num_particles"])
+        self.mass = float(header["mass"])
+        self.level = int(header["level"])
+        num_blocks = 8 ** self.level
+        self.offsets = np.memmap(filename, dtype="<u8", mode="r", offset=int(header["table_offset"]), shape=(num_blocks + 1,))
+        self.particles = np.memmap(filename, dtype=PARTICLE, mode="r", offset=int(header["data_offset"]), shape=(self.num_particles,))
+
+    def query_box(self, lower, upper):
+        lower = np.asarray(lower, dtype=float)
+        upper = np.asarray(upper, dtype=float)
+        if np.any(lower >= upper):
+            return np.empty(0, dtype=PARTICLE)
+        blocks = 2 ** self.level
+        first = np.clip(np.floor(lower * blocks).astype(int), 0, blocks - 1)
+        last = np.clip(np.ceil(upper * blocks).astype(int) - 1, 0, blocks - 1)
+        keys = sorted(block_key(i, j, k) for i in range(first[0], last[0] + 1)
+                      for j in range(first[1], last[1] + 1) for k in range(first[2], last[2] + 1))
+
+        # consecutive keys are contiguous in the file and read as one run
+        selected = []
+        run_start = 0
+        for r in range(1, len(keys) + 1):
+            if r < len(keys) and keys[r] == keys[r - 1] + 1:
+                continue
+            run = self.particles[self.offsets[keys[run_start]]:self.offsets[keys[r - 1] + 1]]
+            inside = np.all((run["position"] >= lower) & (run["position"] < upper), axis=1)
+            selected.append(np.array(run[inside]))
+            run_start = r
+        return np.concatenate(selected)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 8:
+        print("Usage: python3 read_snapshot.py <snapshot> <x_min> <y_min> <z_min> <x_max> <y_max> <z_max>")
+        sys.exit(1)
+    snapshot = IndexedSnapshot(sys.argv[1])
+    coordinates = [float(value) for value in sys.argv[2:]]
+    particles = snapshot.query_box(coordinates[:3], coordinates[3:])
+    print(f"{len(particles)} of {snapshot.num_particles} particles in the box, total mass {len(particles) * snapshot.mass}")
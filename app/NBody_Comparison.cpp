@@ -87,7 +87,7 @@ int main(int argc, char** argv)
         double time_step = 0.01;
         Simulation sim(t_max, time_step, particle_group(mass, num_particles, random_seed), width, num_cells, expansion_factor);
         sim.run();
-        const particle_group particle_collection = sim.get_particle_collection();
+        const particle_group & particle_collection = sim.get_particle_collection();
         std::vector<double> corr_func = correlationFunction(particle_collection, num_bins);
         std::vector<std::vector<double>> corr_funcs = {corr_func,};
         for (int i = 1; i < num_proc; i++){
@@ -127,7 +127,7 @@ int main(int argc, char** argv)
 
         Simulation sim(t_max, time_step, particle_group(mass, num_particles, random_seed), width, num_cells, expansion_factor);
         sim.run();
-        const particle_group particle_collection = sim.get_particle_collection();
+        const particle_group & particle_collection = sim.get_particle_collection();
         std::vector<double> corr_func = correlationFunction(particle_collection, num_bins);
         MPI_Send(&num_bins, 1, MPI_UNSIGNED, 0, 2, MPI_COMM_WORLD);
         MPI_Send(corr_func.data(), num_bins, MPI_DOUBLE, 0, 3, MPI_COMM_WORLD);
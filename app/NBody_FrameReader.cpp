@@ -0,0 +1,118 @@
+#include "FrameRing.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+/**
+ * @brief: This function prints a help message for the NBody_FrameReader application
+*/
+void HelpMessage(){
+    std::cout << "This program follows a running NBody_Visualiser through the shared memory frame ring it publishes its density projections to, printing a summary of every frame it receives.\n\nBrief instructions can be found below." << std::endl;
+    std::cout << "Usage: NBody_FrameReader -shm <ring_name> [-n <number_of_frames>] [-w <wait_seconds>]\n"
+              << "Options:\n"
+              << "  -h                                       Show this help message\n"
+              << "  -shm <ring_name>                         Name of the shared memory ring given to NBody_Visualiser -shm\n"
+              << "  -n  <number_of_frames>                   Optional, stop after this many frames, by default the reader stops when the run finishes\n"
+              << "  -w  <wait_seconds>                       Optional, how long to wait for the ring to appear, 10 by default" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    std::string ring_name;
+    uint64_t max_frames = 0;
+    double wait_seconds = 10;
+
+    for (int i = 1; i < argc; i+=2){
+        std::string arg(argv[i]);
+        if (arg == "-h"){
+            HelpMessage();
+            return 0;
+        }
+        if (i + 1 >= argc){
+            std::cerr << "Error - Flag " << arg << " requires a value!" << std::endl;
+            HelpMessage();
+            return 1;
+        }
+        if (arg == "-shm"){
+            ring_name = argv[i + 1];
+        }
+        else if (arg == "-n"){
+            max_frames = std::stoull(argv[i + 1]);
+        }
+        else if (arg == "-w"){
+            wait_seconds = std::stod(argv[i + 1]);
+        }
+        else{
+            std::cerr << "Invalid Flag Detected: " << arg << std::endl;
+            HelpMessage();
+            return 1;
+        }
+    }
+    if (ring_name.empty()){
+        std::cerr << "Please Input the Required Flags!" << std::endl;
+        HelpMessage();
+        return 1;
+    }
+
+    // the ring is created when the simulation starts running, so it may not exist yet
+    std::unique_ptr<FrameSubscriber> ring;
+    auto give_up = std::chrono::steady_clock::now() + std::chrono::duration<double>(wait_seconds);
+    while (!ring){
+        try{
+            ring = std::make_unique<FrameSubscriber>(ring_name);
+        }
+        catch (const std::runtime_error &e){
+            if (std::chrono::steady_clock::now() > give_up){
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    std::cout << std::left << std::setw(10) << "frame" << std::setw(12) << "time" << std::setw(10) << "step" << std::setw(14) << "mean" << std::setw(14) << "max" << "missed" << std::endl;
+    uint64_t next_frame = 0;
+    uint64_t received = 0;
+    uint64_t missed = 0; // frames lost since the last one printed
+    while (max_frames == 0 || received < max_frames){
+        uint64_t published = ring->get_frames_published();
+        if (published == next_frame){
+            if (ring->is_finished()){
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        // frames older than the ring have been overwritten, skip straight to the oldest one still held
+        uint64_t oldest = published > ring->get_num_slots() ? published - ring->get_num_slots() : 0;
+        uint64_t frame = std::max(next_frame, oldest);
+        missed += frame - next_frame;
+
+        // the statistics are computed straight from shared memory, view reports whether the writer lapped the reader in the meantime
+        frame_info info;
+        double mean = 0, max = 0;
+        bool intact = ring->view(frame, [&](const frame_info & slot_info, const double * pixels){
+            info = slot_info;
+            uint64_t num_pixels = slot_info.size * slot_info.size;
+            double sum = 0;
+            for (uint64_t p = 0; p < num_pixels; p++){
+                sum += pixels[p];
+                max = std::max(max, pixels[p]);
+            }
+            mean = num_pixels > 0 ? sum / num_pixels : 0;
+        });
+        next_frame = frame + 1;
+        if (!intact){
+            missed++;
+            continue;
+        }
+        received++;
+        std::cout << std::setw(10) << info.frame << std::setw(12) << info.time << std::setw(10) << info.step << std::setw(14) << mean << std::setw(14) << max << missed << std::endl;
+        missed = 0;
+    }
+    return 0;
+}
@@ -19,13 +19,15 @@ void HelpMessage(){
               << "  -dt <time_step>                          Amount of time that is incremented each propagation\n"
               << "  -F  <expansion_factor>                   Factor that the absolute value of the box expands\n"
               << "  -o  <output_folder>                      Folder that output images are sent to\n"
-              << "  -s  <random_seed>                        Seed that is used to generate initial randomised positions" << std::endl;
+              << "  -s  <random_seed>                        Seed that is used to generate initial randomised positions\n"
+              << "  -shm <ring_name>                         Optional, also publish every step's density projection to a shared memory ring, e.g. /universe_frames" << std::endl;
 }
 
 int main(int argc, char** argv)
 {
     
     std::string output_folder;
+    std::string frame_ring_name;
     uint num_cells;
     uint random_seed;
     double average_particles_per_cell;
@@ -120,6 +122,14 @@ int main(int argc, char** argv)
             random_seed = std::atoi(arg1.c_str());
             random_seed_set = true;
         }
+        else if (arg == "-shm"){
+            if (!frame_ring_name.empty()){
+                std::cerr << "Error - the frame ring has already been set!" << std::endl;
+                HelpMessage();
+                return 1;
+            }
+            frame_ring_name = argv[i + 1];
+        }
         else{ // extra error handling
             std::cerr << "Invalid Flag Detected: " << arg << std::endl;
             HelpMessage();
@@ -141,7 +151,10 @@ int main(int argc, char** argv)
 
     try{
         particle_group particles(mass, num_particles, random_seed);
-        Simulation_ptr = std::make_unique<Simulation>(max_time, time_step, particles, width, num_cells, expansion_factor);
+        Simulation_ptr = std::make_unique<Simulation>(max_time, time_step, std::move(particles), width, num_cells, expansion_factor);
+        if (!frame_ring_name.empty()){
+            Simulation_ptr->set_frame_publishing(frame_ring_name);
+        }
     }
     catch (const std::bad_alloc &e){
         std::cerr << "Error - Memory Overflow: Please use smaller values for -nc <number_of_cells> or -np <average_number_particles_per_cell> arguments!" << std::endl;
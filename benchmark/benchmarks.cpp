@@ -1,6 +1,8 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <array>
+#include <algorithm>
 #include <omp.h>
 #include <chrono>
 #include "Simulation.hpp"
@@ -37,6 +39,163 @@ std::ostream& operator<<(std::ostream &os, const BenchmarkData& b)
     return os;
 }
 
+/**
+ * @brief: Times whole time steps driven phase by phase, with a parallel region per phase, against the same steps taken with Simulation::step, which keeps one parallel region open for the whole step.
+ * @param num_cells: Number of cells per length of the box. Small grids show the fork/join overhead most clearly.
+ * @param num_steps: Number of time steps timed for each variant.
+*/
+std::vector<BenchmarkData> benchmark_step_region(uint num_cells, uint num_steps)
+{
+    uint average_particles_per_cell = 10;
+    uint num_particles = num_cells * num_cells * num_cells * average_particles_per_cell;
+    double mass = 10.0 * 10.0 * 10.0 * 10.0 * 10.0/num_particles;
+    double width = 100.0;
+    int threads = omp_get_max_threads();
+    particle_group particles(mass, num_particles, 42);
+    std::string info = std::to_string(num_steps) + " steps with " + std::to_string(num_cells) + " cells per length of the box and " + std::to_string(num_particles) + " particles.";
+
+    Simulation phase_sim(1.5, 0.01, particle_group(particles), width, num_cells, 1.02);
+    BenchmarkData phase_bench("Time Steps with a Parallel Region per Phase", threads);
+    phase_bench.start();
+    for (uint i = 0; i < num_steps; i++){
+        phase_sim.fill_density_buffer();
+        phase_sim.fill_potential_buffer();
+        phase_sim.update_particles();
+        phase_sim.box_expansion();
+    }
+    phase_bench.finish();
+    phase_bench.info = info;
+
+    Simulation step_sim(1.5, 0.01, std::move(particles), width, num_cells, 1.02); // last use, moved in instead of copied
+    BenchmarkData step_bench("Time Steps with one Persistent Parallel Region", threads);
+    step_bench.start();
+    for (uint i = 0; i < num_steps; i++){
+        step_sim.step();
+    }
+    step_bench.finish();
+    step_bench.info = info;
+
+    return {phase_bench, step_bench};
+}
+
+/**
+ * @brief: Times time steps with the kernels compiled for the grid size against the same steps with the generic kernels (TuningConfiguration::specialise_grid).
+ * @param num_cells: Number of cells per length of the box, one of Simulation::specialised_grid_sizes.
+ * @param num_steps: Number of time steps timed for each variant.
+*/
+std::vector<BenchmarkData> benchmark_grid_specialisation(uint num_cells, uint num_steps)
+{
+    uint average_particles_per_cell = 4;
+    uint num_particles = num_cells * num_cells * num_cells * average_particles_per_cell;
+    double mass = 10.0 * 10.0 * 10.0 * 10.0 * 10.0/num_particles;
+    double width = 100.0;
+    int threads = omp_get_max_threads();
+    particle_group particles(mass, num_particles, 42);
+    std::string info = std::to_string(num_steps) + " steps with " + std::to_string(num_cells) + " cells per length of the box and " + std::to_string(num_particles) + " particles.";
+
+    std::vector<BenchmarkData> benches;
+    for (bool specialise : {false, true}){
+        Simulation sim(1.5, 0.01, particle_group(particles), width, num_cells, 1.02);
+        TuningConfiguration configuration = sim.get_tuning();
+        configuration.specialise_grid = specialise;
+        sim.set_tuning(configuration);
+        sim.step(); // warm up
+        BenchmarkData bench(specialise ? "Time Steps with Kernels Specialised for the Grid Size" : "Time Steps with Generic Kernels", threads);
+        bench.start();
+        for (uint i = 0; i < num_steps; i++){
+            sim.step();
+        }
+        bench.finish();
+        bench.info = info;
+        benches.push_back(bench);
+    }
+    return benches;
+}
+
+std::vector<BenchmarkData> benchmark_grid_layout(uint num_cells, uint num_steps)
+{
+    uint average_particles_per_cell = 4;
+    uint num_particles = num_cells * num_cells * num_cells * average_particles_per_cell;
+    double mass = 10.0 * 10.0 * 10.0 * 10.0 * 10.0/num_particles;
+    double width = 100.0;
+    int threads = omp_get_max_threads();
+    particle_group particles(mass, num_particles, 42);
+    std::string info = std::to_string(num_steps) + " steps with " + std::to_string(num_cells) + " cells per length of the box and " + std::to_string(num_particles) + " particles.";
+
+    std::vector<BenchmarkData> benches;
+    for (GridLayout layout : {GridLayout::row_major, GridLayout::bricked}){
+        Simulation sim(1.5, 0.01, particle_group(particles), width, num_cells, 1.02);
+        TuningConfiguration configuration = sim.get_tuning();
+        configuration.grid_layout = layout;
+        sim.set_tuning(configuration);
+        sim.step(); // warm up
+        BenchmarkData bench(layout == GridLayout::bricked ? "Time Steps with Bricked Particle Grids" : "Time Steps with Row Major Particle Grids", threads);
+        bench.start();
+        for (uint i = 0; i < num_steps; i++){
+            sim.step();
+        }
+        bench.finish();
+        bench.info = info;
+        benches.push_back(bench);
+    }
+    return benches;
+}
+
+/**
+ * @brief: Times time steps with the diagnostics enabled and reports the heap allocations of the steps and of copying the particles into the Simulation,
+ * with the resident memory before and after, and the allocations and largest resident memory of each phase of the steps. The allocation counts are 0 unless the library is built with PM_COUNT_ALLOCATIONS.
+ * @param num_cells: Number of cells per length of the box.
+ * @param num_steps: Number of time steps timed.
+*/
+BenchmarkData benchmark_memory(uint num_cells, uint num_steps)
+{
+    uint average_particles_per_cell = 4;
+    uint num_particles = num_cells * num_cells * num_cells * average_particles_per_cell;
+    double mass = 10.0 * 10.0 * 10.0 * 10.0 * 10.0/num_particles;
+    double width = 100.0;
+    int threads = omp_get_max_threads();
+    particle_group particles(mass, num_particles, 42);
+    resident_memory initial_memory = SampleResidentMemory();
+
+    allocation_counts construction_start = CountAllocations();
+    Simulation sim(1.5, 0.01, particle_group(particles), width, num_cells, 1.02);
+    allocation_counts construction = CountAllocations() - construction_start;
+    sim.set_diagnostics(true);
+    sim.step(); // warm up, the first step sizes the per thread buffers
+    BenchmarkData bench("Time Steps with Allocation and Memory Diagnostics", threads);
+    bench.start();
+    for (uint i = 0; i < num_steps; i++){
+        sim.step();
+    }
+    bench.finish();
+
+    allocation_counts step_total;
+    std::array<allocation_counts, step_phases> phase_totals;
+    std::array<uint64_t, step_phases> phase_resident{};
+    const std::vector<StepStatistics> & statistics = sim.get_run_statistics();
+    for (size_t i = 1; i < statistics.size(); i++){
+        step_total += statistics[i].step_allocations;
+        for (uint phase = 0; phase < step_phases; phase++){
+            phase_totals[phase] += statistics[i].phase_memory[phase].allocations;
+            phase_resident[phase] = std::max(phase_resident[phase], statistics[i].phase_memory[phase].memory.current_bytes);
+        }
+    }
+    std::string phases;
+    for (uint phase = 0; phase < step_phases; phase++){
+        phases += std::string(phase > 0 ? ", " : "") + step_phase_names[phase] + " " + std::to_string(phase_totals[phase].allocations / num_steps) + " allocations of "
+            + std::to_string(phase_totals[phase].bytes / num_steps) + " bytes and " + std::to_string(phase_resident[phase] >> 20) + " MiB";
+    }
+    const resident_memory & final_memory = statistics.back().memory;
+    bench.info = std::to_string(num_steps) + " steps with " + std::to_string(num_cells) + " cells per length of the box and " + std::to_string(num_particles) + " particles. "
+        + (AllocationCountingEnabled() ? "" : "Built without PM_COUNT_ALLOCATIONS, allocations are not counted. ")
+        + "Construction: " + std::to_string(construction.allocations) + " allocations of " + std::to_string(construction.bytes) + " bytes. "
+        + "Steps: " + std::to_string(step_total.allocations / num_steps) + " allocations of " + std::to_string(step_total.bytes / num_steps) + " bytes per step. "
+        + "Resident memory: " + std::to_string(initial_memory.current_bytes >> 20) + " MiB before, " + std::to_string(final_memory.current_bytes >> 20) + " MiB after, "
+        + std::to_string(final_memory.peak_bytes >> 20) + " MiB peak. "
+        + "Per step and phase, with the largest resident memory at the end of the phase: " + phases + ".";
+    return bench;
+}
+
 int main()
 {
     uint average_particles_per_cell = 10;
@@ -62,7 +221,7 @@ int main()
         omp_set_num_threads(i);
         double width = 100.0;
     
-        Simulation sim(1.5, 0.01, particles, width, num_cells, 1.02); // initialise new simulation each time so runs are identical.
+        Simulation sim(1.5, 0.01, particle_group(particles), width, num_cells, 1.02); // initialise new simulation each time so runs are identical.
         
         // density evaluation
         BenchmarkData density_bench("Density Calculation", i);
@@ -119,5 +278,19 @@ int main()
     for (uint i = 0; i < expansion_benches.size(); i++){
         std::cout << expansion_benches[i] << std::endl;
     }
+
+    omp_set_num_threads(max_threads);
+    for (uint small_num_cells : {51, 101}){
+        for (const BenchmarkData & step_bench : benchmark_step_region(small_num_cells, 20)){
+            std::cout << step_bench << std::endl;
+        }
+    }
+    for (const BenchmarkData & grid_bench : benchmark_grid_specialisation(128, 10)){
+        std::cout << grid_bench << std::endl;
+    }
+    for (const BenchmarkData & layout_bench : benchmark_grid_layout(256, 5)){
+        std::cout << layout_bench << std::endl;
+    }
+    std::cout << benchmark_memory(128, 10) << std::endl;
     return 0;
 }
\ No newline at end of file
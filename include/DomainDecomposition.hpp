@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mpi.h>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include "particle.hpp"
+
+/**
+ * @brief: Settings of the particle domain decomposition used by Simulation::set_domain_decomposition.
+*/
+struct decomposition_settings
+{
+    uint rebalance_interval = 20; // steps between load checks, 0 only balances once when the decomposition is set
+    double imbalance_threshold = 1.1; // the particles are redistributed when the slowest rank takes this many times the mean particle time
+    uint curve_level = 5; // the space filling curve is cut at cells of 2^level per box length
+};
+
+/**
+ * @brief: Morton (Z order) key of the curve cell containing a position, interleaving the bits of the cell coordinates so that nearby keys are nearby in space.
+ * @param position: Coordinates within the unit cube.
+ * @param level: Number of bits per coordinate, at most 21.
+*/
+uint64_t MortonKey(const std::array<double, 3> & position, uint level);
+
+/**
+ * @brief: Cuts the space filling curve into one contiguous segment per rank so every segment carries about the same total weight.
+ * @param bin_weights: Summed cost of the particles in each curve cell, in key order.
+ * @param num_ranks: Number of segments.
+ * @return vector<int> rank owning each curve cell, non decreasing along the curve.
+*/
+std::vector<int> PartitionCurve(const std::vector<double> & bin_weights, int num_ranks);
+
+/**
+ * @brief: Sends every particle to its destination rank with a single MPI_Alltoallv. Collective over the communicator.
+ * @param particles: Particles held by this rank.
+ * @param destinations: Destination rank of each particle.
+ * @param communicator: Communicator the ranks belong to.
+ * @return vector<particle> particles received by this rank, ordered by source rank.
+*/
+std::vector<particle> MigrateParticles(const std::vector<particle> & particles, const std::vector<int> & destinations, MPI_Comm communicator);
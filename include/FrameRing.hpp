@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+/**
+ * @brief: Metadata of a frame published to a shared memory frame ring.
+*/
+struct frame_info
+{
+    uint64_t frame; // index of the frame, counting from 0 over the whole run
+    double time; // simulation time of the frame
+    uint64_t step;
+    double box_width;
+    uint64_t size; // pixels per side, pixel (i, j) is stored at i * size + j like ProjectDensity
+};
+
+namespace frame_ring_detail {
+
+constexpr char magic[8] = {'P', 'M', 'F', 'R', 'A', 'M', 'E', '1'};
+
+struct ring_header
+{
+    char magic[8];
+    uint64_t num_slots;
+    uint64_t max_pixels; // capacity of each slot in pixels
+    uint64_t slot_stride; // bytes between consecutive slots
+    std::atomic<uint64_t> published; // number of frames completely written
+    std::atomic<uint64_t> finished; // 1 once the writer has published its last frame
+};
+
+struct slot_header
+{
+    std::atomic<uint64_t> sequence; // seqlock counter, odd while the slot is being written
+    frame_info info;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring counters are shared between processes and must not rely on a lock");
+
+}
+
+/**
+ * @brief: Writer side of a ring of frames in POSIX shared memory, for watching a run live from another process without going through the filesystem.
+ * The segment holds a header and num_slots slots, each guarded by a sequence counter (a seqlock): the writer makes the counter odd, writes the frame and makes
+ * it even again, so the writer never waits for readers. A reader that falls behind misses frames instead of slowing the writer down and detects a frame that
+ * was overwritten while it read it from the counter.
+*/
+class FramePublisher
+{
+public:
+    /**
+     * @brief: Creates the shared memory segment. The segment is removed again when the publisher is destroyed, readers that have it mapped keep their mapping.
+     * Throws std::runtime_error if a segment of that name already exists, it may belong to another run that readers are attached to.
+     * @param name: POSIX shared memory name, a single '/' followed by up to 254 characters without further slashes, e.g. "/universe_frames".
+     * @param num_slots: Number of frames kept in the ring, at least 2.
+     * @param max_pixels: Largest number of pixels in a frame.
+     * @param overwrite: Replaces an existing segment of the same name instead, e.g. one left behind by a run that did not exit cleanly.
+    */
+    FramePublisher(const std::string & name, uint64_t num_slots, uint64_t max_pixels, bool overwrite = false);
+    FramePublisher(const FramePublisher &) = delete;
+    FramePublisher & operator=(const FramePublisher &) = delete;
+    ~FramePublisher();
+
+    /**
+     * @brief: Writes a frame into the next slot, overwriting the oldest frame. Never blocks.
+     * @param pixels: Frame of size * size pixels.
+     * @param size: Pixels per side.
+     * @param time: Simulation time of the frame.
+     * @param step: Number of steps taken.
+     * @param box_width: Box width at the time of the frame.
+    */
+    void publish(const std::vector<double> & pixels, uint64_t size, double time, uint64_t step, double box_width);
+
+    /**
+     * @brief: Writes a frame into the next slot by letting writer fill the slot's pixels in place, so the frame does not need a buffer of its own.
+     * Never blocks. The writer is called with (double * pixels) and must write all size * size of them.
+     * @param size: Pixels per side.
+     * @param time: Simulation time of the frame.
+     * @param step: Number of steps taken.
+     * @param box_width: Box width at the time of the frame.
+    */
+    template <typename Writer>
+    void publish(uint64_t size, double time, uint64_t step, double box_width, Writer && writer)
+    {
+        double * pixels = begin_frame(size, time, step, box_width);
+        writer(pixels);
+        end_frame();
+    }
+
+    /**
+     * @brief: Marks the run as finished so readers can stop waiting for further frames.
+    */
+    void finish();
+
+    uint64_t get_frames_published() const;
+    const std::string & get_name() const;
+
+private:
+    // Makes the next slot odd and writes its metadata, returns its pixels. end_frame makes the slot even again and counts the frame as published.
+    double * begin_frame(uint64_t size, double time, uint64_t step, double box_width);
+    void end_frame();
+
+    std::string name;
+    void * mapping;
+    size_t mapping_length;
+    frame_ring_detail::ring_header * header;
+};
+
+/**
+ * @brief: Reader side of a frame ring created by FramePublisher. Readers map the segment read only and never modify it, so any number of them can attach.
+*/
+class FrameSubscriber
+{
+public:
+    /**
+     * @brief: Maps an existing frame ring. Throws std::runtime_error if no ring of that name exists.
+    */
+    FrameSubscriber(const std::string & name);
+    FrameSubscriber(const FrameSubscriber &) = delete;
+    FrameSubscriber & operator=(const FrameSubscriber &) = delete;
+    ~FrameSubscriber();
+
+    /**
+     * @brief: Number of frames published so far, the newest frame is get_frames_published() - 1.
+    */
+    uint64_t get_frames_published() const;
+
+    bool is_finished() const;
+    uint64_t get_num_slots() const;
+
+    /**
+     * @brief: Gives the visitor direct access to a frame in shared memory, without copying it. The visitor is called with (const frame_info &, const double * pixels)
+     * holding info.size * info.size pixels while the writer may be overwriting the slot, so it must only read and must not trust what it read unless view returns true.
+     * @param frame: Index of the frame.
+     * @return bool true if the frame was intact during the whole visit, false if it is no longer (or not yet) in the ring or was overwritten during the visit.
+    */
+    template <typename Visitor>
+    bool view(uint64_t frame, Visitor && visitor) const
+    {
+        const frame_ring_detail::slot_header * slot = slot_of(frame);
+        uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        frame_info info = slot->info; // may be torn, but is checked against the slot's capacity so the visitor never reads past the slot
+        if (before & 1 || info.frame != frame || frame >= get_frames_published() || info.size * info.size > header->max_pixels){
+            return false;
+        }
+        visitor(info, reinterpret_cast<const double *>(slot + 1));
+        std::atomic_thread_fence(std::memory_order_acquire); // the reads of the visit may not move past the second load of the counter
+        return slot->sequence.load(std::memory_order_relaxed) == before;
+    }
+
+    /**
+     * @brief: Copies a frame out of the ring.
+     * @param frame: Index of the frame.
+     * @param info: Receives the frame's metadata.
+     * @param pixels: Receives the pixels.
+     * @return bool true if the copy is a complete frame, see view.
+    */
+    bool read(uint64_t frame, frame_info & info, std::vector<double> & pixels) const;
+
+private:
+    const frame_ring_detail::slot_header * slot_of(uint64_t frame) const;
+
+    const void * mapping;
+    size_t mapping_length;
+    const frame_ring_detail::ring_header * header;
+};
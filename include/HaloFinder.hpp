@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <string>
+#include <cstdint>
+#include "particle.hpp"
+
+/**
+ * @brief: Summary of a single friends-of-friends group of particles.
+*/
+struct halo
+{
+    uint64_t num_members;
+    double mass;
+    std::array<double, 3> centre; // centre of mass within the unit cube, accounts for groups that wrap around the periodic boundaries
+    std::array<double, 3> velocity; // mean velocity of the members
+};
+
+/**
+ * @brief: Parallel friends-of-friends group finder. Particles closer than the link length (periodic distance) are linked and every connected set of linked particles forms a group.
+ * Particles are binned into the simulation cells with the cell index cache, so only the 27 neighbouring cells of each cell are searched. Links are merged with a lock free concurrent union-find.
+ * @param particles: Particle group to search. Positions within the unit cube.
+ * @param cell_indices: Flat cell index k + n * (j + n * i) of every particle, as kept by Simulation.
+ * @param num_cells: Number of cells per length of the box.
+ * @param link_length: Linking length in units of the cell width. Must be larger than 0 and no more than 1 so that all friends are in neighbouring cells.
+ * @param min_members: Smallest group that is reported as a halo.
+ * @param velocity_scale: Factor that converts the stored particle velocities into physical velocities, see Simulation.
+ * @return vector<halo> halos sorted from most to least massive.
+ */
+std::vector<halo> friendsOfFriends(const particle_group & particles, const std::vector<uint32_t> & cell_indices, uint num_cells, double link_length, uint min_members, double velocity_scale = 1);
+
+/**
+ * @brief: Saves a halo catalogue to a csv file with one row per halo: number of members, mass, centre and mean velocity.
+ * @param halos: Halos to be saved, as returned by friendsOfFriends.
+ * @param filename: string of the file path and name that the csv will be saved to.
+*/
+void SaveHaloCatalogue(const std::vector<halo> & halos, const std::string & filename);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include "particle.hpp"
+
+/**
+ * @brief: Saves the particles as a spatially indexed snapshot. The unit box is divided into 2^level blocks per side, the particles are written ordered by the
+ * Morton key (see MortonKey) of their block and an offset table gives the first particle of every block, so a reader can find the particles of any region
+ * without reading the rest of the file. Layout: one page of header (magic "PMSNAP01", number of particles, mass, level, table offset, data offset),
+ * the offset table of 8^level + 1 unsigned 64 bit particle indices and, starting on a page boundary, the raw particle records.
+ * @param particles: Particle group to be saved, positions within the unit cube.
+ * @param filename: string of the file path and name that the snapshot will be saved to.
+ * @param level: Number of times the box is halved along each axis, between 1 and 8.
+*/
+void SaveIndexedSnapshot(const particle_group & particles, const std::string & filename, uint level = 4);
+
+/**
+ * @brief: Read only memory mapped view of a snapshot written by SaveIndexedSnapshot. Queries only touch the pages holding the blocks that overlap the query,
+ * the kernel reads no further ahead.
+*/
+class IndexedSnapshot
+{
+public:
+    /**
+     * @brief: Opens and maps a snapshot.
+     * @param filename: Path of the snapshot file.
+    */
+    IndexedSnapshot(const std::string & filename);
+    IndexedSnapshot(const IndexedSnapshot &) = delete;
+    IndexedSnapshot & operator=(const IndexedSnapshot &) = delete;
+    ~IndexedSnapshot();
+
+    uint64_t size() const;
+    double get_mass() const;
+    uint get_level() const;
+
+    /**
+     * @brief: Particles of one block, in file order.
+     * @param key: Morton key of the block.
+     * @return pair of the first and one past the last particle of the block.
+    */
+    std::pair<const particle *, const particle *> block(uint64_t key) const;
+
+    /**
+     * @brief: Returns every particle with lower <= position < upper on all three axes. Only the blocks overlapping the box are read.
+     * @param lower: Lower corner of the box in the unit cube.
+     * @param upper: Upper corner of the box in the unit cube.
+    */
+    std::vector<particle> query_box(const std::array<double, 3> & lower, const std::array<double, 3> & upper) const;
+
+private:
+    int file_descriptor;
+    void * mapping;
+    size_t mapping_length;
+    uint64_t num_particles;
+    double mass;
+    uint level;
+    const uint64_t * offsets; // 8^level + 1 entries
+    const particle * particles;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief: Heap allocations made through operator new, counted since the start of the process. Only counted when the library is built with the
+ * PM_COUNT_ALLOCATIONS CMake option, which replaces the global operator new and delete, otherwise every count stays 0.
+*/
+struct allocation_counts
+{
+    uint64_t allocations = 0;
+    uint64_t bytes = 0; // requested bytes, not reduced by deallocations
+
+    allocation_counts operator-(const allocation_counts & start) const
+    {
+        return allocation_counts{allocations - start.allocations, bytes - start.bytes};
+    }
+
+    allocation_counts & operator+=(const allocation_counts & other)
+    {
+        allocations += other.allocations;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+/**
+ * @brief: Resident set size of the process, read from /proc/self/status. Both are 0 where /proc is not available.
+*/
+struct resident_memory
+{
+    uint64_t current_bytes = 0; // VmRSS
+    uint64_t peak_bytes = 0; // VmHWM, the largest resident set size so far
+};
+
+/**
+ * @brief: Whether the library was built with PM_COUNT_ALLOCATIONS.
+*/
+bool AllocationCountingEnabled();
+
+/**
+ * @brief: Allocations made by every thread so far, the difference of two calls gives the allocations of the code between them.
+*/
+allocation_counts CountAllocations();
+
+/**
+ * @brief: Samples the current and peak resident set size.
+*/
+resident_memory SampleResidentMemory();
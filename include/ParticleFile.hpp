@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include "particle.hpp"
+
+/**
+ * @brief: Particle population stored in a binary file and memory mapped, for runs with more particles than fit in memory.
+ * The file holds a one page header (magic, number of particles, particle mass) followed by the raw particle records. The mapping is shared,
+ * so updates made through data() are written back to the file by the kernel and the file always holds the latest particle state.
+ * Particles are meant to be processed in large consecutive chunks: prefetch asks the kernel to start reading a chunk ahead of time and
+ * release drops the pages of a chunk that has been processed so the resident set stays bounded.
+*/
+class MappedParticleFile
+{
+public:
+    /**
+     * @brief: Opens and maps an existing particle file for reading and writing.
+     * @param filename: Path of a file written by WriteParticleFile or CreateUniformParticleFile.
+    */
+    MappedParticleFile(const std::string & filename);
+    MappedParticleFile(const MappedParticleFile &) = delete;
+    MappedParticleFile & operator=(const MappedParticleFile &) = delete;
+    ~MappedParticleFile();
+
+    uint64_t size() const;
+    double get_mass() const;
+    particle * data();
+    const particle * data() const;
+
+    /**
+     * @brief: Starts asynchronous read ahead of the particles [begin, end) so they are resident by the time they are processed.
+    */
+    void prefetch(uint64_t begin, uint64_t end) const;
+
+    /**
+     * @brief: Drops the pages holding particles [begin, end) from the resident set. Modified pages are kept in the page cache until written back.
+    */
+    void release(uint64_t begin, uint64_t end) const;
+
+private:
+    int file_descriptor;
+    void * mapping;
+    size_t mapping_length;
+    uint64_t num_particles;
+    double mass;
+    particle * particles;
+};
+
+/**
+ * @brief: Writes a particle group to a particle file that can be mapped with MappedParticleFile.
+ * @param particles: Particle group to be saved.
+ * @param filename: string of the file path and name that the particles will be saved to.
+*/
+void WriteParticleFile(const particle_group & particles, const std::string & filename);
+
+/**
+ * @brief: Creates a particle file of uniformly distributed particles at rest without holding the population in memory. Particles are generated
+ * in the same order and with the same generator as particle_group(mass, num_particles, random_seed), so both give identical particles.
+ * @param filename: string of the file path and name that the particles will be saved to.
+ * @param mass: Mass of each particle.
+ * @param num_particles: Number of particles to be created, 64 bit so that populations larger than memory can be described.
+ * @param random_seed: Random seed applied to the STL default random number generator.
+*/
+void CreateUniformParticleFile(const std::string & filename, double mass, uint64_t num_particles, uint random_seed);
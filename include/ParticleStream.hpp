@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief: Lightcone output of Simulation::run. The past lightcone of an observer at the end of the run is a spherical shell that recedes towards the observer,
+ * its radius is light_speed * (t_max - t). Every particle is written once, when the shell sweeps over it, with its position and time interpolated to the crossing.
+*/
+struct lightcone_settings
+{
+    std::array<double, 3> observer = {0.5, 0.5, 0.5}; // position of the observer in the unit box
+    double light_speed = 1; // box lengths per unit of simulation time
+    double max_radius = 0.5; // crossings further out are not written, beyond half the box a particle has several periodic images
+};
+
+/**
+ * @brief: Region of interest output of Simulation::run. The particles inside an axis aligned box of the unit cube are written every interval steps.
+*/
+struct region_settings
+{
+    std::array<double, 3> lower = {0, 0, 0}; // the region holds positions with lower <= position < upper on every axis
+    std::array<double, 3> upper = {1, 1, 1};
+    uint interval = 1; // steps between outputs
+};
+
+/**
+ * @brief: Compact record of a particle written to a particle stream, single precision to halve the output volume.
+*/
+struct streamed_particle
+{
+    double time; // simulation time of the record, the crossing time for lightcones
+    std::array<float, 3> position; // in the unit box
+    std::array<float, 3> velocity; // physical velocity
+};
+
+/**
+ * @brief: Binary file of streamed particle records. The file starts with a header (magic "PMSTRM01", the kind of output and the settings it was written with)
+ * followed by the records back to back, in no particular order. The number of records follows from the file size.
+*/
+class ParticleStream
+{
+public:
+    enum class kind : uint32_t { lightcone = 0, region = 1 };
+    static constexpr size_t num_parameters = 7; // observer, light speed and maximum radius, or lower and upper corners and interval
+
+    /**
+     * @brief: Creates the file and writes its header.
+     * @param filename: string of the file path and name that the records will be saved to.
+     * @param output_kind: Kind of output the records belong to.
+     * @param parameters: Settings of the output, see num_parameters.
+    */
+    ParticleStream(const std::string & filename, kind output_kind, const std::array<double, num_parameters> & parameters);
+
+    /**
+     * @brief: Appends records to the file. Not thread safe, Simulation serialises the flushes of its per thread buffers.
+     * Does not throw as it is called inside parallel regions, failures are reported by good().
+    */
+    void write(const std::vector<streamed_particle> & records);
+
+    bool good() const;
+    uint64_t get_records_written() const;
+    const std::string & get_filename() const;
+
+private:
+    std::ofstream file;
+    std::string filename;
+    uint64_t records_written;
+};
+
+/**
+ * @brief: Reads every record of a particle stream file.
+ * @param filename: Path of a file written by ParticleStream.
+ * @param output_kind: Receives the kind of output stored in the file.
+ * @return vector<streamed_particle> records in file order.
+*/
+std::vector<streamed_particle> ReadParticleStream(const std::string & filename, ParticleStream::kind & output_kind);
@@ -1,8 +1,182 @@
 #pragma once
 #include "particle.hpp"
+#include "HaloFinder.hpp"
+#include "ParticleFile.hpp"
+#include "DomainDecomposition.hpp"
+#include "FrameRing.hpp"
+#include "ParticleStream.hpp"
+#include "IndexedSnapshot.hpp"
+#include "MemoryProfile.hpp"
+#include "Utils.hpp"
 #include <fftw3.h>
 #include <vector>
+#include <array>
 #include <optional>
+#include <cstdint>
+#include <string>
+#include <iterator>
+#include <cstddef>
+#include <memory>
+
+/**
+ * @brief: Ways of scattering particle densities into the density buffer.
+ * atomic: every particle is added to its cell with an atomic update.
+ * coalesced: each thread sums runs of consecutive particles in the same cell and issues one atomic update per run. Fastest when the particles are sorted by cell.
+ * private_grids: each thread deposits into its own copy of the grid without atomics and the copies are summed afterwards. Costs one extra grid per thread.
+*/
+enum class DepositionStrategy { atomic, coalesced, private_grids };
+
+/**
+ * @brief: Memory layout of the grids the particles scatter into and gather from (the deposition grids, the acceleration and the cell index cache).
+ * row_major: cell (i, j, k) is stored at k + n * (j + n * i), the layout of the FFT buffers.
+ * bricked: the grid is tiled into bricks of Simulation::brick_length^3 cells stored one after the other, so cells that are neighbours along any axis share a few
+ * pages and cache lines. Converted to and from the FFT layout inside the passes that clear the deposition grids and apply the stencil. Needs the particles in memory.
+*/
+enum class GridLayout { row_major, bricked };
+
+/**
+ * @brief: Kernel strategies and thread counts used by Simulation::step. Chosen by Simulation::autotune or set manually.
+*/
+struct TuningConfiguration
+{
+    DepositionStrategy deposition = DepositionStrategy::atomic;
+    uint sort_interval = 0; // particles are sorted by cell every sort_interval steps, 0 never sorts
+    unsigned fftw_flags = FFTW_MEASURE;
+    int num_threads = 0; // 0 uses omp_get_max_threads()
+    bool specialise_grid = true; // run the kernels compiled for the grid size when it is one of Simulation::specialised_grid_sizes
+    GridLayout grid_layout = GridLayout::row_major;
+    // incremental deposition keeps the number of particles in every cell between steps and only moves the particles that changed cell, see Simulation::deposit_counts
+    bool incremental_deposition = false;
+    uint full_deposition_interval = 50; // every full_deposition_interval-th deposition counts every particle again, 0 only when required
+    double max_moved_fraction = 0.2; // a deposition after more than this fraction of the particles changed cell counts every particle again
+
+    /**
+     * @brief: Human readable summary of the configuration, printed by the autotuner so a run can be reproduced.
+    */
+    std::string to_string() const;
+};
+
+/**
+ * @brief: Lightweight read only view of the simulation state after a time step. Refers to the live buffers of the Simulation instead of copying them,
+ * so it is only valid until the simulation is advanced again.
+*/
+struct StepView
+{
+    double time; // simulation time reached by the step
+    uint64_t step; // number of steps taken so far
+    double box_width;
+    uint num_cells;
+    const particle_group & particles; // velocities are stored relative to velocity_scale
+    double velocity_scale; // physical velocity = stored velocity * velocity_scale
+    const std::vector<uint32_t> & cell_indices;
+    const fftw_complex * density; // density the step's forces were evaluated from
+    const fftw_complex * potential;
+};
+
+constexpr uint density_histogram_bins = 16;
+constexpr double density_histogram_start = -1; // log10 of the density over the mean at the lower edge of the first bin
+constexpr double density_histogram_width = 0.25; // dex
+
+/**
+ * @brief: Clustering statistics of a deposited density grid, in units of the mean density. The variance is summed over the Fourier modes in the Green's function
+ * pass (Parseval) and the rest is accumulated while the ghost layer copy reads the density rows for the potential energy, so no extra pass over the grid is needed.
+*/
+struct DensityStatistics
+{
+    double variance = 0; // of the density contrast, density / mean - 1
+    double min_density = 0;
+    double max_density = 0;
+    uint64_t empty_cells = 0;
+    std::array<uint64_t, density_histogram_bins> histogram{}; // one point PDF of log10(density / mean), the outer bins hold everything beyond them, empty cells are left out
+};
+
+/**
+ * @brief: Phases of a time step that the memory profile of StepStatistics is split into. The density is deposited, transformed and multiplied by the
+ * Green's function (fft, including the sum over the ranks), its potential copied into the ghost layers and differentiated (gradient), and the particles pushed.
+*/
+enum class StepPhase { deposit, fft, gradient, push };
+constexpr uint step_phases = 4;
+constexpr std::array<const char *, step_phases> step_phase_names = {"deposit", "fft", "gradient", "push"};
+
+/**
+ * @brief: Heap allocations and resident memory of one phase of a time step, sampled by the master thread at the barrier that ends the phase.
+*/
+struct PhaseMemory
+{
+    allocation_counts allocations; // made during the phase, summed over the substeps of a block step
+    resident_memory memory; // when the phase last ended in the step, zero for phases the step skipped (e.g. a reused force field)
+};
+
+/**
+ * @brief: Conservation diagnostics of one time step, recorded by Simulation when diagnostics are enabled.
+ * Particle sums are accumulated inside the kick and drift loop and the potential energy inside the ghost layer copy, so no extra pass over the particles is needed.
+*/
+struct StepStatistics
+{
+    double time; // simulation time reached by the step
+    uint64_t step;
+    std::array<double, 3> momentum; // total momentum of the particles at the end of the step
+    double kinetic_energy; // at the end of the step
+    double potential_energy; // 1/2 sum of density * potential * cell volume over the grid the step's forces were evaluated from
+    double max_speed;
+    uint64_t local_particles; // particles held by this rank
+    double particle_time; // seconds this rank spent depositing and pushing its particles
+    double load_imbalance; // slowest particle time over the mean across ranks, 1 without a domain decomposition
+    DensityStatistics density; // of the grid the step's forces were evaluated from (the first substep's with block time steps, like potential_energy), zero for steps taken with update_particles
+    allocation_counts step_allocations; // heap allocations made by this rank during the step, zero unless built with PM_COUNT_ALLOCATIONS
+    allocation_counts output_allocations; // made by run() writing the images, renders, frames and halo catalogues that follow the step
+    resident_memory memory; // resident set size of the process at the end of the step
+    std::array<PhaseMemory, step_phases> phase_memory; // indexed by StepPhase, zero for steps taken with update_particles
+};
+
+/**
+ * @brief: Saves run statistics to a csv file with one row per step.
+ * @param statistics: Statistics to be saved, as returned by Simulation::get_run_statistics.
+ * @param filename: string of the file path and name that the csv will be saved to.
+*/
+void SaveRunStatistics(const std::vector<StepStatistics> & statistics, const std::string & filename);
+
+/**
+ * @brief: Saves the density statistics of every step to a csv file with one row per step: time, step, variance, minimum and maximum density, empty cells
+ * and the counts of the histogram bins, the first bin starting at log10(density / mean) = density_histogram_start.
+ * @param statistics: Statistics to be saved, as returned by Simulation::get_run_statistics.
+ * @param filename: string of the file path and name that the csv will be saved to.
+*/
+void SaveDensityStatistics(const std::vector<StepStatistics> & statistics, const std::string & filename);
+
+/**
+ * @brief: Hierarchical block time steps (see Simulation::set_block_time_steps). Level l advances its particles with time_step / 2^l, so the particles in dense,
+ * fast regions take several small steps while the rest of the box takes one.
+*/
+struct block_step_settings
+{
+    uint max_level = 0; // each step is split into 2^max_level substeps, 0 gives every particle the global time step
+    double cell_fraction = 0.25; // largest fraction of a cell a particle may cross, or fall from rest under its acceleration, in one of its steps
+};
+
+/**
+ * @brief: Reuse of the mesh forces between steps (see Simulation::set_force_reuse).
+*/
+struct force_reuse_settings
+{
+    uint max_reuse = 0; // steps a solved acceleration field may be reused for before the next solve, 0 solves every step
+    double max_displacement = 0.25; // a solve is forced once a particle may have moved this many cells since the last solve
+    bool extrapolate = false; // extrapolate the field linearly from the last two solves instead of holding it, costs three more grids
+};
+
+/**
+ * @brief: Parameters a branch changes when it continues from the state of another simulation (see Simulation::branch). Unset parameters are inherited.
+*/
+struct branch_parameters
+{
+    std::optional<double> time_max;
+    std::optional<double> time_step;
+    std::optional<double> expansion_factor;
+    double position_perturbation = 0; // largest random displacement of each particle along each axis, in units of the cell width, 0 leaves the particles unchanged
+    uint perturbation_seed = 0;
+};
+
+class StepRange;
 
 /**
  * @brief: Class that takes an initial distribution of particles and then uses the particle mesh method to simulate the trajectories of N bodies due to the resultant gravitational field.
@@ -15,11 +189,33 @@ public:
      * @brief Constructor for Simulation class. Allocates memory in heap for FFT plans for forward and backwards fast fourier transform and respective buffers. Initialises member variables of class.
      * @param t_max: Time at which Simulation terminates.
      * @param t_step: Timestep which separates each moment that the Simulation evaluates particle positions for.
-     * @param collection: Particle_group instance that contains the initial distribution of particles to be passed to the Simulation.
+     * @param collection: Particle_group instance that contains the initial distribution of particles to be passed to the Simulation. The Simulation takes ownership,
+     * pass it with std::move or as a temporary. A group that is still needed has to be copied explicitly, e.g. particle_group(particles), so no copy happens by accident.
      * @param num_cells: Number of cells per length of the cubic box the Simulation runs in.
      * @param e_factor: Expansion factor - Factor by which the simulation is scaled by every iteration.
     */
-    Simulation(double t_max, double t_step, particle_group collection, double W, uint num_cells, double e_factor);  
+    Simulation(double t_max, double t_step, particle_group && collection, double W, uint num_cells, double e_factor);  
+
+    /**
+     * @brief: Standard production grid sizes the hot kernels are compiled for with a constant number of cells, other sizes run the generic kernels.
+    */
+    static constexpr std::array<uint, 6> specialised_grid_sizes = {64, 96, 101, 128, 201, 256};
+
+    /**
+     * @brief: Cells per side of a brick in GridLayout::bricked, grids whose size is not a multiple are padded to whole bricks.
+    */
+    static constexpr uint brick_length = 8;
+
+    /**
+     * @brief Constructor for an out of core Simulation whose particles stay in a memory mapped particle file (see MappedParticleFile) that is updated in place.
+     * Particles are streamed through in chunks, reading ahead the next chunk while the current one is processed. The push of each step deposits the particles
+     * into the density of the following step, so a step makes a single pass over the file. No cell index cache is kept.
+     * Only step based driving (run, step, advance_to, steps) and the grid phases are available: the particle collection and cell indices of the Simulation stay empty,
+     * and update_particles, box_expansion, sort_particles, autotune, halos and particle renders throw. Sorting in the tuning configuration is ignored.
+     * @param particle_file_path: Path of a particle file written by WriteParticleFile or CreateUniformParticleFile.
+     * @param chunk_particles: Number of particles processed per chunk, sets the resident memory used for particles.
+    */
+    Simulation(double t_max, double t_step, const std::string & particle_file_path, double W, uint num_cells, double e_factor, uint64_t chunk_particles = 1 << 22);
     
     /**
      * @brief Run a particle mesh simulation from t=0 to t_max in slices separated by dt.
@@ -27,6 +223,182 @@ public:
      */
     void run(std::optional<std::string> output_folder = std::nullopt);
 
+    /**
+     * @brief: Advances the simulation by one time step. Equivalent to calling fill_density_buffer, fill_potential_buffer, update_particles and box_expansion in turn,
+     * but every phase runs inside a single OpenMP parallel region so the team of threads is only forked and joined once per step.
+    */
+    void step();
+
+    /**
+     * @brief: Takes time steps until the simulation time reaches or passes t. Does nothing if the simulation is already at or beyond t.
+     * @param t: Simulation time to advance to.
+    */
+    void advance_to(double t);
+
+    /**
+     * @brief: Generator style range that takes one time step each time it is advanced and yields a StepView of the state after that step.
+     * Iteration stops once the simulation time reaches t_end, leaving the simulation there so a later range or call to run resumes from the same state.
+     * Usage: for (const StepView & view : sim.steps(1.0)){ ... }
+     * @param t_end: Simulation time at which the range ends.
+    */
+    StepRange steps(double t_end);
+
+    /**
+     * @brief: View of the current simulation state, see StepView.
+    */
+    StepView view() const;
+
+    /**
+     * @brief: Runs the friends-of-friends halo finder on the current particle distribution, see friendsOfFriends.
+     * @param link_length: Linking length in units of the cell width.
+     * @param min_members: Smallest group that is reported as a halo.
+    */
+    std::vector<halo> find_halos(double link_length = 0.2, uint min_members = 20) const;
+
+    /**
+     * @brief: Enables halo catalogues in run(). Catalogues are saved as csv files next to the images every interval steps and always for the final state.
+     * @param link_length: Linking length in units of the cell width.
+     * @param min_members: Smallest group that is reported as a halo.
+     * @param interval: Number of steps between catalogues, 0 only saves the final state.
+    */
+    void set_halo_output(double link_length, uint min_members, uint interval = 0);
+
+    /**
+     * @brief: Configures the density images saved by run().
+     * @param colour_map: Colour map applied to the projected densities.
+     * @param pyramid: If true every frame is saved as a pyramid of block averaged binary ppm images (see SavePyramidToFiles) instead of a single full resolution image.
+    */
+    void set_image_output(const ColourMap & colour_map, bool pyramid = false);
+
+    /**
+     * @brief: Makes run() also save a particle splatting render (see RenderParticles) with every density image, at a resolution independent of the number of cells.
+     * Renders use the colour map set with set_image_output.
+     * @param settings: Resolution, smoothing and scale of the renders.
+    */
+    void set_render_output(const render_settings & settings);
+
+    /**
+     * @brief: Distributes the particles over the ranks of a communicator. Collective, every rank constructs its Simulation with the same parameters and its share
+     * (possibly none) of the initial particles. The mesh is replicated: each rank deposits its own particles, the densities are summed with MPI_Allreduce and every
+     * rank solves for the potential and pushes its own particles. Ranks own contiguous segments of a Morton space filling curve weighted by the measured cost of
+     * their particles, so particles that are close in space stay on the same rank. Every rebalance_interval steps the load imbalance is checked and if it is above
+     * the threshold the curve is cut again and the particles are migrated with MPI_Alltoallv.
+     * get_particle_collection returns the particles of this rank. Images are saved by rank 0, renders are summed over the ranks and halos are not available.
+     * OpenMP threads call MPI from the master thread only, so MPI must be initialised with at least MPI_THREAD_FUNNELED.
+     * @param communicator: Communicator of the ranks taking part.
+     * @param settings: Rebalancing interval, imbalance threshold and curve resolution.
+    */
+    void set_domain_decomposition(MPI_Comm communicator, const decomposition_settings & settings = decomposition_settings());
+
+    /**
+     * @brief: Makes run() publish the projected density into a shared memory frame ring (see FramePublisher) every interval steps, independent of the images
+     * saved to the output folder, so a viewer can follow the run live. The ring is created when run() starts and removed when the Simulation is destroyed.
+     * Publishing never waits for readers. With a domain decomposition only rank 0 publishes.
+     * @param name: POSIX shared memory name of the ring, e.g. "/universe_frames".
+     * @param num_slots: Number of frames kept in the ring.
+     * @param interval: Number of steps between frames.
+     * @param overwrite: Replace an existing segment of the same name, otherwise run() throws if the name is taken.
+    */
+    void set_frame_publishing(const std::string & name, uint num_slots = 8, uint interval = 1, bool overwrite = false);
+
+    /**
+     * @brief: Makes run() stream the particles crossing the past lightcone of an observer to a compact binary file (see ParticleStream) next to the images.
+     * Crossings are detected during the particle push, so no snapshot of the particles is needed.
+     * @param settings: Observer position, speed of light in box lengths per unit time and largest radius written.
+    */
+    void set_lightcone_output(const lightcone_settings & settings);
+
+    /**
+     * @brief: Makes run() stream the particles inside an axis aligned region to a compact binary file next to the images every interval steps. Can be called
+     * several times, each region gets its own file. Particles are selected during the particle push, so the output is proportional to the particles in the region.
+     * @param settings: Corners of the region in the unit box and steps between outputs.
+    */
+    void add_region_output(const region_settings & settings);
+
+    /**
+     * @brief: Enables hierarchical block time steps. At the start of every step each particle is given the lowest level l whose step time_step / 2^l moves it
+     * by at most cell_fraction of a cell, judged from its velocity and the acceleration of its cell, and the particles are bucketed by level so every level is a
+     * contiguous range. The step is split into 2^max_level substeps, each solving for the forces of the current positions, and a substep only kicks and drifts the
+     * levels that are due (level l on every 2^(max_level - l)-th substep), the other particles wait at their last position. The box expands once per step.
+     * Not available with lightcone or region outputs, whose records assume every particle moves once per step.
+     * @param settings: Deepest level and the fraction of a cell that sets the levels.
+    */
+    void set_block_time_steps(const block_step_settings & settings);
+
+    /**
+     * @brief: Number of particles on each time step level during the last step, empty unless block time steps are enabled.
+    */
+    const std::vector<uint64_t> & get_level_counts() const;
+
+    /**
+     * @brief: Lets step() skip the deposition, FFTs and gradient and push the particles with the acceleration field of an earlier step. The field only changes
+     * because the particles move and the box expands: the expansion is exact, the acceleration of a fixed density scales with 1 / W^2, and the movement is bounded
+     * by summing the largest displacement of any particle over the steps since the last solve. A new field is solved once that bound exceeds max_displacement cells
+     * or the field has been reused max_reuse times. On reused steps the density and potential buffers still hold the fields of the last solve.
+     * Not available with block time steps or when the particles are streamed from a file.
+     * @param settings: Largest number of reuses, displacement bound in cells and whether to extrapolate the field.
+    */
+    void set_force_reuse(const force_reuse_settings & settings);
+
+    /**
+     * @brief: Number of steps that solved for the forces since the simulation was created.
+    */
+    uint64_t get_force_solves() const;
+
+    /**
+     * @brief: Enables or disables the per step conservation diagnostics (momentum, kinetic and potential energy and maximum speed), together with the density
+     * statistics, heap allocations and resident memory of each step. Off by default.
+     * When enabled run() also saves the statistics as a csv file next to the images.
+    */
+    void set_diagnostics(bool enabled);
+
+    /**
+     * @brief: Statistics of every step taken while diagnostics were enabled. Steps taken with update_particles are recorded before box_expansion is applied.
+    */
+    const std::vector<StepStatistics> & get_run_statistics() const;
+
+    /**
+     * @brief: Saves the complete dynamical state (parameters, time, step count, box width and particles) to a binary checkpoint file, so several runs can continue
+     * from it with load_checkpoint without recomputing the history that led to it. Output settings (images, halos, renders, diagnostics, tuning) are not saved.
+     * Continuing from a checkpoint gives the same particles as continuing the simulation that saved it.
+     * @param filename: string of the file path and name that the checkpoint will be saved to.
+    */
+    void save_checkpoint(const std::string & filename) const;
+
+    /**
+     * @brief: Saves the particles, with physical velocities, as a spatially indexed snapshot (see SaveIndexedSnapshot) that IndexedSnapshot and
+     * Correlation/read_snapshot.py can query by subvolume. When the domain is decomposed every rank saves its own particles, pass a different filename per rank.
+     * @param filename: string of the file path and name that the snapshot will be saved to.
+     * @param level: Number of times the box is halved along each axis for the index, between 1 and 8.
+    */
+    void save_snapshot(const std::string & filename, uint level = 4) const;
+
+    /**
+     * @brief: Creates a simulation from a checkpoint written by save_checkpoint.
+     * @param filename: Path of the checkpoint file.
+    */
+    static std::unique_ptr<Simulation> load_checkpoint(const std::string & filename);
+
+    /**
+     * @brief: Clones the simulation in memory and applies the branch parameters to the clone, which continues from the current state while this simulation is unchanged.
+     * The clone copies the output, tuning and diagnostics settings (including the statistics recorded so far) but does not publish frames. A force field held
+     * for reuse (see set_force_reuse) is copied too, unless the branch perturbs the particles or changes the time step, in which case the branch solves on its first step.
+     * A branch without changed parameters continues exactly like this simulation.
+     * @param parameters: Parameters that differ in the branch and an optional random perturbation of the particle positions.
+    */
+    std::unique_ptr<Simulation> branch(const branch_parameters & parameters = branch_parameters()) const;
+
+    /**
+     * @brief: Runs one branch (see branch) for each set of parameters from the current state, one after another with all threads, so the shared history is only computed once.
+     * Each branch is run with run() and its output is saved to <output_folder>/branch_<index>. This simulation is left unchanged.
+     * @param branches: Parameters of every branch.
+     * @param output_folder: Optional folder the outputs of the branches are saved in.
+    */
+    void run_ensemble(const std::vector<branch_parameters> & branches, std::optional<std::string> output_folder = std::nullopt) const;
+
+    double get_time() const;
+    uint64_t get_steps_taken() const;
+
     /**
      * @brief: Calculates the density of every cell in the cubic box. Stores in the density buffer array with type fftw_complex.
     */
@@ -37,7 +409,41 @@ public:
      * Evaluates Fast Fourier Transform of density buffer, applies factors and performs back transformation.
     */
     void fill_potential_buffer();
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> calculate_gradient(const fftw_complex * potential);
+
+    /**
+     * @brief: Evaluates the acceleration due to gravity (negative gradient of the potential) in every cell and stores it in three component arrays indexed by field_index.
+     * The potential is first copied into a grid with ghost layers holding the periodic neighbours so that the finite difference stencil is a unit stride sweep along k.
+     * @param potential: Potential of every cell in the cubic box. Imaginary component ignored.
+    */
+    void calculate_gradient(const fftw_complex * potential);
+
+    /**
+     * @brief: Selects the order of the central finite difference used for the gradient.
+     * @param order: 2 for the three point stencil (default) or 4 for the five point stencil that uses both ghost layers.
+    */
+    void set_gradient_order(uint order);
+
+    /**
+     * @brief: Reorders the particles (and their cached cell indices) so that particles in the same cell are contiguous in memory, using a counting sort on the cell index cache.
+    */
+    void sort_particles();
+
+    /**
+     * @brief: Applies a tuning configuration to all following steps. The FFT plans are rebuilt if the planner flags change.
+    */
+    void set_tuning(const TuningConfiguration & configuration);
+    const TuningConfiguration & get_tuning() const;
+
+    /**
+     * @brief: Chooses the fastest tuning configuration for this machine, grid size and particle count and applies it.
+     * If profile_path names a tuning profile that already holds an entry for (host, number of cells, number of particles) that entry is used directly.
+     * Otherwise every option is timed over a few steps, one option at a time, and the particle state is restored after each trial. The result is appended to the profile.
+     * The chosen configuration is printed so that production runs can be reproduced with set_tuning.
+     * @param trial_steps: Number of steps timed for each candidate. The median step time is compared.
+     * @param profile_path: Optional path of the cached tuning profile.
+     * @returns: The configuration that was applied.
+    */
+    TuningConfiguration autotune(uint trial_steps = 3, std::optional<std::string> profile_path = std::nullopt);
     
     /**
      * @brief: Given cell graviational potential calculates the acceleration due to gravity in every direction in each cell of the box.
@@ -46,7 +452,8 @@ public:
     void update_particles();
     
     /**
-     * @brief: Applies expansion factor to width of box and velocity of every particle.
+     * @brief: Applies expansion factor to width of box and velocity of every particle. Velocities are stored relative to a global scale factor,
+     * so only the scale factor is divided by the expansion factor and no particle is touched.
     */
     void box_expansion();
 
@@ -57,19 +464,294 @@ public:
 
     const fftw_complex * get_density_buffer() const;
     const fftw_complex * get_potential_buffer() const;
+    /**
+     * @brief: Returns the particles with physical velocities. If the velocities are stored relative to a velocity scale other than 1 the scale is folded into them first.
+    */
     const particle_group & get_particle_collection() const;
+    /**
+     * @brief: Returns the x, y and z components of the acceleration of every cell, cell (i, j, k) is stored at field_index(i, j, k).
+    */
+    const std::array<std::vector<double>, 3> & get_acceleration() const;
+
+    /**
+     * @brief: Returns the cached flat cell index of every particle, in the same order as the particle collection. The index of cell (i, j, k) is field_index(i, j, k),
+     * k + n * (j + n * i) unless the tuning selects GridLayout::bricked.
+    */
+    const std::vector<uint32_t> & get_cell_indices() const;
+
+    /**
+     * @brief: Fraction of the particles that changed cell between the last two depositions, recorded when the tuning enables incremental deposition.
+    */
+    double get_moved_fraction() const;
+
+    /**
+     * @brief: Number of depositions that only moved the particles that changed cell instead of depositing every particle.
+    */
+    uint64_t get_incremental_depositions() const;
+
+    /**
+     * @brief: Index of cell (i, j, k) in the acceleration grids and the cell index cache for the grid layout of the tuning.
+    */
+    size_t field_index(uint i, uint j, uint k) const;
 
     private:
+    /**
+     * @brief: Evaluates the flat index of the cell containing a particle. Positions are clamped into the last cell so a coordinate of exactly 1 stays in range.
+    */
+    uint32_t cell_index_of(const particle & current_particle) const;
+    template <typename Grid>
+    uint32_t cell_index_of(const particle & current_particle, Grid grid) const;
+
+    /**
+     * @brief: Calls kernel(grid) with a grid whose size() is the number of cells, a compile time constant for the specialised grid sizes so that strides fold into
+     * the instructions and divisions by the grid size become multiplications, and a runtime value for every other size or when the tuning disables specialisation.
+    */
+    template <typename Kernel>
+    void with_grid(Kernel && kernel);
+
+    /**
+     * @brief: Number of particles, held in memory or in the particle file.
+    */
+    uint64_t particle_count() const;
+
+    /**
+     * @brief: Throws if the particles are streamed from a file, for operations that need the whole population in memory.
+    */
+    void require_in_memory(const std::string & operation) const;
+
+    /**
+     * @brief: Throws if the particles are distributed over several ranks, for operations that need every particle on one rank.
+    */
+    void require_single_domain(const std::string & operation) const;
+
+    /**
+     * @brief: Cuts the space filling curve into equally weighted segments and migrates every particle to the rank owning its segment. Collective.
+    */
+    void rebalance();
+
+    size_t buffer_size() const; // number of cells in the grid
+    bool bricked_layout() const;
+    size_t field_length() const; // number of cells in the particle facing grids, including the padding of partial bricks
+
+    /**
+     * @brief: Validates and applies the parameters of a branch to this simulation.
+    */
+    void apply_branch(const branch_parameters & parameters);
+
+    /**
+     * @brief: Multiplies the velocity scale into the stored velocities and resets it to 1. Logically const, the physical velocities are unchanged.
+    */
+    void fold_velocity_scale() const;
+
+    /**
+     * @brief: Velocity scale the stored velocities are relative to after the next push, 1 if the push renormalises them.
+    */
+    double pushed_velocity_scale(bool apply_expansion) const;
+
+    // Phase kernels made of orphaned worksharing loops, must be called from inside a parallel region.
+    void deposit_density();
+    void deposit_streamed_density();
+    // Incremental deposition: applies the moves recorded by the push to cell_counts, or recounts every particle when that is required or the moves are too many,
+    // and converts the counts into densities in the pass that would otherwise zero the density buffer.
+    void deposit_counts();
+    // With record_density the power of the density modes is added to density_power, for the variance of the step's statistics.
+    void apply_greens_function(bool record_density = false);
+    // The diagnostic sums are reduced into the given shared variables and only accumulated when diagnostics are enabled.
+    // With record_density the extremes, empty cells and histogram of the density are merged into density_statistics.
+    void fill_ghost_layers(const fftw_complex * potential, double & potential_energy, bool record_density = false);
+    void apply_stencil();
+    // Pushes the particles first to last - 1 by step_length, every particle for a global step. The kick is scaled by force_scale.
+    void push_particles(bool apply_expansion, uint64_t first, uint64_t last, double step_length, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared);
+    // Adds the allocations since phase_start_allocations to the phase and samples the resident memory. Called by one thread while diagnostics are enabled,
+    // the allocations of the sample itself are left out of every phase.
+    void end_phase(StepPhase phase);
+    // Deposits the density and fills the acceleration grids from it, sharing the team of the caller's parallel region.
+    // With diagnostics and record_density the density statistics are reset and taken from this density, otherwise the previous ones are kept.
+    void compute_forces(double & potential_energy, double & deposit_end, bool record_density = true);
+    // Implementations of the kernels above for a grid size from with_grid.
+    template <typename Grid> void apply_greens_function(Grid grid, bool record_density);
+    template <typename Grid> void fill_ghost_layers(Grid grid, const fftw_complex * potential, double & potential_energy, bool record_density);
+    template <typename Grid> void apply_stencil(Grid grid);
+    template <typename Grid>
+    void push_particles(Grid grid, bool apply_expansion, uint64_t first, uint64_t last, double step_length, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared);
+
+    /**
+     * @brief: Takes the substeps of a step with block time steps, see set_block_time_steps. The diagnostic sums are taken over every particle once all levels are synchronised.
+    */
+    void take_block_step(int threads, double & potential_energy, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared);
+
+    /**
+     * @brief: Whether the coming step has to solve for the forces or may reuse the last field, see set_force_reuse. Collective when the domain is decomposed.
+    */
+    bool needs_force_solve();
+
+    /**
+     * @brief: Keeps the extrapolation of the acceleration field. After a solve the normalised field a * W^2 and its change per step are updated from the new field,
+     * on a reused step the acceleration grids are replaced by the field extrapolated to the current step. Orphaned worksharing loops.
+    */
+    void extrapolate_acceleration(bool solved);
+
+    /**
+     * @brief: Gives every particle its time step level from its velocity and the acceleration grids and bucket sorts the particles by level, keeping their order within a level.
+    */
+    void assign_time_step_levels();
+
+    /**
+     * @brief: Adds the records of a particle that has just been drifted to the calling thread's stream buffers, writing a buffer once it is full.
+     * @param old_position: Position before the drift.
+     * @param current_particle: Particle after the drift.
+     * @param physical_scale: Velocity scale that turns the particle's stored velocity into its physical velocity.
+     * @param buffers: The calling thread's buffers, one per open stream.
+    */
+    void stream_particle(const std::array<double, 3> & old_position, const particle & current_particle, double physical_scale, std::vector<std::vector<streamed_particle>> & buffers);
+
+    /**
+     * @brief: Writes and clears a stream buffer. Serialised between threads.
+    */
+    void flush_stream_buffer(size_t stream, std::vector<streamed_particle> & buffer);
+
+    /**
+     * @brief: Appends the statistics of the step that has just been taken from the reduced sums.
+    */
+    void record_statistics(std::array<double, 3> momentum, double kinetic_energy, double potential_energy, double max_speed_squared);
+
+    /**
+     * @brief: Destroys and recreates the forward and backward FFT plans with the given FFTW planner flags.
+    */
+    void make_plans(unsigned fftw_flags);
+
+    /**
+     * @brief: Times the median step of a candidate configuration, restoring the given particle state before the trial.
+    */
+    double time_configuration(const TuningConfiguration & configuration, uint trial_steps, const particle_group & initial_particles, const std::vector<uint32_t> & initial_cells, double initial_width);
+
     double time_max;
     double time_step;
-    particle_group particle_collection;
+    mutable particle_group particle_collection; // velocities relative to velocity_scale, see fold_velocity_scale
     double box_width;
     uint number_of_cells;
     double expansion_factor;
 
+    std::vector<uint32_t> cell_indices; // cell of every particle, kept in step with positions by the drift
+    uint64_t steps_taken;
+    double current_time;
+
+    mutable double velocity_scale; // physical velocity = stored velocity * velocity_scale, so box expansion is a scalar update
+    static constexpr double velocity_scale_limit = 1e100; // the scale is folded into the velocities once it leaves [1/limit, limit]
+
+    ColourMap colour_map;
+    bool image_pyramid;
+    std::optional<render_settings> render_output;
+
+    double halo_link_length; // 0 disables halo catalogues in run()
+    uint halo_min_members;
+    uint halo_interval;
+
+    bool diagnostics;
+    std::vector<StepStatistics> run_statistics;
+    DensityStatistics density_statistics; // of the last grid the forces were solved from, the variance is completed from the sums below when a step is recorded
+    double density_power; // sum of the squared magnitudes of the non zero density modes
+    double density_mean_mode; // zero mode of the density, the mean density times the number of cells
+    allocation_counts step_start_allocations; // taken when a step starts while diagnostics are enabled
+    std::array<PhaseMemory, step_phases> phase_memory; // of the current step
+    allocation_counts phase_start_allocations;
+
+    std::string frame_ring_name; // empty disables frame publishing
+    uint frame_slots;
+    uint frame_interval;
+    bool frame_overwrite;
+    std::unique_ptr<FramePublisher> frame_publisher;
+
+    std::optional<lightcone_settings> lightcone_output;
+    std::vector<region_settings> region_outputs;
+    std::vector<std::unique_ptr<ParticleStream>> particle_streams; // open while run() is running, the lightcone (if set) first, then one per region
+    std::vector<std::vector<std::vector<streamed_particle>>> stream_buffers; // records waiting to be written, per thread and per stream
+    static constexpr size_t stream_buffer_records = 4096; // records a thread collects for a stream before writing them
+
+    std::unique_ptr<MappedParticleFile> particle_file; // set for out of core runs, particle_collection is then empty
+    uint64_t chunk_size;
+    std::vector<double> next_density; // streamed runs deposit the next step's density while pushing
+    bool next_density_ready;
+
+    MPI_Comm domain_communicator; // MPI_COMM_NULL unless the particles are decomposed over ranks
+    int domain_rank;
+    int num_domains;
+    decomposition_settings decomposition;
+    uint64_t last_rebalance_step;
+    double particle_time; // measured time of the particle phases of the last step on this rank
+    double load_imbalance;
+
+    TuningConfiguration tuning;
+    std::vector<std::vector<double>> thread_density; // per thread grids for DepositionStrategy::private_grids
+    std::vector<double> bricked_density; // deposition grid of the atomic and coalesced strategies in the bricked layout, zero between steps
+    std::vector<uint32_t> cell_counts; // particles in every cell in the field layout, maintained by the incremental deposition
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> thread_moves; // (old cell, new cell) of the particles each thread's pushes moved since the last deposition
+    bool counts_valid; // cell_counts agrees with the cell index cache once the recorded moves are applied
+    bool moves_overflowed; // a thread stopped recording its moves, so they cannot be applied
+    uint64_t moved_particles; // particles that changed cell since the last deposition
+    uint64_t deposits_since_rebuild;
+    uint64_t incremental_depositions;
+    double moved_fraction;
+
+    block_step_settings block_steps;
+    std::vector<uint64_t> level_offsets; // particles of level l are level_offsets[l] to level_offsets[l + 1] - 1 during a block step
+    std::vector<uint64_t> level_counts;
+
+    force_reuse_settings force_reuse;
+    bool forces_valid; // the acceleration grids hold a solved (or extrapolated) field that may be reused
+    uint64_t reuses_since_solve;
+    double displacement_since_solve; // bound on the distance, in cells, any particle moved since the last solve
+    double push_displacement; // largest distance a particle moved in the pushes since the bound was last updated, in cells
+    double solve_width; // box width of the last solve
+    double solved_potential_energy;
+    double force_scale; // factor the push applies to the acceleration grids
+    uint64_t force_solves;
+    std::array<std::vector<double>, 3> solved_acceleration; // a * W^2 of the last solve, for the extrapolation
+    std::array<std::vector<double>, 3> acceleration_change; // change of a * W^2 per step between the last two solves
+
+    static constexpr uint ghost_layers = 2; // enough periodic neighbours for the fourth order stencil
+    uint gradient_order;
+    std::vector<double> padded_potential; // potential with ghost layers on every face, (n + 4)^3 cells
+    std::array<std::vector<double>, 3> acceleration; // x, y and z components of the acceleration in each cell
+
     fftw_complex * density_buffer; // buffers and plans
     fftw_complex * potential_buffer;
     fftw_complex * k_space_buffer;
     fftw_plan forward_plan;
     fftw_plan backward_plan;
-};
\ No newline at end of file
+};
+
+/**
+ * @brief: Range returned by Simulation::steps. Its iterators are single pass input iterators: incrementing one advances the simulation.
+*/
+class StepRange
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = StepView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = StepView;
+
+        iterator(Simulation * sim, double t_end);
+        StepView operator*() const;
+        iterator & operator++();
+        bool operator==(const iterator & other) const;
+        bool operator!=(const iterator & other) const;
+
+    private:
+        Simulation * simulation; // nullptr once the range is exhausted
+        double time_end;
+    };
+
+    StepRange(Simulation & sim, double t_end);
+    iterator begin();
+    iterator end();
+
+private:
+    Simulation & simulation;
+    double time_end;
+};
@@ -11,14 +11,126 @@
 using std::vector;
 using std::array;
 
+/**
+ * @brief: Colour ramp for density images, applied to densities normalised by their mean through a lookup table.
+ * Available maps are "classic" (the original black-red-yellow-white ramp with thresholds at 255 and 550), "grey" and "cool" (black-blue-cyan-white).
+*/
+class ColourMap
+{
+public:
+    /**
+     * @brief: Builds the lookup table of the named colour map. Throws std::invalid_argument for unknown names.
+     * @param name: Name of the colour map.
+     * @param max_density: Normalised density (density/mean) that maps to the last entry of the table, larger densities saturate.
+    */
+    ColourMap(const std::string & name = "classic", double max_density = 805.0/255.0);
+
+    /**
+     * @brief: Colour of a density normalised by the mean density of the image.
+    */
+    const array<unsigned char, 3> & operator()(double normalised_density) const
+    {
+        double position = normalised_density * scale;
+        size_t index = position >= table_size - 1 ? table_size - 1 : (position > 0 ? static_cast<size_t>(position) : 0);
+        return table[index];
+    }
+
+    const std::string & get_name() const;
+    double get_max_density() const;
+
+private:
+    static constexpr size_t table_size = 1024;
+    std::string name;
+    double max_density;
+    double scale; // converts a normalised density into a table index
+    vector<array<unsigned char, 3>> table;
+};
+
+/**
+ * @brief: One level of a projection pyramid, a square image stored row by row.
+*/
+struct image_level
+{
+    size_t size;
+    vector<double> pixels;
+};
+
 /**
  * @brief Takes a buffer of fftw_complex values and outputs and image
  * Densities are integrated over the z axis to convert to 2D
  * @param density_map density values of type fftw_comlex. Imaginary component ignored.
  * @param n_cells size of buffer in each dimension; total size is n_cells*n_cells*n_cells
  * @param filename image output file path
+ * @param colour_map colour map applied to the projected densities normalised by their mean
  */
-void SaveToFile(fftw_complex* density_map, const size_t n_cells, const std::string &filename);
+void SaveToFile(fftw_complex* density_map, const size_t n_cells, const std::string &filename, const ColourMap &colour_map = ColourMap());
+
+/**
+ * @brief: Integrates a density buffer over the z axis in parallel.
+ * @param density_map: density values of type fftw_complex. Imaginary component ignored.
+ * @param n_cells: size of buffer in each dimension.
+ * @return vector<double> projected densities, pixel (i, j) is stored at i * n_cells + j.
+*/
+vector<double> ProjectDensity(const fftw_complex* density_map, const size_t n_cells);
+
+/**
+ * @brief: Integrates a density buffer over the z axis in parallel into a buffer of the caller, e.g. a slot of a frame ring, without allocating.
+ * @param density_map: density values of type fftw_complex. Imaginary component ignored.
+ * @param n_cells: size of buffer in each dimension.
+ * @param projection: Receives the n_cells * n_cells projected densities, pixel (i, j) at i * n_cells + j.
+*/
+void ProjectDensity(const fftw_complex* density_map, const size_t n_cells, double* projection);
+
+/**
+ * @brief: Builds a mipmap pyramid from a projection by repeatedly averaging 2x2 blocks of pixels in parallel. Odd sized levels average the partial blocks on their last row and column.
+ * @param projection: Full resolution projection, level 0 of the pyramid.
+ * @param size: Number of pixels per side of the projection.
+ * @param min_size: Levels are halved until they have no more than min_size pixels per side.
+ * @return vector<image_level> levels from full resolution to coarsest.
+*/
+vector<image_level> BuildProjectionPyramid(const vector<double> &projection, size_t size, size_t min_size = 8);
+
+/**
+ * @brief: Saves every level of the projection pyramid of a density buffer as binary ppm (P6) images named <base_filename>_level_<level>.ppm, level 0 being full resolution.
+ * All levels are normalised by the same mean so their colours agree. Binary rows have a fixed length so a viewer can seek straight to the rows of the region it displays.
+ * @param density_map: density values of type fftw_complex. Imaginary component ignored.
+ * @param n_cells: size of buffer in each dimension.
+ * @param base_filename: Path and name the level suffix is appended to.
+ * @param colour_map: colour map applied to the projected densities normalised by their mean.
+ * @param min_size: Smallest level size, see BuildProjectionPyramid.
+*/
+void SavePyramidToFiles(const fftw_complex* density_map, const size_t n_cells, const std::string &base_filename, const ColourMap &colour_map = ColourMap(), size_t min_size = 8);
+
+/**
+ * @brief: Settings of the particle splatting renderer.
+*/
+struct render_settings
+{
+    size_t resolution = 2048; // pixels per side of the image
+    double smoothing_radius = 0; // radius of the smoothing kernel in pixels, 0 adds each particle to the single pixel it falls in
+    bool log_scale = false; // colour by log(1 + density/mean) instead of density/mean
+    size_t tile_size = 64; // pixels per side of the tiles rendered independently by each thread
+};
+
+/**
+ * @brief: Renders the particles projected along the z axis directly into an image of any resolution, independent of the number of cells of the simulation.
+ * Particles are binned into square tiles of the image (a particle whose kernel overlaps several tiles is binned into each of them) and every thread renders whole tiles,
+ * so threads never write to the same pixel. The image is periodic like the box, kernels that cross an edge wrap around.
+ * Each particle deposits exactly its mass, spread over the pixels within the smoothing radius with a cubic spline kernel.
+ * @param particles: Particles to render, positions within the unit cube.
+ * @param settings: Resolution, smoothing radius and tile size. The smoothing radius must be less than half the resolution.
+ * @return vector<double> projected mass per pixel, pixel (i, j) is stored at i * resolution + j with i along x like ProjectDensity.
+*/
+vector<double> RenderParticles(const particle_group &particles, const render_settings &settings);
+
+/**
+ * @brief: Saves an image made by RenderParticles as a binary ppm (P6) file.
+ * @param image: Projected mass per pixel.
+ * @param settings: Settings the image was rendered with, selects linear or log scale colouring.
+ * @param colour_map: colour map applied to the pixel values normalised by their mean.
+ * @param filename: image output file path
+*/
+void SaveRenderToFile(const vector<double> &image, const render_settings &settings, const ColourMap &colour_map, const std::string &filename);
 
 /**
  * @brief Calculates a log radial correlation for coordinates 0 <= r < 0.5
@@ -27,7 +139,7 @@ void SaveToFile(fftw_complex* density_map, const size_t n_cells, const std::stri
  * @param n_bins the resolution of the histogram
  * @return vector<double> log of radial correlation function evenly spaced from r = 0 to 0.5
  */
-vector<double> correlationFunction(particle_group particles, int n_bins);
+vector<double> correlationFunction(const particle_group &particles, int n_bins);
 
 /**
  * @brief: Saves log radial correlation for coordinates 0 <= r < 0.5 (output of correlationFunction)
@@ -70,4 +182,10 @@ std::string formatREALToNDecimalPlaces(double value, uint dp = 3);
  * @param max_dp: Threshold for maximum number of decimal places that the value will be rounded to.
  * @returns Formatted string with trailing zeros cut off from the left.
 */
-std::string removeTrailingDecimalPlaces(double value, uint max_dp = 3);
\ No newline at end of file
+std::string removeTrailingDecimalPlaces(double value, uint max_dp = 3);
+
+/**
+ * @brief: Name of the machine, as used to key the tuning profiles and performance baselines.
+ * @returns: The host name, or "unknown" if it cannot be read.
+*/
+std::string HostName();
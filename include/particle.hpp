@@ -3,6 +3,7 @@
 #include <vector>
 #include <array>
 #include <random>
+#include <cstddef>
 
 /**
  * @brief: Class designed to hold position and velocity data for single particle.
@@ -15,6 +16,12 @@ public:
      * @param initial_position: 1D array of length 3 to hold coordinates in x, y and z directions with respect to the unit cube describing the box.
     */
     particle(const std::array<double, 3> &initial_position);
+
+    /**
+     * @brief: Particle at rest at the origin, so a vector of particles can be sized before it is filled.
+    */
+    particle() : position{0, 0, 0} {}
+
     std::array<double, 3> position;
     std::array<double, 3> velocity = {0, 0, 0};
 };
@@ -32,7 +39,7 @@ class particle_group
      * @param num_particles: Number of particles to be created in the group.
      * @param random_seed: Random seed that will be applied to the STL standard library default random number generator following the uniform distribution.
     */
-    particle_group(double mass, uint num_particles, uint random_seed);
+    particle_group(double mass, size_t num_particles, uint random_seed);
     
     /**
      * @brief: Constructor for particle_group class allowing for manual assignment of particle positions. Contains error handling to check if inputted number of particles value is correct
@@ -40,13 +47,28 @@ class particle_group
      * @param num_particles: Number of particles to be created in the group.
      * @param positions: Vector of length 3 arrays that contain the coordinates in the unit cube in all 3 directions of cartesian space.
     */
-    particle_group(double mass, uint num_particles, const std::vector<std::array<double,3>> &positions);
+    particle_group(double mass, size_t num_particles, const std::vector<std::array<double,3>> &positions);
+
+    /**
+     * @brief: Constructor for particle_group class that adopts an existing vector of particles without copying it. Positions are validated in parallel.
+     * Pass the vector with std::move, e.g. particle_group(mass, std::move(loaded_particles)).
+     * @param mass: Mass of each particle.
+     * @param collection: Particles to take ownership of.
+    */
+    particle_group(double mass, std::vector<particle> &&collection);
 
-    size_t get_num_particles();
+    /**
+     * @brief: Constructor for particle_group class that builds the particles in one parallel pass from a flat buffer of coordinates x0 y0 z0 x1 y1 z1 ...,
+     * as filled by bulk readers. The coordinates are copied: a particle stores its velocity next to its position, so a buffer of positions alone cannot
+     * be used in place. The buffer stays owned by the caller, only the std::vector<particle> constructor takes particles over without a copy.
+     * @param mass: Mass of each particle.
+     * @param positions: Pointer to 3 * num_particles coordinates within the unit cube.
+     * @param num_particles: Number of particles to be created in the group.
+    */
+    particle_group(double mass, const double *positions, size_t num_particles);
+
+    size_t get_num_particles() const;
 
     double mass;
     std::vector<particle> particles;
-
-    private:
-    uint num_particles;
 };
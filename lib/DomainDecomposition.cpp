@@ -0,0 +1,97 @@
+#include "DomainDecomposition.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+/**
+ * @brief: Spreads the lowest 21 bits of a value so that there are two zero bits between each of them.
+*/
+uint64_t spreadBits(uint64_t value){
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8) & 0x100f00f00f00f00f;
+    value = (value | value << 4) & 0x10c30c30c30c30c3;
+    value = (value | value << 2) & 0x1249249249249249;
+    return value;
+}
+
+}
+
+uint64_t MortonKey(const std::array<double, 3> & position, uint level)
+{
+    if (level > 21){
+        throw std::invalid_argument("Error - The space filling curve level must be at most 21!");
+    }
+    uint64_t cells = uint64_t(1) << level;
+    uint64_t key = 0;
+    for (uint axis = 0; axis < 3; axis++){
+        uint64_t coordinate = std::min(static_cast<uint64_t>(position[axis] * cells), cells - 1);
+        key |= spreadBits(coordinate) << (2 - axis);
+    }
+    return key;
+}
+
+std::vector<int> PartitionCurve(const std::vector<double> & bin_weights, int num_ranks)
+{
+    if (num_ranks <= 0){
+        throw std::invalid_argument("Error - The curve must be cut into at least one segment!");
+    }
+    size_t num_bins = bin_weights.size();
+    double total = 0;
+    for (double weight : bin_weights){
+        total += weight;
+    }
+
+    std::vector<int> owners(num_bins);
+    double before = 0;
+    for (size_t bin = 0; bin < num_bins; bin++){
+        // owner of the midpoint of the bin's weight, empty space is split evenly when there is no weight at all
+        double position = total > 0 ? (before + 0.5 * bin_weights[bin]) / total : (bin + 0.5) / num_bins;
+        owners[bin] = std::min(static_cast<int>(position * num_ranks), num_ranks - 1);
+        before += bin_weights[bin];
+    }
+    return owners;
+}
+
+std::vector<particle> MigrateParticles(const std::vector<particle> & particles, const std::vector<int> & destinations, MPI_Comm communicator)
+{
+    static_assert(sizeof(particle) == 6 * sizeof(double), "particles are sent as six doubles");
+    int num_ranks;
+    MPI_Comm_size(communicator, &num_ranks);
+    if (destinations.size() != particles.size()){
+        throw std::invalid_argument("Error - Every particle needs a destination rank!");
+    }
+
+    std::vector<int> send_counts(num_ranks, 0);
+    for (int destination : destinations){
+        send_counts[destination]++;
+    }
+    std::vector<int> receive_counts(num_ranks);
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, receive_counts.data(), 1, MPI_INT, communicator);
+
+    std::vector<int> send_offsets(num_ranks, 0);
+    std::vector<int> receive_offsets(num_ranks, 0);
+    for (int r = 1; r < num_ranks; r++){
+        send_offsets[r] = send_offsets[r - 1] + send_counts[r - 1];
+        receive_offsets[r] = receive_offsets[r - 1] + receive_counts[r - 1];
+    }
+
+    // group the particles by destination, keeping their order within each destination
+    std::vector<particle> send_buffer(particles.size(), particle({0, 0, 0}));
+    std::vector<int> fill(send_offsets);
+    for (size_t p = 0; p < particles.size(); p++){
+        send_buffer[fill[destinations[p]]++] = particles[p];
+    }
+
+    size_t num_received = receive_offsets[num_ranks - 1] + receive_counts[num_ranks - 1];
+    std::vector<particle> received(num_received, particle({0, 0, 0}));
+    MPI_Datatype particle_type;
+    MPI_Type_contiguous(6, MPI_DOUBLE, &particle_type);
+    MPI_Type_commit(&particle_type);
+    MPI_Alltoallv(send_buffer.data(), send_counts.data(), send_offsets.data(), particle_type,
+                  received.data(), receive_counts.data(), receive_offsets.data(), particle_type, communicator);
+    MPI_Type_free(&particle_type);
+    return received;
+}
@@ -0,0 +1,177 @@
+#include "FrameRing.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace frame_ring_detail;
+
+namespace {
+
+constexpr size_t cache_line = 64; // slots start on their own cache line so the writer and readers of different slots do not share one
+
+size_t roundUp(size_t bytes){
+    return (bytes + cache_line - 1) / cache_line * cache_line;
+}
+
+size_t headerLength(){
+    return roundUp(sizeof(ring_header));
+}
+
+}
+
+FramePublisher::FramePublisher(const std::string & name, uint64_t num_slots, uint64_t max_pixels, bool overwrite) : name(name), mapping(MAP_FAILED), mapping_length(0), header(nullptr)
+{
+    if (num_slots < 2){
+        throw std::invalid_argument("Error - A frame ring needs at least 2 slots!");
+    }
+    if (max_pixels == 0){
+        throw std::invalid_argument("Error - Frames must hold at least one pixel!");
+    }
+    size_t slot_stride = roundUp(sizeof(slot_header) + max_pixels * sizeof(double));
+    mapping_length = headerLength() + num_slots * slot_stride;
+
+    if (overwrite){
+        shm_unlink(name.c_str()); // readers still holding the old segment keep their mapping but never see another frame
+    }
+    int descriptor = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (descriptor < 0 && errno == EEXIST){
+        throw std::runtime_error("Error - The shared memory segment " + name + " already exists, another run may be publishing to it. Remove it (on Linux from /dev/shm) "
+                                 "if it was left behind by a run that did not exit cleanly, or enable overwriting!");
+    }
+    if (descriptor < 0){
+        throw std::runtime_error("Failed to create the shared memory segment " + name + ": " + std::strerror(errno));
+    }
+    if (ftruncate(descriptor, mapping_length) != 0){
+        close(descriptor);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Failed to size the shared memory segment " + name + ": " + std::strerror(errno));
+    }
+    mapping = mmap(nullptr, mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    close(descriptor); // the mapping keeps the segment alive
+    if (mapping == MAP_FAILED){
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Failed to map the shared memory segment " + name + ": " + std::strerror(errno));
+    }
+
+    // the new segment is zero filled, so every slot starts with an even sequence counter and no frame
+    char * base = static_cast<char *>(mapping);
+    for (uint64_t s = 0; s < num_slots; s++){
+        slot_header * slot = new (base + headerLength() + s * slot_stride) slot_header;
+        slot->sequence.store(0, std::memory_order_relaxed);
+        slot->info.frame = UINT64_MAX;
+    }
+    header = new (mapping) ring_header;
+    header->num_slots = num_slots;
+    header->max_pixels = max_pixels;
+    header->slot_stride = slot_stride;
+    header->published.store(0, std::memory_order_relaxed);
+    header->finished.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, magic, sizeof(magic)); // written last, readers treat a segment without it as not ready
+}
+
+FramePublisher::~FramePublisher()
+{
+    munmap(mapping, mapping_length);
+    shm_unlink(name.c_str());
+}
+
+void FramePublisher::publish(const std::vector<double> & pixels, uint64_t size, double time, uint64_t step, double box_width){
+    if (pixels.size() != size * size){
+        throw std::invalid_argument("Error - The frame does not have size * size pixels!");
+    }
+    publish(size, time, step, box_width, [&](double * slot_pixels){
+        std::memcpy(slot_pixels, pixels.data(), pixels.size() * sizeof(double));
+    });
+}
+
+double * FramePublisher::begin_frame(uint64_t size, double time, uint64_t step, double box_width){
+    if (size * size > header->max_pixels){
+        throw std::invalid_argument("Error - The frame is larger than the slots of the frame ring!");
+    }
+    uint64_t frame = header->published.load(std::memory_order_relaxed); // only this process writes
+    slot_header * slot = reinterpret_cast<slot_header *>(static_cast<char *>(mapping) + headerLength() + (frame % header->num_slots) * header->slot_stride);
+
+    uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed); // odd, readers reject the slot from now on
+    std::atomic_thread_fence(std::memory_order_release); // the counter becomes visible before any of the new contents
+    slot->info = {frame, time, step, box_width, size};
+    return reinterpret_cast<double *>(slot + 1);
+}
+
+void FramePublisher::end_frame(){
+    uint64_t frame = header->published.load(std::memory_order_relaxed);
+    slot_header * slot = reinterpret_cast<slot_header *>(static_cast<char *>(mapping) + headerLength() + (frame % header->num_slots) * header->slot_stride);
+    slot->sequence.store(slot->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    header->published.store(frame + 1, std::memory_order_release);
+}
+
+void FramePublisher::finish(){
+    header->finished.store(1, std::memory_order_release);
+}
+
+uint64_t FramePublisher::get_frames_published() const {
+    return header->published.load(std::memory_order_relaxed);
+}
+
+const std::string & FramePublisher::get_name() const {
+    return name;
+}
+
+FrameSubscriber::FrameSubscriber(const std::string & name) : mapping(MAP_FAILED), mapping_length(0), header(nullptr)
+{
+    int descriptor = shm_open(name.c_str(), O_RDONLY, 0);
+    if (descriptor < 0){
+        throw std::runtime_error("Failed to open the shared memory segment " + name + ": " + std::strerror(errno));
+    }
+    struct stat segment_status;
+    if (fstat(descriptor, &segment_status) != 0 || static_cast<size_t>(segment_status.st_size) < headerLength()){
+        close(descriptor);
+        throw std::runtime_error("Error - The shared memory segment " + name + " is not a frame ring!");
+    }
+    mapping_length = segment_status.st_size;
+    mapping = mmap(nullptr, mapping_length, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED){
+        throw std::runtime_error("Failed to map the shared memory segment " + name + ": " + std::strerror(errno));
+    }
+    header = static_cast<const ring_header *>(mapping);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || headerLength() + header->num_slots * header->slot_stride > mapping_length){
+        munmap(const_cast<void *>(mapping), mapping_length);
+        throw std::runtime_error("Error - The shared memory segment " + name + " is not a frame ring!");
+    }
+}
+
+FrameSubscriber::~FrameSubscriber()
+{
+    munmap(const_cast<void *>(mapping), mapping_length);
+}
+
+uint64_t FrameSubscriber::get_frames_published() const {
+    return header->published.load(std::memory_order_acquire);
+}
+
+bool FrameSubscriber::is_finished() const {
+    return header->finished.load(std::memory_order_acquire) != 0;
+}
+
+uint64_t FrameSubscriber::get_num_slots() const {
+    return header->num_slots;
+}
+
+const slot_header * FrameSubscriber::slot_of(uint64_t frame) const {
+    return reinterpret_cast<const slot_header *>(static_cast<const char *>(mapping) + headerLength() + (frame % header->num_slots) * header->slot_stride);
+}
+
+bool FrameSubscriber::read(uint64_t frame, frame_info & info, std::vector<double> & pixels) const {
+    return view(frame, [&](const frame_info & slot_info, const double * slot_pixels){
+        info = slot_info;
+        pixels.assign(slot_pixels, slot_pixels + slot_info.size * slot_info.size);
+    });
+}
@@ -0,0 +1,213 @@
+#include "HaloFinder.hpp"
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <omp.h>
+
+namespace {
+
+/**
+ * @brief: Lock free union-find over particle indices. Roots are only ever linked below a smaller index with a compare and swap, so concurrent unions never form cycles.
+*/
+class ConcurrentUnionFind
+{
+public:
+    ConcurrentUnionFind(size_t size) : parent(size)
+    {
+        #pragma omp parallel for
+        for (size_t i = 0; i < size; i++){
+            parent[i].store(i, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t find(uint64_t element){
+        while (true){
+            uint64_t up = parent[element].load(std::memory_order_relaxed);
+            if (up == element){
+                return element;
+            }
+            uint64_t grand_parent = parent[up].load(std::memory_order_relaxed);
+            if (grand_parent != up){
+                parent[element].compare_exchange_weak(up, grand_parent, std::memory_order_relaxed); // path halving, failure is harmless
+            }
+            element = grand_parent;
+        }
+    }
+
+    void unite(uint64_t a, uint64_t b){
+        while (true){
+            a = find(a);
+            b = find(b);
+            if (a == b){
+                return;
+            }
+            if (a < b){
+                std::swap(a, b);
+            }
+            uint64_t expected = a;
+            if (parent[a].compare_exchange_strong(expected, b, std::memory_order_acq_rel)){
+                return;
+            }
+        }
+    }
+
+private:
+    std::vector<std::atomic<uint64_t>> parent;
+};
+
+double periodicOffset(double x1, double x2){
+    double d = x1 - x2;
+    if (d >= 0.5){
+        d -= 1;
+    }
+    else if (d < -0.5){
+        d += 1;
+    }
+    return d;
+}
+
+void atomicAdd(double & target, double value){
+    #pragma omp atomic
+    target += value;
+}
+
+}
+
+std::vector<halo> friendsOfFriends(const particle_group & particles, const std::vector<uint32_t> & cell_indices, uint num_cells, double link_length, uint min_members, double velocity_scale)
+{
+    if (link_length <= 0 || link_length > 1){
+        throw std::invalid_argument("Error - The friends-of-friends link length must be larger than 0 and at most 1 cell width!");
+    }
+    size_t num_particles = cell_indices.size();
+    if (num_particles != particles.particles.size()){
+        throw std::invalid_argument("Error - The cell index cache does not match the number of particles!");
+    }
+    size_t buffer_length = static_cast<size_t>(num_cells) * num_cells * num_cells;
+    double link_squared = (link_length / num_cells) * (link_length / num_cells); // positions are in unit cube coordinates
+
+    // cell lists: members of cell c are cell_members[cell_start[c]] to cell_members[cell_start[c + 1] - 1]
+    std::vector<uint64_t> cell_start(buffer_length + 1, 0);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        #pragma omp atomic
+        cell_start[cell_indices[p] + 1]++;
+    }
+    std::partial_sum(cell_start.begin(), cell_start.end(), cell_start.begin());
+    std::vector<uint64_t> fill(cell_start.begin(), cell_start.end() - 1);
+    std::vector<uint64_t> cell_members(num_particles);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        uint64_t slot;
+        #pragma omp atomic capture
+        slot = fill[cell_indices[p]]++;
+        cell_members[slot] = p;
+    }
+
+    // neighbour offsets, duplicates removed for grids so small that periodic neighbours coincide
+    std::vector<int> offsets = {-1, 0, 1};
+    if (num_cells < 3){
+        offsets = num_cells == 1 ? std::vector<int>{0} : std::vector<int>{0, 1};
+    }
+
+    ConcurrentUnionFind groups(num_particles);
+    const std::vector<particle> & members = particles.particles;
+    int n = num_cells;
+
+    #pragma omp parallel for collapse(3) schedule(dynamic, 16)
+    for (int i = 0; i < n; i++){
+        for (int j = 0; j < n; j++){
+            for (int k = 0; k < n; k++){
+                uint64_t cell = k + n * (j + static_cast<uint64_t>(n) * i);
+                for (int di : offsets){
+                    for (int dj : offsets){
+                        for (int dk : offsets){
+                            uint64_t neighbour = (k + dk + n) % n + n * ((j + dj + n) % n + static_cast<uint64_t>(n) * ((i + di + n) % n));
+                            if (neighbour < cell){
+                                continue; // each pair of cells is visited once, from the lower index
+                            }
+                            for (uint64_t a = cell_start[cell]; a < cell_start[cell + 1]; a++){
+                                uint64_t p = cell_members[a];
+                                // within a cell only compare against later members
+                                uint64_t b_start = neighbour == cell ? a + 1 : cell_start[neighbour];
+                                for (uint64_t b = b_start; b < cell_start[neighbour + 1]; b++){
+                                    uint64_t q = cell_members[b];
+                                    double dx = periodicOffset(members[p].position[0], members[q].position[0]);
+                                    double dy = periodicOffset(members[p].position[1], members[q].position[1]);
+                                    double dz = periodicOffset(members[p].position[2], members[q].position[2]);
+                                    if (dx * dx + dy * dy + dz * dz < link_squared){
+                                        groups.unite(p, q);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // group sizes, roots are the smallest index of each group
+    std::vector<uint64_t> root(num_particles);
+    std::vector<uint64_t> group_size(num_particles, 0);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        root[p] = groups.find(p);
+        #pragma omp atomic
+        group_size[root[p]]++;
+    }
+
+    std::vector<int64_t> halo_id(num_particles, -1);
+    std::vector<halo> halos;
+    for (size_t p = 0; p < num_particles; p++){
+        if (root[p] == p && group_size[p] >= min_members){
+            halo_id[p] = halos.size();
+            halos.push_back(halo{group_size[p], group_size[p] * particles.mass, {0, 0, 0}, {0, 0, 0}});
+        }
+    }
+
+    // sum offsets from the root particle so groups that straddle the boundary are averaged correctly
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        int64_t id = halo_id[root[p]];
+        if (id < 0){
+            continue;
+        }
+        const particle & reference = members[root[p]];
+        for (uint axis = 0; axis < 3; axis++){
+            atomicAdd(halos[id].centre[axis], periodicOffset(members[p].position[axis], reference.position[axis]));
+            atomicAdd(halos[id].velocity[axis], members[p].velocity[axis]);
+        }
+    }
+
+    for (size_t p = 0; p < num_particles; p++){
+        if (halo_id[p] < 0){
+            continue;
+        }
+        halo & current_halo = halos[halo_id[p]];
+        for (uint axis = 0; axis < 3; axis++){
+            double centre = members[p].position[axis] + current_halo.centre[axis] / current_halo.num_members;
+            current_halo.centre[axis] = centre - std::floor(centre);
+            current_halo.velocity[axis] *= velocity_scale / current_halo.num_members;
+        }
+    }
+
+    std::stable_sort(halos.begin(), halos.end(), [](const halo & a, const halo & b){ return a.num_members > b.num_members; });
+    return halos;
+}
+
+void SaveHaloCatalogue(const std::vector<halo> & halos, const std::string & filename)
+{
+    std::ofstream file(filename);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    file << "num_members,mass,x,y,z,vx,vy,vz\n";
+    for (const halo & current_halo : halos){
+        file << current_halo.num_members << "," << current_halo.mass << ","
+        << current_halo.centre[0] << "," << current_halo.centre[1] << "," << current_halo.centre[2] << ","
+        << current_halo.velocity[0] << "," << current_halo.velocity[1] << "," << current_halo.velocity[2] << "\n";
+    }
+}
@@ -0,0 +1,208 @@
+#include "IndexedSnapshot.hpp"
+#include "DomainDecomposition.hpp"
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char snapshot_magic[8] = {'P', 'M', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr size_t page_length = 4096;
+
+struct snapshot_header
+{
+    char magic[8];
+    uint64_t num_particles;
+    double mass;
+    uint64_t level;
+    uint64_t table_offset; // bytes from the start of the file
+    uint64_t data_offset;
+};
+
+uint64_t roundUpToPage(uint64_t bytes){
+    return (bytes + page_length - 1) / page_length * page_length;
+}
+
+/**
+ * @brief: Morton key of the block with integer coordinates (i, j, k), evaluated through the block centre so it matches MortonKey of any position inside it.
+*/
+uint64_t blockKey(uint64_t i, uint64_t j, uint64_t k, uint level){
+    double blocks = double(uint64_t(1) << level);
+    return MortonKey({(i + 0.5) / blocks, (j + 0.5) / blocks, (k + 0.5) / blocks}, level);
+}
+
+}
+
+void SaveIndexedSnapshot(const particle_group & particles, const std::string & filename, uint level)
+{
+    if (level == 0 || level > 8){
+        throw std::invalid_argument("Error - The snapshot index level must be between 1 and 8!");
+    }
+    const std::vector<particle> & records = particles.particles;
+    size_t num_particles = records.size();
+    size_t num_blocks = size_t(1) << (3 * level);
+
+    // counting sort of the particles by block key, stable so particles keep their relative order within a block
+    std::vector<uint64_t> keys(num_particles);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        keys[p] = MortonKey(records[p].position, level);
+    }
+    std::vector<uint64_t> offsets(num_blocks + 1, 0);
+    for (uint64_t key : keys){
+        offsets[key + 1]++;
+    }
+    for (size_t b = 0; b < num_blocks; b++){
+        offsets[b + 1] += offsets[b];
+    }
+    std::vector<size_t> order(num_particles);
+    std::vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t p = 0; p < num_particles; p++){
+        order[fill[keys[p]]++] = p;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    snapshot_header header;
+    std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.num_particles = num_particles;
+    header.mass = particles.mass;
+    header.level = level;
+    header.table_offset = page_length;
+    header.data_offset = roundUpToPage(page_length + offsets.size() * sizeof(uint64_t)); // particle records start page aligned
+    std::vector<char> padding(page_length, 0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(padding.data(), page_length - sizeof(header));
+    file.write(reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    file.write(padding.data(), header.data_offset - page_length - offsets.size() * sizeof(uint64_t));
+
+    // gathered in chunks so the sorted copy never holds more than one chunk
+    const size_t chunk_size = 1 << 16;
+    std::vector<particle> chunk;
+    chunk.reserve(chunk_size);
+    for (size_t begin = 0; begin < num_particles; begin += chunk_size){
+        size_t end = std::min(begin + chunk_size, num_particles);
+        chunk.clear();
+        for (size_t p = begin; p < end; p++){
+            chunk.push_back(records[order[p]]);
+        }
+        file.write(reinterpret_cast<const char *>(chunk.data()), chunk.size() * sizeof(particle));
+    }
+    if (!file){
+        throw std::runtime_error("Failed to write the snapshot " + filename + ".");
+    }
+}
+
+IndexedSnapshot::IndexedSnapshot(const std::string & filename) : mapping(MAP_FAILED), mapping_length(0)
+{
+    file_descriptor = open(filename.c_str(), O_RDONLY);
+    if (file_descriptor < 0){
+        throw std::runtime_error("Failed to open the snapshot " + filename + ": " + std::strerror(errno));
+    }
+    struct stat file_status;
+    snapshot_header header;
+    if (fstat(file_descriptor, &file_status) != 0 || file_status.st_size < static_cast<off_t>(page_length)
+        || pread(file_descriptor, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0
+        || header.level == 0 || header.level > 8){
+        close(file_descriptor);
+        throw std::invalid_argument("Error - " + filename + " is not an indexed snapshot!");
+    }
+    num_particles = header.num_particles;
+    mass = header.mass;
+    level = header.level;
+    mapping_length = header.data_offset + num_particles * sizeof(particle);
+    if (static_cast<size_t>(file_status.st_size) < mapping_length){
+        close(file_descriptor);
+        throw std::invalid_argument("Error - The snapshot " + filename + " is shorter than its header states!");
+    }
+
+    mapping = mmap(nullptr, mapping_length, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    if (mapping == MAP_FAILED){
+        close(file_descriptor);
+        throw std::runtime_error("Failed to map the snapshot " + filename + ": " + std::strerror(errno));
+    }
+    const char * base = static_cast<const char *>(mapping);
+    offsets = reinterpret_cast<const uint64_t *>(base + header.table_offset);
+    particles = reinterpret_cast<const particle *>(base + header.data_offset);
+    // queries jump between blocks, read ahead would pull in the pages of blocks outside the query
+    madvise(static_cast<char *>(mapping) + header.data_offset, mapping_length - header.data_offset, MADV_RANDOM);
+}
+
+IndexedSnapshot::~IndexedSnapshot()
+{
+    munmap(mapping, mapping_length);
+    close(file_descriptor);
+}
+
+uint64_t IndexedSnapshot::size() const {
+    return num_particles;
+}
+
+double IndexedSnapshot::get_mass() const {
+    return mass;
+}
+
+uint IndexedSnapshot::get_level() const {
+    return level;
+}
+
+std::pair<const particle *, const particle *> IndexedSnapshot::block(uint64_t key) const {
+    if (key >= (uint64_t(1) << (3 * level))){
+        throw std::out_of_range("Error - The block key is outside the snapshot index!");
+    }
+    return {particles + offsets[key], particles + offsets[key + 1]};
+}
+
+std::vector<particle> IndexedSnapshot::query_box(const std::array<double, 3> & lower, const std::array<double, 3> & upper) const {
+    int64_t blocks = int64_t(1) << level;
+    std::array<int64_t, 3> first, last;
+    for (uint axis = 0; axis < 3; axis++){
+        if (!(lower[axis] < upper[axis])){
+            return {};
+        }
+        first[axis] = std::clamp<int64_t>(static_cast<int64_t>(std::floor(lower[axis] * blocks)), 0, blocks - 1);
+        last[axis] = std::clamp<int64_t>(static_cast<int64_t>(std::ceil(upper[axis] * blocks)) - 1, 0, blocks - 1);
+    }
+
+    // keys of the overlapping blocks in file order, consecutive keys are read as one contiguous run
+    std::vector<uint64_t> keys;
+    keys.reserve((last[0] - first[0] + 1) * (last[1] - first[1] + 1) * (last[2] - first[2] + 1));
+    for (int64_t i = first[0]; i <= last[0]; i++){
+        for (int64_t j = first[1]; j <= last[1]; j++){
+            for (int64_t k = first[2]; k <= last[2]; k++){
+                keys.push_back(blockKey(i, j, k, level));
+            }
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<particle> selected;
+    auto inside = [&](const particle & current){
+        for (uint axis = 0; axis < 3; axis++){
+            if (current.position[axis] < lower[axis] || current.position[axis] >= upper[axis]){
+                return false;
+            }
+        }
+        return true;
+    };
+    size_t run_start = 0;
+    for (size_t r = 1; r <= keys.size(); r++){
+        if (r < keys.size() && keys[r] == keys[r - 1] + 1){
+            continue;
+        }
+        const particle * begin = particles + offsets[keys[run_start]];
+        const particle * end = particles + offsets[keys[r - 1] + 1];
+        std::copy_if(begin, end, std::back_inserter(selected), inside);
+        run_start = r;
+    }
+    return selected;
+}
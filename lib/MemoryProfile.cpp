@@ -0,0 +1,99 @@
+#include "MemoryProfile.hpp"
+#include <fstream>
+#include <string>
+#include <sstream>
+
+#ifdef PM_COUNT_ALLOCATIONS
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+
+namespace {
+
+// relaxed, the counts are only read as totals between phases
+std::atomic<uint64_t> allocation_total{0};
+std::atomic<uint64_t> allocated_bytes{0};
+
+void * countedAllocation(std::size_t size, std::size_t alignment){
+    allocation_total.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (size == 0){
+        size = 1;
+    }
+    void * memory = nullptr;
+    if (alignment <= alignof(std::max_align_t)){
+        memory = std::malloc(size);
+    }
+    else if (posix_memalign(&memory, alignment, size) != 0){
+        memory = nullptr;
+    }
+    if (!memory){
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+}
+
+// the array and nothrow forms of the standard library forward to these
+void * operator new(std::size_t size){
+    return countedAllocation(size, alignof(std::max_align_t));
+}
+
+void * operator new(std::size_t size, std::align_val_t alignment){
+    return countedAllocation(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void * memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void * memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void * memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void * memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+bool AllocationCountingEnabled(){
+    return true;
+}
+
+allocation_counts CountAllocations(){
+    return allocation_counts{allocation_total.load(std::memory_order_relaxed), allocated_bytes.load(std::memory_order_relaxed)};
+}
+
+#else
+
+bool AllocationCountingEnabled(){
+    return false;
+}
+
+allocation_counts CountAllocations(){
+    return allocation_counts();
+}
+
+#endif
+
+resident_memory SampleResidentMemory(){
+    resident_memory memory;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)){
+        bool current = line.rfind("VmRSS:", 0) == 0;
+        bool peak = line.rfind("VmHWM:", 0) == 0;
+        if (current || peak){
+            std::istringstream fields(line.substr(6));
+            uint64_t kilobytes = 0;
+            fields >> kilobytes;
+            (current ? memory.current_bytes : memory.peak_bytes) = kilobytes * 1024;
+        }
+    }
+    return memory;
+}
@@ -0,0 +1,166 @@
+#include "ParticleFile.hpp"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+static_assert(std::is_trivially_copyable<particle>::value, "particles are stored in the file as raw records");
+
+constexpr char file_magic[8] = {'P', 'M', 'P', 'A', 'R', 'T', 'S', '1'};
+constexpr size_t header_length = 4096; // one page, so the particle records start page aligned
+
+struct particle_file_header
+{
+    char magic[8];
+    uint64_t num_particles;
+    double mass;
+};
+
+/**
+ * @brief: Page aligned byte range of the mapping covering particles [begin, end), clamped to the particles in the file.
+*/
+std::pair<char *, size_t> pageRange(void * mapping, uint64_t num_particles, uint64_t begin, uint64_t end){
+    end = std::min(end, num_particles);
+    if (begin >= end){
+        return {nullptr, 0};
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = header_length + begin * sizeof(particle);
+    size_t last = header_length + end * sizeof(particle);
+    first -= first % page;
+    return {static_cast<char *>(mapping) + first, last - first};
+}
+
+void writeHeader(std::ofstream & file, double mass, uint64_t num_particles){
+    std::vector<char> header(header_length, 0);
+    particle_file_header fields;
+    std::memcpy(fields.magic, file_magic, sizeof(file_magic));
+    fields.num_particles = num_particles;
+    fields.mass = mass;
+    std::memcpy(header.data(), &fields, sizeof(fields));
+    file.write(header.data(), header.size());
+}
+
+}
+
+MappedParticleFile::MappedParticleFile(const std::string & filename) : mapping(MAP_FAILED), mapping_length(0)
+{
+    file_descriptor = open(filename.c_str(), O_RDWR);
+    if (file_descriptor < 0){
+        throw std::runtime_error("Failed to open the particle file " + filename + ": " + std::strerror(errno));
+    }
+    struct stat file_status;
+    particle_file_header header;
+    if (fstat(file_descriptor, &file_status) != 0 || file_status.st_size < static_cast<off_t>(header_length)
+        || pread(file_descriptor, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0){
+        close(file_descriptor);
+        throw std::invalid_argument("Error - " + filename + " is not a particle file!");
+    }
+    num_particles = header.num_particles;
+    mass = header.mass;
+    mapping_length = header_length + num_particles * sizeof(particle);
+    if (static_cast<size_t>(file_status.st_size) < mapping_length){
+        close(file_descriptor);
+        throw std::invalid_argument("Error - The particle file " + filename + " is shorter than its header states!");
+    }
+
+    mapping = mmap(nullptr, mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+    if (mapping == MAP_FAILED){
+        close(file_descriptor);
+        throw std::runtime_error("Failed to map the particle file " + filename + ": " + std::strerror(errno));
+    }
+    madvise(mapping, mapping_length, MADV_SEQUENTIAL); // chunks are visited in order, lets the kernel read ahead aggressively
+    particles = reinterpret_cast<particle *>(static_cast<char *>(mapping) + header_length);
+}
+
+MappedParticleFile::~MappedParticleFile()
+{
+    munmap(mapping, mapping_length);
+    close(file_descriptor);
+}
+
+uint64_t MappedParticleFile::size() const {
+    return num_particles;
+}
+
+double MappedParticleFile::get_mass() const {
+    return mass;
+}
+
+particle * MappedParticleFile::data(){
+    return particles;
+}
+
+const particle * MappedParticleFile::data() const {
+    return particles;
+}
+
+void MappedParticleFile::prefetch(uint64_t begin, uint64_t end) const {
+    std::pair<char *, size_t> range = pageRange(mapping, num_particles, begin, end);
+    if (range.second > 0){
+        madvise(range.first, range.second, MADV_WILLNEED); // returns immediately, the reads run while the current chunk is processed
+    }
+}
+
+void MappedParticleFile::release(uint64_t begin, uint64_t end) const {
+    std::pair<char *, size_t> range = pageRange(mapping, num_particles, begin, end);
+    if (range.second > 0){
+        madvise(range.first, range.second, MADV_DONTNEED); // shared file mapping, dirty pages stay in the page cache and are not lost
+    }
+}
+
+void WriteParticleFile(const particle_group & particles, const std::string & filename)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    writeHeader(file, particles.mass, particles.particles.size());
+    file.write(reinterpret_cast<const char *>(particles.particles.data()), particles.particles.size() * sizeof(particle));
+    if (!file){
+        throw std::runtime_error("Failed to write the particle file " + filename + ".");
+    }
+}
+
+void CreateUniformParticleFile(const std::string & filename, double mass, uint64_t num_particles, uint random_seed)
+{
+    if (mass <= 0){
+        throw std::invalid_argument("Error - The particle masses must be larger than 0!");
+    }
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    writeHeader(file, mass, num_particles);
+
+    std::default_random_engine generator(random_seed);
+    std::uniform_real_distribution<double> initial_dist(0, 1);
+    std::array<double, 3> initial_position;
+    const uint64_t chunk_size = 1 << 16;
+    std::vector<particle> chunk;
+    chunk.reserve(chunk_size);
+    for (uint64_t i = 0; i < num_particles; i++){
+        for (uint j = 0; j < 3; j++){
+            initial_position[j] = initial_dist(generator);
+        }
+        chunk.push_back(particle(initial_position));
+        if (chunk.size() == chunk_size || i + 1 == num_particles){
+            file.write(reinterpret_cast<const char *>(chunk.data()), chunk.size() * sizeof(particle));
+            chunk.clear();
+        }
+    }
+    if (!file){
+        throw std::runtime_error("Failed to write the particle file " + filename + ".");
+    }
+}
@@ -0,0 +1,70 @@
+#include "ParticleStream.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <type_traits>
+
+namespace {
+
+static_assert(std::is_trivially_copyable<streamed_particle>::value && sizeof(streamed_particle) == 32, "records are written as raw 32 byte records");
+
+constexpr char stream_magic[8] = {'P', 'M', 'S', 'T', 'R', 'M', '0', '1'};
+
+struct stream_header
+{
+    char magic[8];
+    uint32_t kind;
+    uint32_t record_size;
+    double parameters[ParticleStream::num_parameters];
+};
+
+}
+
+ParticleStream::ParticleStream(const std::string & filename, kind output_kind, const std::array<double, num_parameters> & parameters) :
+                                file(filename, std::ios::binary), filename(filename), records_written(0)
+{
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    stream_header header;
+    std::memcpy(header.magic, stream_magic, sizeof(stream_magic));
+    header.kind = static_cast<uint32_t>(output_kind);
+    header.record_size = sizeof(streamed_particle);
+    std::memcpy(header.parameters, parameters.data(), sizeof(header.parameters));
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void ParticleStream::write(const std::vector<streamed_particle> & records){
+    file.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(streamed_particle));
+    records_written += records.size();
+}
+
+bool ParticleStream::good() const {
+    return file.good();
+}
+
+const std::string & ParticleStream::get_filename() const {
+    return filename;
+}
+
+uint64_t ParticleStream::get_records_written() const {
+    return records_written;
+}
+
+std::vector<streamed_particle> ReadParticleStream(const std::string & filename, ParticleStream::kind & output_kind)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    size_t file_size = file.tellg();
+    file.seekg(0);
+    stream_header header;
+    if (file_size < sizeof(header) || !file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, stream_magic, sizeof(stream_magic)) != 0
+        || header.record_size != sizeof(streamed_particle)){
+        throw std::invalid_argument("Error - " + filename + " is not a particle stream!");
+    }
+    output_kind = static_cast<ParticleStream::kind>(header.kind);
+    std::vector<streamed_particle> records((file_size - sizeof(header)) / sizeof(streamed_particle));
+    file.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(streamed_particle));
+    return records;
+}
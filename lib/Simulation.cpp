@@ -6,10 +6,23 @@
 #include <iostream>
 #include <omp.h>
 #include <filesystem>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <random>
+#include <utility>
 
-Simulation::Simulation(double t_max, double t_step, particle_group collection, double W, uint num_cells, double e_factor) : 
-                        time_max(t_max), time_step(t_step), particle_collection(collection), box_width(W), number_of_cells(num_cells),
-                         expansion_factor(e_factor)
+Simulation::Simulation(double t_max, double t_step, particle_group && collection, double W, uint num_cells, double e_factor) : 
+                        time_max(t_max), time_step(t_step), particle_collection(std::move(collection)), box_width(W), number_of_cells(num_cells),
+                         expansion_factor(e_factor), steps_taken(0), current_time(0), velocity_scale(1), image_pyramid(false), halo_link_length(0), halo_min_members(20), halo_interval(0), diagnostics(false), density_power(0), density_mean_mode(0), frame_slots(8), frame_interval(1), frame_overwrite(false), chunk_size(0), next_density_ready(false),
+                         domain_communicator(MPI_COMM_NULL), domain_rank(0), num_domains(1), last_rebalance_step(0), particle_time(0), load_imbalance(1),
+                         counts_valid(false), moves_overflowed(false), moved_particles(0), deposits_since_rebuild(0), incremental_depositions(0), moved_fraction(0),
+                         forces_valid(false), reuses_since_solve(0), displacement_since_solve(0), push_displacement(0), solve_width(W), solved_potential_energy(0),
+                         force_scale(1), force_solves(0), gradient_order(2), forward_plan(nullptr), backward_plan(nullptr)
 {
     if (t_max <= 0){
         throw std::invalid_argument("Error - t_max (maximum time reached) must not be less than or equal to 0!");
@@ -29,6 +42,9 @@ Simulation::Simulation(double t_max, double t_step, particle_group collection, d
     if (num_cells > std::numeric_limits<int>::max()){
         throw std::overflow_error("Error - The number of cells stated is invalid.");
     }
+    if (static_cast<uint64_t>(num_cells) * num_cells * num_cells > std::numeric_limits<uint32_t>::max()){
+        throw std::overflow_error("Error - The number of cells is too large to index the grid with 32 bit cell indices.");
+    }
     if (num_cells > 400){
         std::cerr << "Warning - num_cells (Grid Length) has been set to more than 400 units! This may have adverse effects on performance." << std::endl;
     }
@@ -43,11 +59,35 @@ Simulation::Simulation(double t_max, double t_step, particle_group collection, d
     std::memset(potential_buffer, 0, sizeof(fftw_complex) * buffer_length);
     std::memset(k_space_buffer, 0, sizeof(fftw_complex) * buffer_length);
 
+    uint padded_length = number_of_cells + 2 * ghost_layers;
+    padded_potential.assign(padded_length * padded_length * padded_length, 0);
+    for (std::vector<double> & component : acceleration){
+        component.assign(buffer_length, 0);
+    }
+
     // assign plans
-    forward_plan = fftw_plan_dft_3d(number_of_cells, number_of_cells, number_of_cells, density_buffer, k_space_buffer, FFTW_FORWARD, FFTW_MEASURE);
-    backward_plan = fftw_plan_dft_3d(number_of_cells, number_of_cells, number_of_cells, k_space_buffer, potential_buffer, FFTW_BACKWARD, FFTW_MEASURE);
+    make_plans(tuning.fftw_flags);
+
+    // evaluate the cell of every particle once, afterwards the drift keeps the cache up to date
+    size_t num_particles = particle_collection.get_num_particles();
+    cell_indices.resize(num_particles);
+    #pragma omp parallel for
+    for (size_t particle_index = 0; particle_index < num_particles; particle_index++){
+        cell_indices[particle_index] = cell_index_of(particle_collection.particles[particle_index]);
+    }
 }
 
+Simulation::Simulation(double t_max, double t_step, const std::string & particle_file_path, double W, uint num_cells, double e_factor, uint64_t chunk_particles) :
+                        Simulation(t_max, t_step, particle_group(1, 0, 0u), W, num_cells, e_factor)
+{
+    if (chunk_particles == 0){
+        throw std::invalid_argument("Error - The number of particles per chunk must be larger than 0!");
+    }
+    particle_file = std::make_unique<MappedParticleFile>(particle_file_path);
+    particle_collection.mass = particle_file->get_mass();
+    chunk_size = chunk_particles;
+    next_density.assign(static_cast<size_t>(number_of_cells) * number_of_cells * number_of_cells, 0);
+}
 
 Simulation::~Simulation(){
     fftw_free(density_buffer); // deallocate manually allocated memory in heap to prevent memory leak
@@ -60,160 +100,2097 @@ Simulation::~Simulation(){
 
 void Simulation::run(std::optional<std::string> output_folder)
 {
-    std::string ppc = findsigfig(static_cast<double>(particle_collection.get_num_particles())/static_cast<double>(number_of_cells * number_of_cells * number_of_cells));
+    uint64_t total_particles = particle_count();
+    if (domain_communicator != MPI_COMM_NULL){
+        MPI_Allreduce(MPI_IN_PLACE, &total_particles, 1, MPI_UINT64_T, MPI_SUM, domain_communicator);
+    }
+    std::string ppc = findsigfig(static_cast<double>(total_particles)/static_cast<double>(number_of_cells * number_of_cells * number_of_cells));
+    std::string partial_path;
+    if (output_folder){
+        partial_path = *output_folder + "/" + findsigfig(expansion_factor) + "/"; // directories to be stored
+    }
+    auto file_path = [&](const std::string & prefix, const std::string & extension){
+        return partial_path + prefix + "_dt_" + findsigfig(time_step) + "_time_" + 
+        findsigfig(current_time) + "_num_cells_" + std::to_string(number_of_cells) + "_ppc_" + ppc + extension;
+    };
     
-    double t = 0.0;
+    if (!frame_ring_name.empty() && domain_rank == 0 && !frame_publisher){
+        frame_publisher = std::make_unique<FramePublisher>(frame_ring_name, frame_slots, uint64_t(number_of_cells) * number_of_cells, frame_overwrite);
+    }
+    std::string rank_suffix = num_domains > 1 ? "_rank_" + std::to_string(domain_rank) : ""; // every rank streams and saves statistics for its own particles
+    particle_streams.clear(); // left open if a previous run threw
+    if (block_steps.max_level > 0 && (lightcone_output || !region_outputs.empty())){
+        throw std::runtime_error("Error - Lightcone and region outputs are not available with block time steps!");
+    }
+    if (output_folder && (lightcone_output || !region_outputs.empty())){
+        std::filesystem::create_directories(partial_path);
+        if (lightcone_output){
+            const lightcone_settings & cone = *lightcone_output;
+            particle_streams.push_back(std::make_unique<ParticleStream>(file_path("Lightcone", rank_suffix + ".bin"), ParticleStream::kind::lightcone,
+                std::array<double, ParticleStream::num_parameters>{cone.observer[0], cone.observer[1], cone.observer[2], cone.light_speed, cone.max_radius, 0, 0}));
+        }
+        for (size_t r = 0; r < region_outputs.size(); r++){
+            const region_settings & region = region_outputs[r];
+            particle_streams.push_back(std::make_unique<ParticleStream>(file_path("Region_" + std::to_string(r), rank_suffix + ".bin"), ParticleStream::kind::region,
+                std::array<double, ParticleStream::num_parameters>{region.lower[0], region.lower[1], region.lower[2], region.upper[0], region.upper[1], region.upper[2], double(region.interval)}));
+        }
+        stream_buffers.clear();
+    }
+
     uint counter = 0;
-    while (t < time_max){
-        fill_density_buffer();
-        fill_potential_buffer();
-        update_particles();
-        box_expansion();
-        t += time_step;
+    uint halo_counter = 0;
+    uint frame_counter = 0;
+    while (current_time < time_max){
+        step();
+        allocation_counts output_start = CountAllocations();
+        if (frame_publisher && ++frame_counter >= frame_interval){
+            frame_counter = 0;
+            // projected straight into the ring's slot, the hot path allocates nothing
+            frame_publisher->publish(number_of_cells, current_time, steps_taken, box_width, [&](double * pixels){
+                ProjectDensity(density_buffer, number_of_cells, pixels);
+            });
+        }
         
         if (output_folder){
             counter++;
             if (counter >= 10){
                 counter = 0;
-                std::string partial_path = *output_folder + "/" + findsigfig(expansion_factor) + "/"; // directories to be stored
+                if (domain_rank == 0){ // the density is summed over every rank so one copy of each image is enough
+                    std::filesystem::create_directories(partial_path);
+                    if (image_pyramid){
+                        SavePyramidToFiles(density_buffer, number_of_cells, file_path("UniverseSim", ""), colour_map);
+                    }
+                    else{
+                        SaveToFile(density_buffer, number_of_cells, file_path("UniverseSim", ".pbm"), colour_map);
+                    }
+                }
+                if (render_output){
+                    std::vector<double> image = RenderParticles(particle_collection, *render_output);
+                    if (domain_communicator != MPI_COMM_NULL){ // splats are additive, rank 0 sums the renders of every rank
+                        MPI_Reduce(domain_rank == 0 ? MPI_IN_PLACE : image.data(), image.data(), image.size(), MPI_DOUBLE, MPI_SUM, 0, domain_communicator);
+                    }
+                    if (domain_rank == 0){
+                        SaveRenderToFile(image, *render_output, colour_map, file_path("Render", "_res_" + std::to_string(render_output->resolution) + ".ppm"));
+                    }
+                }
+            }
+            if (halo_link_length > 0 && halo_interval > 0 && ++halo_counter >= halo_interval && current_time < time_max){
+                halo_counter = 0;
                 std::filesystem::create_directories(partial_path);
-                std::string full_path = partial_path + "UniverseSim_dt_" + findsigfig(time_step) + "_time_" + 
-                findsigfig(t) + "_num_cells_" + std::to_string(number_of_cells) + "_ppc_" + ppc + ".pbm";
-                SaveToFile(density_buffer, number_of_cells, full_path);
+                SaveHaloCatalogue(find_halos(halo_link_length, halo_min_members), file_path("Halos", ".csv"));
             }
         }
+        if (diagnostics){
+            run_statistics.back().output_allocations = CountAllocations() - output_start;
+        }
+    }
+    if (frame_publisher){
+        frame_publisher->finish();
+    }
+    std::string failed_stream;
+    for (const std::unique_ptr<ParticleStream> & stream : particle_streams){
+        if (!stream->good()){
+            failed_stream = stream->get_filename();
+        }
+    }
+    particle_streams.clear(); // closes the files
+    if (!failed_stream.empty()){
+        throw std::runtime_error("Failed to write the particle stream " + failed_stream + ".");
+    }
+    if (output_folder && halo_link_length > 0){ // catalogue of the final state
+        std::filesystem::create_directories(partial_path);
+        SaveHaloCatalogue(find_halos(halo_link_length, halo_min_members), file_path("Halos", ".csv"));
+    }
+    if (output_folder && diagnostics){ // statistics hold the particle times of each rank, so every rank saves its own
+        std::filesystem::create_directories(partial_path);
+        SaveRunStatistics(run_statistics, file_path("RunStatistics", rank_suffix + ".csv"));
+        if (domain_rank == 0){ // the grid is summed over every rank, its statistics are the same on all of them
+            SaveDensityStatistics(run_statistics, file_path("DensityStatistics", ".csv"));
+        }
     }
 }
 
-void Simulation::fill_density_buffer(){
-    std::memset(density_buffer, 0, sizeof(fftw_complex) * number_of_cells * number_of_cells * number_of_cells); // initialise density buffer to 0
-    
-    #pragma omp parallel for
-    for (size_t particle_index = 0; particle_index < particle_collection.get_num_particles(); particle_index++){ // iterate through every particle and evaluate position
-        particle& current_particle = particle_collection.particles[particle_index];
-        uint i = std::floor(current_particle.position[0] * number_of_cells);
-        uint j = std::floor(current_particle.position[1] * number_of_cells);
-        uint k = std::floor(current_particle.position[2] * number_of_cells);
-        
-        uint index = k + number_of_cells * (j + number_of_cells * i);
-        double cell_width = (box_width/number_of_cells);
-        double single_density = particle_collection.mass / (cell_width * cell_width * cell_width);
-        // use of atomic to prevent race condition when updating density buffer
-        //#pragma omp critical
-        #pragma omp atomic
-        density_buffer[index][0] += single_density;
+void Simulation::step(){
+    if (diagnostics){
+        step_start_allocations = CountAllocations();
+        phase_memory = {};
+    }
+    bool decomposed = domain_communicator != MPI_COMM_NULL;
+    if (decomposed && decomposition.rebalance_interval > 0 && steps_taken - last_rebalance_step >= decomposition.rebalance_interval){
+        if (load_imbalance > decomposition.imbalance_threshold){ // identical on every rank, so every rank takes part
+            rebalance();
+        }
+        else{
+            last_rebalance_step = steps_taken;
+        }
+    }
+    if (!particle_file && tuning.sort_interval > 0 && steps_taken % tuning.sort_interval == 0){
+        sort_particles();
+    }
+    int threads = tuning.num_threads > 0 ? tuning.num_threads : omp_get_max_threads();
+    double potential_energy = 0; // diagnostic sums, shared by the team and reduced by the kernels
+    double momentum_x = 0, momentum_y = 0, momentum_z = 0;
+    double kinetic_energy = 0;
+    double max_speed_squared = 0;
+    if (block_steps.max_level > 0){
+        // the substeps push a level at a time, so renormalising the stored velocities is done for every particle up front instead of during the push
+        if (pushed_velocity_scale(false) != velocity_scale || pushed_velocity_scale(true) != velocity_scale / expansion_factor){
+            fold_velocity_scale();
+        }
+    }
+    double next_velocity_scale = pushed_velocity_scale(true);
+
+    if (block_steps.max_level > 0){
+        force_scale = 1;
+        take_block_step(threads, potential_energy, momentum_x, momentum_y, momentum_z, kinetic_energy, max_speed_squared);
+    }
+    else{
+        bool solve = needs_force_solve();
+        // a held field was solved for an earlier box width, the acceleration of the same density scales with 1 / W^2
+        force_scale = solve || force_reuse.extrapolate ? 1 : (solve_width / box_width) * (solve_width / box_width);
+        double deposit_end = 0, push_start = 0; // time stamps of the particle phases, taken by the master thread
+        double step_start = omp_get_wtime();
+        uint64_t num_particles = particle_count();
+
+        // one team of threads for the whole step, phases are separated by the barriers of the worksharing constructs
+        #pragma omp parallel num_threads(threads)
+        {
+            if (solve){
+                compute_forces(potential_energy, deposit_end);
+            }
+            if (force_reuse.extrapolate && force_reuse.max_reuse > 0){
+                extrapolate_acceleration(solve);
+            }
+            #pragma omp master
+            {
+                push_start = omp_get_wtime();
+                if (diagnostics){
+                    phase_start_allocations = CountAllocations();
+                }
+            }
+            if (diagnostics){
+                #pragma omp barrier
+            }
+            // kick, drift and velocity expansion share one pass over the particles
+            push_particles(true, 0, num_particles, time_step, momentum_x, momentum_y, momentum_z, kinetic_energy, max_speed_squared);
+        }
+        particle_time = (solve ? deposit_end - step_start : 0) + (omp_get_wtime() - push_start);
+        if (diagnostics){
+            end_phase(StepPhase::push);
+        }
+
+        if (solve){
+            force_solves++;
+            forces_valid = true;
+            reuses_since_solve = 0;
+            displacement_since_solve = 0;
+            solve_width = box_width;
+            solved_potential_energy = potential_energy;
+        }
+        else{
+            reuses_since_solve++;
+            potential_energy = solved_potential_energy * solve_width / box_width; // the energy of a fixed density scales with 1 / W
+        }
+        displacement_since_solve += push_displacement;
+        push_displacement = 0;
+    }
+    if (decomposed){
+        double slowest, total;
+        MPI_Allreduce(&particle_time, &slowest, 1, MPI_DOUBLE, MPI_MAX, domain_communicator);
+        MPI_Allreduce(&particle_time, &total, 1, MPI_DOUBLE, MPI_SUM, domain_communicator);
+        load_imbalance = total > 0 ? slowest * num_domains / total : 1;
+    }
+    box_width *= expansion_factor;
+    velocity_scale = next_velocity_scale;
+    steps_taken++;
+    current_time += time_step;
+    if (diagnostics){
+        record_statistics({momentum_x, momentum_y, momentum_z}, kinetic_energy, potential_energy, max_speed_squared);
     }
 }
 
-void Simulation::fill_potential_buffer(){
-    uint total_size = number_of_cells * number_of_cells * number_of_cells;
-    fftw_execute(forward_plan);
-    k_space_buffer[0][0] = 0; //set first element of the buffer to 0.
-    k_space_buffer[0][1] = 0;
-    
-    #pragma omp parallel for //parallelise
-    for (uint index = 1; index < total_size; index++){
-        uint i = index / (number_of_cells * number_of_cells);
-        uint j = (index / number_of_cells) % number_of_cells;
-        uint k = index % number_of_cells;
-        
-        double cell_num = number_of_cells; //cast to double
-        double norm_factor = -4 * M_PI * box_width * box_width/(i * i + j * j + k * k) * 
-            (1/(8 * cell_num * cell_num * cell_num)); //scale by -4*pi/k^2 and normalisation factor
-    
-        k_space_buffer[index][0] *= norm_factor;
-        k_space_buffer[index][1] *= norm_factor;
+void Simulation::compute_forces(double & potential_energy, double & deposit_end, bool record_density){
+    record_density = record_density && diagnostics;
+    if (diagnostics){
+        #pragma omp master
+        {
+            if (record_density){
+                density_statistics = DensityStatistics();
+                density_statistics.min_density = std::numeric_limits<double>::max();
+                density_power = 0;
+            }
+            phase_start_allocations = CountAllocations();
+        }
+        #pragma omp barrier
+    }
+    deposit_density();
+    #pragma omp master
+    {
+        deposit_end = omp_get_wtime();
+        if (diagnostics){
+            end_phase(StepPhase::deposit);
+        }
+        if (domain_communicator != MPI_COMM_NULL){ // every rank deposited its own particles, the imaginary parts are zero
+            MPI_Allreduce(MPI_IN_PLACE, density_buffer, 2 * buffer_size(), MPI_DOUBLE, MPI_SUM, domain_communicator);
+        }
+        fftw_execute(forward_plan);
     }
+    #pragma omp barrier
+    apply_greens_function(record_density);
+    #pragma omp single
     fftw_execute(backward_plan);
+    if (diagnostics){
+        #pragma omp master
+        end_phase(StepPhase::fft);
+        #pragma omp barrier
+    }
+    fill_ghost_layers(potential_buffer, potential_energy, record_density);
+    apply_stencil();
+    if (diagnostics){
+        #pragma omp master
+        end_phase(StepPhase::gradient);
+        #pragma omp barrier
+    }
+}
+
+void Simulation::end_phase(StepPhase phase){
+    PhaseMemory & current = phase_memory[static_cast<size_t>(phase)];
+    current.allocations += CountAllocations() - phase_start_allocations;
+    current.memory = SampleResidentMemory();
+    phase_start_allocations = CountAllocations();
 }
 
-std::vector<std::vector<std::vector<std::array<double, 3>>>> Simulation::calculate_gradient(const fftw_complex * potential){
-    double cell_width = box_width/number_of_cells;
+bool Simulation::needs_force_solve(){
+    if (force_reuse.extrapolate && force_reuse.max_reuse > 0 && solved_acceleration[0].size() != acceleration[0].size()){
+        for (uint axis = 0; axis < 3; axis++){
+            solved_acceleration[axis].assign(acceleration[axis].size(), 0);
+            acceleration_change[axis].assign(acceleration[axis].size(), 0);
+        }
+        forces_valid = false;
+    }
+    // identical on every rank, every rank takes the same decisions
+    if (force_reuse.max_reuse == 0 || !forces_valid || reuses_since_solve >= force_reuse.max_reuse){
+        return true;
+    }
+    double bound = displacement_since_solve;
+    if (domain_communicator != MPI_COMM_NULL){
+        MPI_Allreduce(MPI_IN_PLACE, &bound, 1, MPI_DOUBLE, MPI_MAX, domain_communicator);
+    }
+    return bound > force_reuse.max_displacement;
+}
 
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> gradient(number_of_cells, std::vector<std::vector<std::array<double, 3>>>(
-        number_of_cells, std::vector<std::array<double, 3>>(number_of_cells, std::array<double, 3>{0, 0, 0}))); // Initialize each std::array<double, 3> with zeros
-    
-    //#pragma omp parallel for
-    #pragma omp parallel for collapse(3) // Parallelize all nested loops
-    for (int i = 0; i < number_of_cells; i++){
-        for (int j = 0; j < number_of_cells; j++){
-            for (int k = 0; k < number_of_cells; k++){
-                int i_high = i + 1;
-                int i_low = i - 1;
-                int j_high = j + 1;
-                int j_low = j - 1;
-                int k_high = k + 1;
-                int k_low = k - 1;
+void Simulation::extrapolate_acceleration(bool solved){
+    double width_squared = box_width * box_width;
+    double steps = reuses_since_solve + 1; // steps since the previous solve, or since the last solve that the field is extrapolated to
+    bool have_previous = forces_valid;
+    for (uint axis = 0; axis < 3; axis++){
+        double * field = acceleration[axis].data();
+        double * solved_field = solved_acceleration[axis].data();
+        double * change = acceleration_change[axis].data();
+        size_t length = acceleration[axis].size();
+        if (solved){
+            #pragma omp for schedule(static) nowait
+            for (size_t index = 0; index < length; index++){
+                double normalised = field[index] * width_squared;
+                change[index] = have_previous ? (normalised - solved_field[index]) / steps : 0;
+                solved_field[index] = normalised;
+            }
+        }
+        else{
+            #pragma omp for schedule(static) nowait
+            for (size_t index = 0; index < length; index++){
+                field[index] = (solved_field[index] + steps * change[index]) / width_squared;
+            }
+        }
+    }
+    #pragma omp barrier
+}
 
-                while (i_high >= number_of_cells){i_high -= number_of_cells;}
-                while (i_low < 0){i_low += number_of_cells;}
-                while (j_high >= number_of_cells){j_high -= number_of_cells;}
-                while (j_low < 0){j_low += number_of_cells;}
-                while (k_high >= number_of_cells){k_high -= number_of_cells;}
-                while (k_low < 0){k_low += number_of_cells;}
+void Simulation::take_block_step(int threads, double & potential_energy, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared){
+    uint max_level = block_steps.max_level;
+    uint64_t substeps = uint64_t(1) << max_level;
+    double substep_energy = 0; // only the energy of the density at the start of the step is recorded
+    // the pushes' sums are replaced by a pass over every particle at the end, each gets its own scratch variable as they are separate reduction items
+    double momentum_x_sum = 0, momentum_y_sum = 0, momentum_z_sum = 0, energy_sum = 0, speed_sum = 0;
+    particle_time = 0;
 
-                gradient[i][j][k][0] = (potential[k + number_of_cells * (j + number_of_cells * i_high)][0] 
-                - potential[k + number_of_cells * (j + number_of_cells * i_low)][0])/(2 * cell_width);
+    for (uint64_t substep = 0; substep < substeps; substep++){
+        // level l is due on every 2^(max_level - l)-th substep, so the due levels are lowest_level to max_level, a contiguous range of particles
+        uint lowest_level = max_level;
+        while (lowest_level > 0 && substep % (uint64_t(1) << (max_level - lowest_level + 1)) == 0){
+            lowest_level--;
+        }
+        double deposit_start = omp_get_wtime(), deposit_end = 0;
+        #pragma omp parallel num_threads(threads)
+        compute_forces(substep == 0 ? potential_energy : substep_energy, deposit_end, substep == 0); // statistics of the same density as the energy
+        particle_time += deposit_end - deposit_start;
 
-                gradient[i][j][k][1] = (potential[k + number_of_cells * (j_high + number_of_cells * (i))][0] 
-                - potential[k + number_of_cells * (j_low + number_of_cells * i)][0])/(2 * cell_width);
-                
-                gradient[i][j][k][2] = (potential[k_high + number_of_cells * (j + number_of_cells * (i))][0] 
-                - potential[k_low + number_of_cells * (j + number_of_cells * i)][0])/(2 * cell_width);
-            }
+        if (substep == 0){ // levels are judged from the forces at the start of the step
+            assign_time_step_levels();
+        }
+        if (diagnostics){
+            phase_start_allocations = CountAllocations(); // after the level assignment, which is part of no phase
+        }
+        double push_start = omp_get_wtime();
+        #pragma omp parallel num_threads(threads)
+        for (uint level = lowest_level; level <= max_level; level++){
+            push_particles(false, level_offsets[level], level_offsets[level + 1], time_step / double(uint64_t(1) << level), momentum_x_sum, momentum_y_sum, momentum_z_sum, energy_sum, speed_sum);
+        }
+        particle_time += omp_get_wtime() - push_start;
+        if (diagnostics){
+            end_phase(StepPhase::push);
+        }
+    }
+
+    if (diagnostics){
+        const std::vector<particle> & particles = particle_collection.particles;
+        size_t num_particles = particles.size();
+        #pragma omp parallel for num_threads(threads) reduction(+: momentum_x, momentum_y, momentum_z, kinetic_energy) reduction(max: max_speed_squared)
+        for (size_t index = 0; index < num_particles; index++){ // raw stored velocities like the sums of push_particles, record_statistics applies the scale after the expansion
+            const std::array<double, 3> & velocity = particles[index].velocity;
+            double speed_squared = velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2];
+            momentum_x += velocity[0];
+            momentum_y += velocity[1];
+            momentum_z += velocity[2];
+            kinetic_energy += speed_squared;
+            max_speed_squared = std::max(max_speed_squared, speed_squared);
         }
     }
-    return gradient;
 }
 
-void Simulation::update_particles(){
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> gradient = calculate_gradient(potential_buffer);
-    
+void Simulation::assign_time_step_levels(){
+    std::vector<particle> & particles = particle_collection.particles;
+    size_t num_particles = particles.size();
+    uint max_level = block_steps.max_level;
+    double max_distance = block_steps.cell_fraction / number_of_cells; // in units of the box
+    std::vector<uint8_t> levels(num_particles);
     #pragma omp parallel for
-    for (size_t index = 0; index < particle_collection.get_num_particles(); index++){
-        particle& current_particle = particle_collection.particles[index];
-        uint i = std::floor(current_particle.position[0] * number_of_cells);
-        uint j = std::floor(current_particle.position[1] * number_of_cells);
-        uint k = std::floor(current_particle.position[2] * number_of_cells);
+    for (size_t p = 0; p < num_particles; p++){
+        const std::array<double, 3> & velocity = particles[p].velocity;
+        uint32_t cell = cell_indices[p];
+        double speed = std::sqrt(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]) * velocity_scale;
+        double magnitude = std::sqrt(acceleration[0][cell] * acceleration[0][cell] + acceleration[1][cell] * acceleration[1][cell] + acceleration[2][cell] * acceleration[2][cell]);
+        double allowed_step = time_step;
+        if (speed > 0){
+            allowed_step = std::min(allowed_step, max_distance / speed);
+        }
+        if (magnitude > 0){
+            allowed_step = std::min(allowed_step, std::sqrt(2 * max_distance / magnitude));
+        }
+        uint level = 0;
+        while (level < max_level && time_step / double(uint64_t(1) << level) > allowed_step){
+            level++;
+        }
+        levels[p] = level;
+    }
 
-        current_particle.velocity[0] += -1 * gradient[i][j][k][0] * time_step;
-        current_particle.velocity[1] += -1 * gradient[i][j][k][1] * time_step;
-        current_particle.velocity[2] += -1 * gradient[i][j][k][2] * time_step;
+    // stable counting sort by level, each thread scatters its own contiguous block so particles keep their order (and any cell sort) within a level
+    int threads = omp_get_max_threads();
+    std::vector<std::vector<uint64_t>> thread_counts(threads, std::vector<uint64_t>(max_level + 1, 0));
+    std::vector<particle> sorted_particles(num_particles, num_particles > 0 ? particles[0] : particle({0, 0, 0}));
+    std::vector<uint32_t> sorted_cells(num_particles);
+    level_offsets.assign(max_level + 2, 0);
+    #pragma omp parallel num_threads(threads)
+    {
+        int thread = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        size_t begin = num_particles * thread / team;
+        size_t end = num_particles * (thread + 1) / team;
+        for (size_t p = begin; p < end; p++){
+            thread_counts[thread][levels[p]]++;
+        }
+        #pragma omp barrier
+        #pragma omp single
+        {
+            uint64_t offset = 0;
+            for (uint level = 0; level <= max_level; level++){
+                level_offsets[level] = offset;
+                for (int t = 0; t < team; t++){
+                    uint64_t count = thread_counts[t][level];
+                    thread_counts[t][level] = offset; // becomes the thread's first slot on the level
+                    offset += count;
+                }
+            }
+            level_offsets[max_level + 1] = offset;
+        }
+        for (size_t p = begin; p < end; p++){
+            uint64_t destination = thread_counts[thread][levels[p]]++;
+            sorted_particles[destination] = particles[p];
+            sorted_cells[destination] = cell_indices[p];
+        }
+    }
+    particles.swap(sorted_particles);
+    cell_indices.swap(sorted_cells);
+    level_counts.resize(max_level + 1);
+    for (uint level = 0; level <= max_level; level++){
+        level_counts[level] = level_offsets[level + 1] - level_offsets[level];
+    }
+}
 
-        current_particle.position[0] += current_particle.velocity[0] * time_step;
-        current_particle.position[1] += current_particle.velocity[1] * time_step;
-        current_particle.position[2] += current_particle.velocity[2] * time_step;
+void Simulation::record_statistics(std::array<double, 3> momentum, double kinetic_energy, double potential_energy, double max_speed_squared){
+    allocation_counts step_allocations = CountAllocations() - step_start_allocations; // before the statistics below allocate
+    if (domain_communicator != MPI_COMM_NULL){ // particle sums over every rank, the potential energy comes from the shared grid
+        double sums[4] = {momentum[0], momentum[1], momentum[2], kinetic_energy};
+        MPI_Allreduce(MPI_IN_PLACE, sums, 4, MPI_DOUBLE, MPI_SUM, domain_communicator);
+        MPI_Allreduce(MPI_IN_PLACE, &max_speed_squared, 1, MPI_DOUBLE, MPI_MAX, domain_communicator);
+        momentum = {sums[0], sums[1], sums[2]};
+        kinetic_energy = sums[3];
+    }
+    double mass = particle_collection.mass;
+    for (double & component : momentum){
+        component *= mass * velocity_scale; // sums are of the stored velocities
+    }
+    DensityStatistics density = density_statistics;
+    density.variance = density_mean_mode > 0 ? density_power / (density_mean_mode * density_mean_mode) : 0; // the cell counts of Parseval and the mean cancel
+    run_statistics.push_back(StepStatistics{current_time, steps_taken, momentum, 0.5 * mass * kinetic_energy * velocity_scale * velocity_scale, 
+        potential_energy, std::sqrt(max_speed_squared) * velocity_scale, particle_count(), particle_time, load_imbalance, density, step_allocations, allocation_counts(),
+        SampleResidentMemory(), phase_memory});
+}
 
-        // apply boundary conditions
-        while (current_particle.position[0] < 0){current_particle.position[0] +=1;}
-        while (current_particle.position[0] >= 1){current_particle.position[0] -= 1;}
-        while (current_particle.position[1] < 0){current_particle.position[1] += 1;}
-        while (current_particle.position[1] >= 1){current_particle.position[1] -= 1;}
-        while (current_particle.position[2] < 0){current_particle.position[2] += 1;}
-        while (current_particle.position[2] >= 1){current_particle.position[2] -= 1;}
+void Simulation::advance_to(double t){
+    while (current_time < t){
+        step();
     }
 }
 
-void Simulation::box_expansion(){
-    box_width *= expansion_factor;
+StepRange Simulation::steps(double t_end){
+    return StepRange(*this, t_end);
+}
+
+StepView Simulation::view() const {
+    return StepView{current_time, steps_taken, box_width, number_of_cells, particle_collection, velocity_scale, cell_indices, density_buffer, potential_buffer};
+}
+
+std::vector<halo> Simulation::find_halos(double link_length, uint min_members) const {
+    require_in_memory("The halo finder");
+    require_single_domain("The halo finder");
+    if (bricked_layout()){ // the halo finder walks the neighbouring cells by their row major index
+        uint n = number_of_cells;
+        std::vector<uint32_t> row_major_cells(cell_indices.size());
+        #pragma omp parallel for
+        for (size_t p = 0; p < row_major_cells.size(); p++){
+            const std::array<double, 3> & position = particle_collection.particles[p].position;
+            uint i = std::min(static_cast<uint>(position[0] * n), n - 1);
+            uint j = std::min(static_cast<uint>(position[1] * n), n - 1);
+            uint k = std::min(static_cast<uint>(position[2] * n), n - 1);
+            row_major_cells[p] = k + n * (j + n * i);
+        }
+        return friendsOfFriends(particle_collection, row_major_cells, number_of_cells, link_length, min_members, velocity_scale);
+    }
+    return friendsOfFriends(particle_collection, cell_indices, number_of_cells, link_length, min_members, velocity_scale);
+}
+
+void Simulation::set_halo_output(double link_length, uint min_members, uint interval){
+    require_in_memory("The halo finder");
+    require_single_domain("The halo finder");
+    if (link_length <= 0 || link_length > 1){
+        throw std::invalid_argument("Error - The halo link length must be larger than 0 and at most 1 cell width!");
+    }
+    halo_link_length = link_length;
+    halo_min_members = min_members;
+    halo_interval = interval;
+}
+
+void Simulation::set_image_output(const ColourMap & colour_map, bool pyramid){
+    this->colour_map = colour_map;
+    image_pyramid = pyramid;
+}
+
+void Simulation::set_domain_decomposition(MPI_Comm communicator, const decomposition_settings & settings){
+    require_in_memory("Domain decomposition");
+    int initialised;
+    MPI_Initialized(&initialised);
+    if (!initialised){
+        throw std::runtime_error("Error - MPI must be initialised before the particles can be decomposed over ranks!");
+    }
+    if (settings.curve_level == 0 || settings.curve_level > 8){
+        throw std::invalid_argument("Error - The space filling curve level must be between 1 and 8!");
+    }
+    if (settings.imbalance_threshold < 1){
+        throw std::invalid_argument("Error - The load imbalance threshold must be at least 1!");
+    }
+    int thread_support;
+    MPI_Query_thread(&thread_support);
+    if (thread_support < MPI_THREAD_FUNNELED){
+        std::cerr << "Warning - MPI was not initialised with MPI_THREAD_FUNNELED, MPI is called from the master thread inside OpenMP parallel regions." << std::endl;
+    }
+    domain_communicator = communicator;
+    MPI_Comm_rank(communicator, &domain_rank);
+    MPI_Comm_size(communicator, &num_domains);
+    decomposition = settings;
+    rebalance(); // no costs have been measured yet, so the first cut balances particle counts
+}
+
+void Simulation::rebalance(){
+    // stored velocities are relative to the scale of their rank, which a const get_particle_collection may have folded on this rank only,
+    // so every rank ships physical velocities
+    fold_velocity_scale();
+    std::vector<particle> & particles = particle_collection.particles;
+    size_t num_particles = particles.size();
+    uint level = decomposition.curve_level;
+    size_t num_bins = size_t(1) << (3 * level);
+
+    // every particle of a rank carries that rank's measured cost per particle, so ranks that ran slow hand over particles
+    double weight = particle_time > 0 && num_particles > 0 ? particle_time / num_particles : 1;
+    std::vector<uint64_t> keys(num_particles);
+    std::vector<double> bin_weights(num_bins, 0);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        keys[p] = MortonKey(particles[p].position, level);
+        #pragma omp atomic
+        bin_weights[keys[p]] += weight;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, bin_weights.data(), num_bins, MPI_DOUBLE, MPI_SUM, domain_communicator);
+    std::vector<int> owners = PartitionCurve(bin_weights, num_domains);
+
+    std::vector<int> destinations(num_particles);
+    #pragma omp parallel for
+    for (size_t p = 0; p < num_particles; p++){
+        destinations[p] = owners[keys[p]];
+    }
+    particles = MigrateParticles(particles, destinations, domain_communicator);
 
+    cell_indices.resize(particles.size());
     #pragma omp parallel for
-    for (size_t i = 0; i < particle_collection.get_num_particles(); i++){
-        particle_collection.particles[i].velocity[0] /= expansion_factor;
-        particle_collection.particles[i].velocity[1] /= expansion_factor;
-        particle_collection.particles[i].velocity[2] /= expansion_factor;
+    for (size_t p = 0; p < particles.size(); p++){
+        cell_indices[p] = cell_index_of(particles[p]);
     }
+    sort_particles(); // received particles are grouped by source rank, order them by cell for the deposit
+    counts_valid = false; // the incremental deposition counts every particle again after the migration
+    forces_valid = false;
+    last_rebalance_step = steps_taken;
 }
 
+void Simulation::set_render_output(const render_settings & settings){
+    require_in_memory("Particle rendering");
+    if (settings.resolution == 0 || settings.tile_size == 0){
+        throw std::invalid_argument("Error - The render resolution and tile size must be larger than 0!");
+    }
+    render_output = settings;
+}
 
-const fftw_complex* Simulation::get_density_buffer() const {
-    return density_buffer;
+void Simulation::set_frame_publishing(const std::string & name, uint num_slots, uint interval, bool overwrite){
+    if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos){
+        throw std::invalid_argument("Error - The frame ring name must be a '/' followed by a name without further slashes!");
+    }
+    if (num_slots < 2 || interval == 0){
+        throw std::invalid_argument("Error - The frame ring needs at least 2 slots and the publishing interval must be larger than 0!");
+    }
+    frame_ring_name = name;
+    frame_slots = num_slots;
+    frame_interval = interval;
+    frame_overwrite = overwrite;
+    frame_publisher.reset(); // recreated with the new settings by the next run()
 }
 
-const fftw_complex* Simulation::get_potential_buffer() const{
-    return potential_buffer;
+void Simulation::set_lightcone_output(const lightcone_settings & settings){
+    if (settings.light_speed <= 0 || settings.max_radius <= 0 || settings.max_radius > 0.5){
+        throw std::invalid_argument("Error - The speed of light must be larger than 0 and the lightcone radius must be between 0 and half the box!");
+    }
+    for (double coordinate : settings.observer){
+        if (coordinate < 0 || coordinate >= 1){
+            throw std::invalid_argument("Error - The observer must be inside the unit box!");
+        }
+    }
+    lightcone_output = settings;
 }
 
-const particle_group & Simulation::get_particle_collection() const {
-    return particle_collection;
-}
\ No newline at end of file
+void Simulation::add_region_output(const region_settings & settings){
+    if (settings.interval == 0){
+        throw std::invalid_argument("Error - The region output interval must be larger than 0!");
+    }
+    for (uint axis = 0; axis < 3; axis++){
+        if (settings.lower[axis] < 0 || settings.upper[axis] > 1 || settings.lower[axis] >= settings.upper[axis]){
+            throw std::invalid_argument("Error - A region of interest must be a non empty box inside the unit cube!");
+        }
+    }
+    region_outputs.push_back(settings);
+}
+
+void Simulation::set_block_time_steps(const block_step_settings & settings){
+    require_in_memory("Block time steps");
+    if (settings.max_level > 0 && force_reuse.max_reuse > 0){
+        throw std::runtime_error("Error - Block time steps are not available with force reuse!");
+    }
+    if (settings.max_level > 10){
+        throw std::invalid_argument("Error - The deepest block time step level must be at most 10!");
+    }
+    if (settings.cell_fraction <= 0){
+        throw std::invalid_argument("Error - The cell fraction of the block time steps must be larger than 0!");
+    }
+    block_steps = settings;
+    if (settings.max_level == 0){
+        level_offsets.clear();
+        level_counts.clear();
+    }
+}
+
+void Simulation::set_force_reuse(const force_reuse_settings & settings){
+    if (settings.max_reuse > 0){
+        require_in_memory("Force reuse");
+        if (block_steps.max_level > 0){
+            throw std::runtime_error("Error - Force reuse is not available with block time steps!");
+        }
+        if (settings.max_displacement <= 0){
+            throw std::invalid_argument("Error - The displacement bound of the force reuse must be larger than 0!");
+        }
+    }
+    force_reuse = settings;
+    forces_valid = false;
+    if (!settings.extrapolate || settings.max_reuse == 0){
+        for (uint axis = 0; axis < 3; axis++){
+            solved_acceleration[axis] = std::vector<double>();
+            acceleration_change[axis] = std::vector<double>();
+        }
+    }
+}
+
+uint64_t Simulation::get_force_solves() const {
+    return force_solves;
+}
+
+const std::vector<uint64_t> & Simulation::get_level_counts() const {
+    return level_counts;
+}
+
+void Simulation::set_diagnostics(bool enabled){
+    diagnostics = enabled;
+}
+
+const std::vector<StepStatistics> & Simulation::get_run_statistics() const {
+    return run_statistics;
+}
+
+double Simulation::get_time() const {
+    return current_time;
+}
+
+uint64_t Simulation::get_steps_taken() const {
+    return steps_taken;
+}
+
+namespace {
+
+constexpr char checkpoint_magic[8] = {'P', 'M', 'C', 'H', 'E', 'C', 'K', '1'};
+
+struct checkpoint_header
+{
+    char magic[8];
+    double time_max;
+    double time_step;
+    double box_width;
+    uint64_t num_cells;
+    double expansion_factor;
+    uint64_t steps_taken;
+    double current_time;
+    double velocity_scale; // the stored velocities are saved unscaled so a continued run is bit for bit identical
+    uint64_t gradient_order;
+    double mass;
+    uint64_t num_particles;
+};
+
+}
+
+void Simulation::save_checkpoint(const std::string & filename) const {
+    require_in_memory("Checkpointing");
+    require_single_domain("Checkpointing");
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    checkpoint_header header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    header.time_max = time_max;
+    header.time_step = time_step;
+    header.box_width = box_width;
+    header.num_cells = number_of_cells;
+    header.expansion_factor = expansion_factor;
+    header.steps_taken = steps_taken;
+    header.current_time = current_time;
+    header.velocity_scale = velocity_scale;
+    header.gradient_order = gradient_order;
+    header.mass = particle_collection.mass;
+    header.num_particles = particle_collection.particles.size();
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(particle_collection.particles.data()), particle_collection.particles.size() * sizeof(particle));
+    if (!file){
+        throw std::runtime_error("Failed to write the checkpoint " + filename + ".");
+    }
+}
+
+void Simulation::save_snapshot(const std::string & filename, uint level) const {
+    require_in_memory("Saving a snapshot");
+    SaveIndexedSnapshot(get_particle_collection(), filename, level);
+}
+
+std::unique_ptr<Simulation> Simulation::load_checkpoint(const std::string & filename){
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    checkpoint_header header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0){
+        throw std::invalid_argument("Error - " + filename + " is not a checkpoint file!");
+    }
+    // the sizes are checked before anything is allocated from them, a damaged header must not request an arbitrary amount of memory
+    std::streamoff header_end = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t remaining = uint64_t(file.tellg() - header_end);
+    file.seekg(header_end);
+    if (header.num_particles != remaining / sizeof(particle) || remaining % sizeof(particle) != 0){
+        throw std::invalid_argument("Error - The checkpoint " + filename + " states " + std::to_string(header.num_particles) + " particles but holds "
+                                    + std::to_string(remaining) + " bytes of particles!");
+    }
+    // the same limit as the constructor, checked here so the grid size cannot wrap around when it is narrowed to uint
+    if (header.num_cells == 0 || header.num_cells > std::numeric_limits<uint16_t>::max()
+        || header.num_cells * header.num_cells * header.num_cells > std::numeric_limits<uint32_t>::max()){
+        throw std::invalid_argument("Error - The checkpoint " + filename + " states an invalid number of cells (" + std::to_string(header.num_cells) + ")!");
+    }
+    std::vector<particle> particles(header.num_particles);
+    if (!file.read(reinterpret_cast<char *>(particles.data()), particles.size() * sizeof(particle))){
+        throw std::runtime_error("Failed to read the checkpoint " + filename + ".");
+    }
+
+    auto sim = std::make_unique<Simulation>(header.time_max, header.time_step, particle_group(header.mass, std::move(particles)), header.box_width, header.num_cells, header.expansion_factor);
+    sim->steps_taken = header.steps_taken;
+    sim->current_time = header.current_time;
+    sim->velocity_scale = header.velocity_scale;
+    sim->set_gradient_order(header.gradient_order);
+    return sim;
+}
+
+std::unique_ptr<Simulation> Simulation::branch(const branch_parameters & parameters) const {
+    require_in_memory("Branching");
+    require_single_domain("Branching");
+    auto sim = std::make_unique<Simulation>(time_max, time_step, particle_group(particle_collection), box_width, number_of_cells, expansion_factor);
+    sim->steps_taken = steps_taken;
+    sim->current_time = current_time;
+    sim->velocity_scale = velocity_scale;
+    sim->gradient_order = gradient_order;
+    sim->set_tuning(tuning);
+    sim->block_steps = block_steps;
+    sim->set_force_reuse(force_reuse);
+    if (forces_valid){
+        // the held (or extrapolated) field continues to be reused, so the branch solves at the same steps as this simulation
+        sim->acceleration = acceleration;
+        sim->solved_acceleration = solved_acceleration;
+        sim->acceleration_change = acceleration_change;
+        sim->forces_valid = true;
+        sim->reuses_since_solve = reuses_since_solve;
+        sim->displacement_since_solve = displacement_since_solve;
+        sim->push_displacement = push_displacement;
+        sim->solve_width = solve_width;
+        sim->solved_potential_energy = solved_potential_energy;
+        sim->force_scale = force_scale;
+    }
+    sim->colour_map = colour_map;
+    sim->image_pyramid = image_pyramid;
+    sim->render_output = render_output;
+    sim->halo_link_length = halo_link_length;
+    sim->halo_min_members = halo_min_members;
+    sim->halo_interval = halo_interval;
+    sim->diagnostics = diagnostics;
+    sim->run_statistics = run_statistics;
+    sim->lightcone_output = lightcone_output;
+    sim->region_outputs = region_outputs;
+    sim->apply_branch(parameters);
+    return sim;
+}
+
+void Simulation::run_ensemble(const std::vector<branch_parameters> & branches, std::optional<std::string> output_folder) const {
+    for (size_t b = 0; b < branches.size(); b++){
+        std::unique_ptr<Simulation> sim = branch(branches[b]);
+        sim->run(output_folder ? std::optional<std::string>(*output_folder + "/branch_" + std::to_string(b)) : std::nullopt);
+    }
+}
+
+void Simulation::apply_branch(const branch_parameters & parameters){
+    if ((parameters.time_step && *parameters.time_step <= 0) || (parameters.time_max && *parameters.time_max <= 0)){
+        throw std::invalid_argument("Error - The time step and maximum time of a branch must be larger than 0!");
+    }
+    if (parameters.expansion_factor && *parameters.expansion_factor <= 0){
+        throw std::invalid_argument("Error - e_factor (expansion factor) must be larger than 0!");
+    }
+    if (parameters.position_perturbation < 0){
+        throw std::invalid_argument("Error - The position perturbation of a branch must not be negative!");
+    }
+    if (parameters.time_step && *parameters.time_step != time_step){
+        forces_valid = false; // the extrapolation of a reused field is per step
+    }
+    time_max = parameters.time_max.value_or(time_max);
+    time_step = parameters.time_step.value_or(time_step);
+    expansion_factor = parameters.expansion_factor.value_or(expansion_factor);
+    if (parameters.position_perturbation > 0){
+        std::default_random_engine generator(parameters.perturbation_seed);
+        std::uniform_real_distribution<double> displacement(-parameters.position_perturbation / number_of_cells, parameters.position_perturbation / number_of_cells);
+        for (size_t p = 0; p < particle_collection.particles.size(); p++){
+            std::array<double, 3> & position = particle_collection.particles[p].position;
+            for (uint axis = 0; axis < 3; axis++){
+                position[axis] += displacement(generator);
+                position[axis] -= std::floor(position[axis]); // periodic box
+            }
+            cell_indices[p] = cell_index_of(particle_collection.particles[p]);
+        }
+        counts_valid = false;
+        forces_valid = false;
+    }
+}
+
+StepRange::StepRange(Simulation & sim, double t_end) : simulation(sim), time_end(t_end) {}
+
+StepRange::iterator StepRange::begin(){
+    return iterator(&simulation, time_end);
+}
+
+StepRange::iterator StepRange::end(){
+    return iterator(nullptr, time_end);
+}
+
+StepRange::iterator::iterator(Simulation * sim, double t_end) : simulation(sim), time_end(t_end)
+{
+    ++(*this); // the first element is the state after the first step
+}
+
+StepView StepRange::iterator::operator*() const {
+    return simulation->view();
+}
+
+StepRange::iterator & StepRange::iterator::operator++(){
+    if (simulation){
+        if (simulation->get_time() < time_end){
+            simulation->step();
+        }
+        else{
+            simulation = nullptr;
+        }
+    }
+    return *this;
+}
+
+bool StepRange::iterator::operator==(const StepRange::iterator & other) const {
+    return simulation == other.simulation;
+}
+
+bool StepRange::iterator::operator!=(const StepRange::iterator & other) const {
+    return !(*this == other);
+}
+
+void Simulation::fill_density_buffer(){
+    #pragma omp parallel
+    deposit_density();
+    if (domain_communicator != MPI_COMM_NULL){
+        MPI_Allreduce(MPI_IN_PLACE, density_buffer, 2 * buffer_size(), MPI_DOUBLE, MPI_SUM, domain_communicator);
+    }
+}
+
+void Simulation::fill_potential_buffer(){
+    fftw_execute(forward_plan);
+    #pragma omp parallel
+    apply_greens_function();
+    fftw_execute(backward_plan);
+}
+
+void Simulation::set_gradient_order(uint order){
+    if (order != 2 && order != 4){
+        throw std::invalid_argument("Error - The gradient order must be either 2 or 4!");
+    }
+    gradient_order = order;
+    forces_valid = false;
+}
+
+void Simulation::calculate_gradient(const fftw_complex * potential){
+    double potential_energy = 0; // unused, nothing is recorded for a gradient on its own
+    forces_valid = false;
+    #pragma omp parallel
+    {
+        fill_ghost_layers(potential, potential_energy);
+        apply_stencil();
+    }
+}
+
+void Simulation::update_particles(){
+    require_in_memory("update_particles");
+    double potential_energy = 0;
+    double momentum_x = 0, momentum_y = 0, momentum_z = 0;
+    double kinetic_energy = 0;
+    double max_speed_squared = 0;
+    double next_velocity_scale = pushed_velocity_scale(false);
+    forces_valid = false;
+    force_scale = 1;
+    if (diagnostics){
+        step_start_allocations = CountAllocations();
+        phase_memory = {};
+    }
+    #pragma omp parallel
+    {
+        fill_ghost_layers(potential_buffer, potential_energy);
+        apply_stencil();
+        push_particles(false, 0, particle_count(), time_step, momentum_x, momentum_y, momentum_z, kinetic_energy, max_speed_squared);
+    }
+    velocity_scale = next_velocity_scale;
+    if (diagnostics){
+        record_statistics({momentum_x, momentum_y, momentum_z}, kinetic_energy, potential_energy, max_speed_squared);
+        run_statistics.back().density = DensityStatistics(); // the density buffer was filled by the caller, not deposited by a step
+    }
+}
+
+void Simulation::box_expansion(){
+    require_in_memory("box_expansion");
+    box_width *= expansion_factor;
+    velocity_scale /= expansion_factor; // the particles are untouched, the next push renormalises if the scale gets extreme
+}
+
+namespace {
+
+// Grid sizes handed to the kernel templates. fixed_grid makes the number of cells a compile time constant so index arithmetic folds and vectorises with known strides.
+template <uint N>
+struct fixed_grid
+{
+    static constexpr uint size(){ return N; }
+};
+
+struct dynamic_grid
+{
+    uint cells;
+    uint size() const { return cells; }
+};
+
+// Index of cell (i, j, k) in the bricked layout, bricks are stored in row major order and so are the cells within a brick.
+template <typename Grid>
+uint32_t brickedIndex(Grid grid, uint i, uint j, uint k){
+    constexpr uint b = Simulation::brick_length;
+    const uint bricks = (grid.size() + b - 1) / b;
+    uint brick = (i / b * bricks + j / b) * bricks + k / b;
+    return ((brick * b + i % b) * b + j % b) * b + k % b;
+}
+
+/**
+ * @brief: Calls visitor(bricked_index, row_major_index) for every cell of the grid, brick by brick so that both sides of a conversion stay in cache.
+ * Contains an orphaned worksharing loop over the bricks.
+*/
+template <typename Visitor>
+void forEachBrickedCell(uint n, Visitor && visitor){
+    constexpr uint b = Simulation::brick_length;
+    const uint bricks = (n + b - 1) / b;
+    #pragma omp for collapse(2) schedule(static)
+    for (uint bi = 0; bi < bricks; bi++){
+        for (uint bj = 0; bj < bricks; bj++){
+            for (uint bk = 0; bk < bricks; bk++){
+                size_t brick = ((static_cast<size_t>(bi) * bricks + bj) * bricks + bk) * b * b * b;
+                // partial bricks at the upper faces hold padding cells that are never written
+                uint length_i = std::min(b, n - bi * b), length_j = std::min(b, n - bj * b), length_k = std::min(b, n - bk * b);
+                for (uint ii = 0; ii < length_i; ii++){
+                    for (uint jj = 0; jj < length_j; jj++){
+                        size_t row = static_cast<size_t>(n) * ((bj * b + jj) + static_cast<size_t>(n) * (bi * b + ii)) + bk * b;
+                        size_t brick_row = brick + (ii * b + jj) * b;
+                        for (uint kk = 0; kk < length_k; kk++){
+                            visitor(brick_row + kk, row + kk);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <typename Kernel, size_t... I>
+bool callFixedGrid(uint num_cells, Kernel && kernel, std::index_sequence<I...>){
+    return ((num_cells == Simulation::specialised_grid_sizes[I] ? (kernel(fixed_grid<Simulation::specialised_grid_sizes[I]>()), true) : false) || ...);
+}
+
+}
+
+template <typename Kernel>
+void Simulation::with_grid(Kernel && kernel){
+    if (tuning.specialise_grid && callFixedGrid(number_of_cells, kernel, std::make_index_sequence<specialised_grid_sizes.size()>())){
+        return;
+    }
+    kernel(dynamic_grid{number_of_cells});
+}
+
+// The kernels below only contain orphaned worksharing constructs. They are called from inside a parallel region,
+// either the one opened by the matching public phase function or the single region spanning step().
+// Every thread of the team dispatches to the same grid size, so all of them reach the same worksharing constructs.
+
+void Simulation::deposit_density(){
+    if (particle_file){
+        deposit_streamed_density();
+        return;
+    }
+    if (tuning.incremental_deposition){
+        deposit_counts();
+        return;
+    }
+    size_t buffer_length = static_cast<size_t>(number_of_cells) * number_of_cells * number_of_cells;
+    double cell_width = (box_width/number_of_cells);
+    double single_density = particle_collection.mass / (cell_width * cell_width * cell_width);
+    size_t num_particles = cell_indices.size();
+    int thread = omp_get_thread_num();
+    int threads = omp_get_num_threads();
+    bool bricked = bricked_layout();
+
+    if (tuning.deposition == DepositionStrategy::private_grids){
+        size_t grid_length = field_length();
+        #pragma omp single
+        if (thread_density.size() < static_cast<size_t>(threads)){
+            thread_density.resize(threads);
+        }
+        std::vector<double> & local_density = thread_density[thread];
+        if (local_density.size() != grid_length){
+            local_density.assign(grid_length, 0);
+        }
+
+        #pragma omp for
+        for (size_t particle_index = 0; particle_index < num_particles; particle_index++){ // no other thread writes to this grid so no atomic is needed
+            local_density[cell_indices[particle_index]] += single_density;
+        }
+
+        // sum the per thread grids, clearing them ready for the next step
+        auto reduce_cell = [&](size_t grid_index, size_t index){
+            double total = 0;
+            for (int t = 0; t < threads; t++){
+                total += thread_density[t][grid_index];
+                thread_density[t][grid_index] = 0;
+            }
+            density_buffer[index][0] = total;
+            density_buffer[index][1] = 0;
+        };
+        if (bricked){
+            forEachBrickedCell(number_of_cells, reduce_cell);
+        }
+        else{
+            #pragma omp for schedule(static)
+            for (size_t index = 0; index < buffer_length; index++){
+                reduce_cell(index, index);
+            }
+        }
+        return;
+    }
+
+    // the bricked layout deposits into a separate grid that is copied into the density buffer below, the copy overwrites every cell
+    double * target = bricked ? bricked_density.data() : &density_buffer[0][0];
+    size_t stride = bricked ? 1 : 2; // density_buffer interleaves real and imaginary parts
+    if (!bricked){
+        #pragma omp for schedule(static) // initialise density buffer to 0, parallel replacement for std::memset
+        for (size_t index = 0; index < buffer_length; index++){
+            density_buffer[index][0] = 0;
+            density_buffer[index][1] = 0;
+        }
+    }
+
+    if (tuning.deposition == DepositionStrategy::coalesced){
+        // contiguous block of particles per thread so that runs of particles sharing a cell need a single atomic update
+        size_t begin = num_particles * thread / threads;
+        size_t end = num_particles * (thread + 1) / threads;
+        if (begin < end){
+            uint32_t current_cell = cell_indices[begin];
+            double run_density = 0;
+            for (size_t particle_index = begin; particle_index < end; particle_index++){
+                if (cell_indices[particle_index] != current_cell){
+                    #pragma omp atomic
+                    target[stride * current_cell] += run_density;
+                    current_cell = cell_indices[particle_index];
+                    run_density = 0;
+                }
+                run_density += single_density;
+            }
+            #pragma omp atomic
+            target[stride * current_cell] += run_density;
+        }
+        #pragma omp barrier
+    }
+    else{
+        #pragma omp for
+        for (size_t particle_index = 0; particle_index < num_particles; particle_index++){ // iterate through every particle, cell is read from the cache
+            uint32_t index = cell_indices[particle_index];
+            // use of atomic to prevent race condition when updating density buffer
+            //#pragma omp critical
+            #pragma omp atomic
+            target[stride * index] += single_density;
+        }
+    }
+
+    if (bricked){ // convert to the FFT layout, clearing the bricked grid for the next step in the same pass
+        forEachBrickedCell(number_of_cells, [&](size_t grid_index, size_t index){
+            density_buffer[index][0] = bricked_density[grid_index];
+            density_buffer[index][1] = 0;
+            bricked_density[grid_index] = 0;
+        });
+    }
+}
+
+void Simulation::deposit_counts(){
+    size_t buffer_length = buffer_size();
+    size_t num_particles = cell_indices.size();
+    double cell_width = (box_width/number_of_cells);
+    double single_density = particle_collection.mass / (cell_width * cell_width * cell_width);
+    // every thread reads the shared state here, it is only updated by the single construct at the end
+    bool rebuild = !counts_valid || moves_overflowed || cell_counts.size() != field_length() || moved_particles > tuning.max_moved_fraction * num_particles
+                   || (tuning.full_deposition_interval > 0 && deposits_since_rebuild + 1 >= tuning.full_deposition_interval);
+
+    if (rebuild){
+        #pragma omp single
+        cell_counts.assign(field_length(), 0);
+        uint32_t * counts = cell_counts.data();
+        #pragma omp for
+        for (size_t particle_index = 0; particle_index < num_particles; particle_index++){
+            #pragma omp atomic
+            counts[cell_indices[particle_index]]++;
+        }
+    }
+    else{
+        uint32_t * counts = cell_counts.data();
+        int num_lists = thread_moves.size();
+        #pragma omp for schedule(dynamic)
+        for (int list = 0; list < num_lists; list++){
+            for (const std::pair<uint32_t, uint32_t> & move : thread_moves[list]){
+                #pragma omp atomic
+                counts[move.first]--;
+                #pragma omp atomic
+                counts[move.second]++;
+            }
+        }
+    }
+
+    // the counts are scaled by the density of one particle, which changes as the box expands
+    const uint32_t * counts = cell_counts.data();
+    auto convert_cell = [&](size_t grid_index, size_t index){
+        density_buffer[index][0] = counts[grid_index] * single_density;
+        density_buffer[index][1] = 0;
+    };
+    if (bricked_layout()){
+        forEachBrickedCell(number_of_cells, convert_cell);
+    }
+    else{
+        #pragma omp for schedule(static)
+        for (size_t index = 0; index < buffer_length; index++){
+            convert_cell(index, index);
+        }
+    }
+
+    #pragma omp single
+    {
+        moved_fraction = num_particles > 0 ? static_cast<double>(moved_particles) / num_particles : 0;
+        for (std::vector<std::pair<uint32_t, uint32_t>> & moves : thread_moves){
+            moves.clear();
+        }
+        moved_particles = 0;
+        moves_overflowed = false;
+        counts_valid = true;
+        deposits_since_rebuild = rebuild ? 0 : deposits_since_rebuild + 1;
+        incremental_depositions += rebuild ? 0 : 1;
+    }
+}
+
+void Simulation::deposit_streamed_density(){
+    size_t buffer_length = static_cast<size_t>(number_of_cells) * number_of_cells * number_of_cells;
+
+    if (next_density_ready){ // deposited by the push of the previous step, only the grid is touched
+        #pragma omp for schedule(static)
+        for (size_t index = 0; index < buffer_length; index++){
+            density_buffer[index][0] = next_density[index];
+            density_buffer[index][1] = 0;
+            next_density[index] = 0;
+        }
+        #pragma omp single nowait
+        next_density_ready = false; // every thread has read the flag before the barrier of the loop
+        return;
+    }
+
+    #pragma omp for schedule(static)
+    for (size_t index = 0; index < buffer_length; index++){
+        density_buffer[index][0] = 0;
+        density_buffer[index][1] = 0;
+    }
+
+    double cell_width = (box_width/number_of_cells);
+    double single_density = particle_collection.mass / (cell_width * cell_width * cell_width);
+    const particle * particles = particle_file->data();
+    uint64_t num_particles = particle_file->size();
+
+    #pragma omp single nowait
+    particle_file->prefetch(0, chunk_size);
+    for (uint64_t begin = 0; begin < num_particles; begin += chunk_size){
+        uint64_t end = std::min(begin + chunk_size, num_particles);
+        #pragma omp single nowait
+        particle_file->prefetch(end, end + chunk_size); // read ahead while this chunk is deposited
+
+        #pragma omp for
+        for (uint64_t particle_index = begin; particle_index < end; particle_index++){
+            uint32_t index = cell_index_of(particles[particle_index]);
+            #pragma omp atomic
+            density_buffer[index][0] += single_density;
+        }
+
+        #pragma omp single nowait
+        particle_file->release(begin, end);
+    }
+}
+
+void Simulation::apply_greens_function(bool record_density){
+    with_grid([&](auto grid){ apply_greens_function(grid, record_density); });
+}
+
+template <typename Grid>
+void Simulation::apply_greens_function(Grid grid, bool record_density){
+    const uint n = grid.size();
+    uint total_size = n * n * n;
+
+    #pragma omp single nowait
+    {
+        if (record_density){
+            density_mean_mode = k_space_buffer[0][0];
+        }
+        k_space_buffer[0][0] = 0; //set first element of the buffer to 0.
+        k_space_buffer[0][1] = 0;
+    }
+    
+    double thread_power = 0; // Parseval, the variance of the density is the power of the non zero modes over the number of cells squared
+    #pragma omp for nowait
+    for (uint index = 1; index < total_size; index++){
+        if (record_density){
+            thread_power += k_space_buffer[index][0] * k_space_buffer[index][0] + k_space_buffer[index][1] * k_space_buffer[index][1];
+        }
+        uint i = index / (n * n);
+        uint j = (index / n) % n;
+        uint k = index % n;
+        
+        double cell_num = n; //cast to double
+        double norm_factor = -4 * M_PI * box_width * box_width/(i * i + j * j + k * k) * 
+            (1/(8 * cell_num * cell_num * cell_num)); //scale by -4*pi/k^2 and normalisation factor
+    
+        k_space_buffer[index][0] *= norm_factor;
+        k_space_buffer[index][1] *= norm_factor;
+    }
+    if (record_density){
+        #pragma omp atomic
+        density_power += thread_power;
+    }
+    #pragma omp barrier
+}
+
+void Simulation::fill_ghost_layers(const fftw_complex * potential, double & potential_energy, bool record_density){
+    with_grid([&](auto grid){ fill_ghost_layers(grid, potential, potential_energy, record_density); });
+}
+
+template <typename Grid>
+void Simulation::fill_ghost_layers(Grid grid, const fftw_complex * potential, double & potential_energy, bool record_density){
+    const int n = grid.size();
+    int g = ghost_layers;
+    int padded_length = n + 2 * g;
+    size_t plane = static_cast<size_t>(padded_length) * padded_length;
+    // the energy only has a meaning for the potential of the density buffer, which is read while the row is in cache
+    bool accumulate_energy = diagnostics && potential == potential_buffer;
+    double cell_width = box_width/n;
+    double cell_volume = cell_width * cell_width * cell_width;
+    // the mean comes from the zero mode saved by the Green's function pass
+    double inverse_mean = density_mean_mode > 0 ? n * static_cast<double>(n) * n / density_mean_mode : 0;
+    DensityStatistics thread_statistics;
+    thread_statistics.min_density = std::numeric_limits<double>::max();
+    thread_statistics.max_density = 0;
+
+    // copy the potential into the padded grid, periodic neighbours are resolved once per row instead of once per cell
+    #pragma omp for collapse(2) reduction(+: potential_energy)
+    for (int pi = 0; pi < padded_length; pi++){
+        for (int pj = 0; pj < padded_length; pj++){
+            int i = (pi - g + n) % n;
+            int j = (pj - g + n) % n;
+            const fftw_complex * source = potential + n * (j + n * i);
+            double * row = padded_potential.data() + plane * pi + padded_length * pj;
+            for (int pk = 0; pk < g; pk++){
+                row[pk] = source[n - g + pk][0];
+                row[n + g + pk] = source[pk][0];
+            }
+            for (int k = 0; k < n; k++){
+                row[k + g] = source[k][0];
+            }
+            if (accumulate_energy && pi - g == i && pj - g == j){ // interior rows only, ghost rows repeat them
+                const fftw_complex * density = density_buffer + n * (j + n * i);
+                double row_energy = 0;
+                #pragma omp simd reduction(+: row_energy)
+                for (int k = 0; k < n; k++){
+                    row_energy += density[k][0] * source[k][0];
+                }
+                potential_energy += 0.5 * cell_volume * row_energy;
+                if (record_density){
+                    for (int k = 0; k < n; k++){
+                        double relative = density[k][0] * inverse_mean;
+                        thread_statistics.min_density = std::min(thread_statistics.min_density, relative);
+                        thread_statistics.max_density = std::max(thread_statistics.max_density, relative);
+                        if (relative <= 0){
+                            thread_statistics.empty_cells++;
+                            continue;
+                        }
+                        int bin = static_cast<int>(std::floor((std::log10(relative) - density_histogram_start) / density_histogram_width));
+                        thread_statistics.histogram[std::clamp(bin, 0, static_cast<int>(density_histogram_bins) - 1)]++;
+                    }
+                }
+            }
+        }
+    }
+    if (accumulate_energy && record_density){ // every thread merges after the loop, the statistics are read once the parallel region has ended
+        #pragma omp critical(density_statistics)
+        {
+            density_statistics.min_density = std::min(density_statistics.min_density, thread_statistics.min_density);
+            density_statistics.max_density = std::max(density_statistics.max_density, thread_statistics.max_density);
+            density_statistics.empty_cells += thread_statistics.empty_cells;
+            for (uint bin = 0; bin < density_histogram_bins; bin++){
+                density_statistics.histogram[bin] += thread_statistics.histogram[bin];
+            }
+        }
+    }
+}
+
+void Simulation::apply_stencil(){
+    with_grid([&](auto grid){ apply_stencil(grid); });
+}
+
+template <typename Grid>
+void Simulation::apply_stencil(Grid grid){
+    const int n = grid.size();
+    const int g = ghost_layers;
+    const int padded_length = n + 2 * g;
+    const size_t plane = static_cast<size_t>(padded_length) * padded_length;
+    double cell_width = box_width/n;
+
+    double * acceleration_x = acceleration[0].data();
+    double * acceleration_y = acceleration[1].data();
+    double * acceleration_z = acceleration[2].data();
+
+    // differentiates length cells of a row, the output is contiguous in both layouts
+    auto differentiate = [&](const double * centre, double * out_x, double * out_y, double * out_z, int length){
+        if (gradient_order == 4){
+            double factor = -1/(12 * cell_width);
+            #pragma omp simd
+            for (int k = 0; k < length; k++){
+                out_x[k] = factor * (8 * (centre[k + plane] - centre[k - plane]) - (centre[k + 2 * plane] - centre[k - 2 * plane]));
+                out_y[k] = factor * (8 * (centre[k + padded_length] - centre[k - padded_length]) - (centre[k + 2 * padded_length] - centre[k - 2 * padded_length]));
+                out_z[k] = factor * (8 * (centre[k + 1] - centre[k - 1]) - (centre[k + 2] - centre[k - 2]));
+            }
+        }
+        else{
+            double factor = -1/(2 * cell_width);
+            #pragma omp simd
+            for (int k = 0; k < length; k++){
+                out_x[k] = factor * (centre[k + plane] - centre[k - plane]);
+                out_y[k] = factor * (centre[k + padded_length] - centre[k - padded_length]);
+                out_z[k] = factor * (centre[k + 1] - centre[k - 1]);
+            }
+        }
+    };
+    bool bricked = bricked_layout();
+
+    #pragma omp for collapse(2)
+    for (int i = 0; i < n; i++){
+        for (int j = 0; j < n; j++){
+            const double * centre = padded_potential.data() + plane * (i + g) + padded_length * (j + g) + g;
+            if (bricked){ // the stencil writes the acceleration straight into its bricks, one brick row at a time
+                for (int k = 0; k < n; k += brick_length){
+                    size_t offset = brickedIndex(grid, i, j, k);
+                    differentiate(centre + k, acceleration_x + offset, acceleration_y + offset, acceleration_z + offset, std::min<int>(brick_length, n - k));
+                }
+            }
+            else{
+                size_t offset = n * (j + n * i);
+                differentiate(centre, acceleration_x + offset, acceleration_y + offset, acceleration_z + offset, n);
+            }
+        }
+    }
+}
+
+void Simulation::push_particles(bool apply_expansion, uint64_t first, uint64_t last, double step_length, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared){
+    with_grid([&](auto grid){ push_particles(grid, apply_expansion, first, last, step_length, momentum_x, momentum_y, momentum_z, kinetic_energy, max_speed_squared); });
+}
+
+template <typename Grid>
+void Simulation::push_particles(Grid grid, bool apply_expansion, uint64_t first, uint64_t last, double step_length, double & momentum_x, double & momentum_y, double & momentum_z, double & kinetic_energy, double & max_speed_squared){
+    const double * acceleration_x = acceleration[0].data();
+    const double * acceleration_y = acceleration[1].data();
+    const double * acceleration_z = acceleration[2].data();
+
+    // particles held in memory are pushed as a single chunk with the cell index cache, streamed particles chunk by chunk
+    // depositing their new cell into the next step's density while they are resident, the box has expanded by then
+    uint64_t num_particles = last;
+    particle * particles = particle_file ? particle_file->data() : particle_collection.particles.data();
+    uint32_t * cells = particle_file ? nullptr : cell_indices.data();
+    uint64_t chunk = particle_file ? chunk_size : std::max<uint64_t>(last - first, 1);
+
+    // stored velocities are relative to velocity_scale, so the kick and drift apply it and expansion only changes the scale
+    double kick_factor = step_length / velocity_scale * force_scale;
+    double drift_factor = step_length * velocity_scale;
+    double scale_after = apply_expansion ? velocity_scale / expansion_factor : velocity_scale;
+    double fold = scale_after / pushed_velocity_scale(apply_expansion);
+    bool renormalise = fold != 1;
+    double next_cell_width = box_width * expansion_factor / grid.size();
+    double next_single_density = particle_collection.mass / (next_cell_width * next_cell_width * next_cell_width);
+    double * next = next_density.data();
+
+    // particles matching a lightcone or region are collected in per thread buffers while they are in cache
+    bool streaming = !particle_streams.empty();
+    std::vector<std::vector<streamed_particle>> * thread_streams = nullptr;
+    if (streaming){
+        #pragma omp single
+        if (stream_buffers.size() < static_cast<size_t>(omp_get_num_threads())){
+            stream_buffers.resize(omp_get_num_threads(), std::vector<std::vector<streamed_particle>>(particle_streams.size()));
+        }
+        thread_streams = &stream_buffers[omp_get_thread_num()];
+    }
+
+    // particles that change cell are recorded for the incremental deposition, a thread stops recording once it holds its share of the
+    // moves the next deposition may apply, that deposition then counts every particle anyway
+    bool track_displacement = force_reuse.max_reuse > 0;
+    double thread_speed_squared = 0; // largest stored speed after the kick, bounds the drift of the thread's particles
+
+    bool record_moves = cells && tuning.incremental_deposition;
+    std::vector<std::pair<uint32_t, uint32_t>> * moves = nullptr;
+    size_t move_capacity = 0;
+    uint64_t thread_moved = 0;
+    bool thread_overflowed = false;
+    if (record_moves){
+        #pragma omp single
+        if (thread_moves.size() < static_cast<size_t>(omp_get_num_threads())){
+            thread_moves.resize(omp_get_num_threads());
+        }
+        moves = &thread_moves[omp_get_thread_num()];
+        move_capacity = static_cast<size_t>(tuning.max_moved_fraction * particle_count() / omp_get_num_threads()) + 1;
+    }
+
+    if (particle_file){
+        #pragma omp single nowait
+        particle_file->prefetch(first, first + chunk);
+    }
+    for (uint64_t begin = first; begin < num_particles; begin += chunk){
+        uint64_t end = std::min(begin + chunk, num_particles);
+        if (particle_file){
+            #pragma omp single nowait
+            particle_file->prefetch(end, end + chunk);
+        }
+
+        #pragma omp for reduction(+: momentum_x, momentum_y, momentum_z, kinetic_energy) reduction(max: max_speed_squared)
+        for (uint64_t index = begin; index < end; index++){
+            particle& current_particle = particles[index];
+            uint32_t cell_index = cells ? cells[index] : cell_index_of(current_particle, grid); // cell the particle was deposited into
+            std::array<double, 3> old_position = current_particle.position;
+
+            current_particle.velocity[0] += acceleration_x[cell_index] * kick_factor;
+            current_particle.velocity[1] += acceleration_y[cell_index] * kick_factor;
+            current_particle.velocity[2] += acceleration_z[cell_index] * kick_factor;
+
+            if (track_displacement){
+                const std::array<double, 3> & velocity = current_particle.velocity;
+                thread_speed_squared = std::max(thread_speed_squared, velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+            }
+
+            current_particle.position[0] += current_particle.velocity[0] * drift_factor;
+            current_particle.position[1] += current_particle.velocity[1] * drift_factor;
+            current_particle.position[2] += current_particle.velocity[2] * drift_factor;
+
+            // apply boundary conditions
+            while (current_particle.position[0] < 0){current_particle.position[0] +=1;}
+            while (current_particle.position[0] >= 1){current_particle.position[0] -= 1;}
+            while (current_particle.position[1] < 0){current_particle.position[1] += 1;}
+            while (current_particle.position[1] >= 1){current_particle.position[1] -= 1;}
+            while (current_particle.position[2] < 0){current_particle.position[2] += 1;}
+            while (current_particle.position[2] >= 1){current_particle.position[2] -= 1;}
+
+            uint32_t new_cell_index = cell_index_of(current_particle, grid);
+            if (cells){
+                if (record_moves && new_cell_index != cell_index){
+                    thread_moved++;
+                    if (moves->size() < move_capacity){
+                        moves->emplace_back(cell_index, new_cell_index);
+                    }
+                    else{
+                        thread_overflowed = true;
+                    }
+                }
+                cells[index] = new_cell_index; // refresh the cache for the next step
+            }
+            else{
+                #pragma omp atomic
+                next[new_cell_index] += next_single_density;
+            }
+
+            if (streaming){
+                stream_particle(old_position, current_particle, scale_after, *thread_streams);
+            }
+
+            if (renormalise){
+                current_particle.velocity[0] *= fold;
+                current_particle.velocity[1] *= fold;
+                current_particle.velocity[2] *= fold;
+            }
+
+            if (diagnostics){ // sums of the stored velocities at the end of the step, scaled by the particle mass and velocity scale once reduced
+                const std::array<double,3> & velocity = current_particle.velocity;
+                double speed_squared = velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2];
+                momentum_x += velocity[0];
+                momentum_y += velocity[1];
+                momentum_z += velocity[2];
+                kinetic_energy += speed_squared;
+                max_speed_squared = std::max(max_speed_squared, speed_squared);
+            }
+        }
+
+        if (particle_file){
+            #pragma omp single nowait
+            particle_file->release(begin, end);
+        }
+    }
+    if (particle_file){
+        #pragma omp single nowait
+        next_density_ready = true;
+    }
+    if (track_displacement){
+        double thread_displacement = std::sqrt(thread_speed_squared) * std::abs(drift_factor) * grid.size(); // in cells
+        #pragma omp critical(push_displacement)
+        push_displacement = std::max(push_displacement, thread_displacement);
+    }
+    if (record_moves){
+        #pragma omp atomic
+        moved_particles += thread_moved;
+        if (thread_overflowed){
+            #pragma omp atomic write
+            moves_overflowed = true;
+        }
+    }
+    if (streaming){
+        for (size_t stream = 0; stream < thread_streams->size(); stream++){
+            flush_stream_buffer(stream, (*thread_streams)[stream]);
+        }
+    }
+}
+
+void Simulation::stream_particle(const std::array<double, 3> & old_position, const particle & current_particle, double physical_scale, std::vector<std::vector<streamed_particle>> & buffers){
+    const std::array<double, 3> & position = current_particle.position;
+    auto record = [&](double time, const std::array<double, 3> & record_position){
+        return streamed_particle{time, {float(record_position[0]), float(record_position[1]), float(record_position[2])},
+            {float(current_particle.velocity[0] * physical_scale), float(current_particle.velocity[1] * physical_scale), float(current_particle.velocity[2] * physical_scale)}};
+    };
+    auto nearest_image = [](double separation){ return separation - std::round(separation); };
+    size_t stream = 0;
+
+    if (lightcone_output){
+        const lightcone_settings & cone = *lightcone_output;
+        // signed distances to the shell before and after the step, the shell recedes from light_speed * (t_max - t) to light_speed * (t_max - t - dt)
+        double start_radius = cone.light_speed * (time_max - current_time);
+        double end_radius = start_radius - cone.light_speed * time_step;
+        double start_squared = 0, end_squared = 0;
+        for (uint axis = 0; axis < 3; axis++){
+            double start_offset = nearest_image(old_position[axis] - cone.observer[axis]);
+            double end_offset = nearest_image(position[axis] - cone.observer[axis]);
+            start_squared += start_offset * start_offset;
+            end_squared += end_offset * end_offset;
+        }
+        double start_gap = start_radius - std::sqrt(start_squared);
+        double end_gap = end_radius - std::sqrt(end_squared);
+        if (start_gap > 0 && end_gap <= 0){ // the shell passed the particle during the step
+            double fraction = start_gap / (start_gap - end_gap);
+            if (start_radius - fraction * (start_radius - end_radius) <= cone.max_radius){
+                std::array<double, 3> crossing;
+                for (uint axis = 0; axis < 3; axis++){
+                    crossing[axis] = old_position[axis] + fraction * nearest_image(position[axis] - old_position[axis]);
+                    crossing[axis] -= std::floor(crossing[axis]);
+                }
+                buffers[stream].push_back(record(current_time + fraction * time_step, crossing));
+            }
+        }
+        stream++;
+    }
+
+    for (const region_settings & region : region_outputs){
+        if ((steps_taken + 1) % region.interval == 0
+            && position[0] >= region.lower[0] && position[0] < region.upper[0]
+            && position[1] >= region.lower[1] && position[1] < region.upper[1]
+            && position[2] >= region.lower[2] && position[2] < region.upper[2]){
+            buffers[stream].push_back(record(current_time + time_step, position));
+        }
+        stream++;
+    }
+
+    for (size_t s = 0; s < buffers.size(); s++){
+        if (buffers[s].size() >= stream_buffer_records){
+            flush_stream_buffer(s, buffers[s]);
+        }
+    }
+}
+
+void Simulation::flush_stream_buffer(size_t stream, std::vector<streamed_particle> & buffer){
+    if (buffer.empty()){
+        return;
+    }
+    #pragma omp critical(particle_stream)
+    particle_streams[stream]->write(buffer);
+    buffer.clear();
+}
+
+double Simulation::pushed_velocity_scale(bool apply_expansion) const {
+    double scale_after = apply_expansion ? velocity_scale / expansion_factor : velocity_scale;
+    // the scale is folded back into the velocities while the push writes them anyway once it nears the limits of a double,
+    // and every step for particle files so that the file holds physical velocities
+    if (particle_file || scale_after < 1 / velocity_scale_limit || scale_after > velocity_scale_limit){
+        return 1;
+    }
+    return scale_after;
+}
+
+
+void Simulation::make_plans(unsigned fftw_flags){
+    if (forward_plan){
+        fftw_destroy_plan(forward_plan);
+    }
+    if (backward_plan){
+        fftw_destroy_plan(backward_plan);
+    }
+    forward_plan = fftw_plan_dft_3d(number_of_cells, number_of_cells, number_of_cells, density_buffer, k_space_buffer, FFTW_FORWARD, fftw_flags);
+    backward_plan = fftw_plan_dft_3d(number_of_cells, number_of_cells, number_of_cells, k_space_buffer, potential_buffer, FFTW_BACKWARD, fftw_flags);
+}
+
+void Simulation::sort_particles(){
+    require_in_memory("Sorting");
+    size_t buffer_length = field_length();
+    size_t num_particles = cell_indices.size();
+    if (num_particles == 0){
+        return;
+    }
+
+    // counting sort keyed on the cell index cache, offsets[c] ends up as the first slot of cell c
+    std::vector<uint64_t> offsets(buffer_length + 1, 0);
+    #pragma omp parallel for
+    for (size_t particle_index = 0; particle_index < num_particles; particle_index++){
+        #pragma omp atomic
+        offsets[cell_indices[particle_index] + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    std::vector<particle> sorted_particles(num_particles, particle_collection.particles[0]);
+    std::vector<uint32_t> sorted_cells(num_particles);
+    #pragma omp parallel for
+    for (size_t particle_index = 0; particle_index < num_particles; particle_index++){
+        uint32_t cell = cell_indices[particle_index];
+        uint64_t destination;
+        #pragma omp atomic capture
+        destination = offsets[cell]++;
+        sorted_particles[destination] = particle_collection.particles[particle_index];
+        sorted_cells[destination] = cell;
+    }
+    particle_collection.particles.swap(sorted_particles);
+    cell_indices.swap(sorted_cells);
+}
+
+namespace {
+
+std::string deposition_name(DepositionStrategy deposition){
+    switch (deposition){
+        case DepositionStrategy::coalesced: return "coalesced";
+        case DepositionStrategy::private_grids: return "private_grids";
+        default: return "atomic";
+    }
+}
+
+DepositionStrategy parse_deposition(const std::string & name){
+    if (name == "coalesced"){
+        return DepositionStrategy::coalesced;
+    }
+    if (name == "private_grids"){
+        return DepositionStrategy::private_grids;
+    }
+    if (name == "atomic"){
+        return DepositionStrategy::atomic;
+    }
+    throw std::invalid_argument("Error - Unknown deposition strategy " + name + " in tuning profile!");
+}
+
+std::string fftw_flags_name(unsigned fftw_flags){
+    if (fftw_flags == FFTW_ESTIMATE){
+        return "estimate";
+    }
+    if (fftw_flags == FFTW_PATIENT){
+        return "patient";
+    }
+    if (fftw_flags == FFTW_MEASURE){
+        return "measure";
+    }
+    return std::to_string(fftw_flags);
+}
+
+unsigned parse_fftw_flags(const std::string & name){
+    if (name == "estimate"){
+        return FFTW_ESTIMATE;
+    }
+    if (name == "patient"){
+        return FFTW_PATIENT;
+    }
+    if (name == "measure"){
+        return FFTW_MEASURE;
+    }
+    return std::stoul(name);
+}
+
+/**
+ * @brief: Looks up the tuning profile entry for a host, grid size and particle count.
+ * Each line of the profile is "<host> <num_cells> <num_particles> <deposition> <sort_interval> <fftw_flags> <num_threads>", lines starting with # are ignored.
+*/
+std::optional<TuningConfiguration> read_tuning_profile(const std::string & path, const std::string & host, uint num_cells, size_t num_particles){
+    std::ifstream profile(path);
+    std::string line;
+    while (std::getline(profile, line)){
+        if (line.empty() || line[0] == '#'){
+            continue;
+        }
+        std::istringstream entry(line);
+        std::string entry_host, deposition, fftw_flags;
+        uint entry_cells;
+        size_t entry_particles;
+        TuningConfiguration configuration;
+        if (!(entry >> entry_host >> entry_cells >> entry_particles >> deposition >> configuration.sort_interval >> fftw_flags >> configuration.num_threads)){
+            continue;
+        }
+        if (entry_host == host && entry_cells == num_cells && entry_particles == num_particles){
+            configuration.deposition = parse_deposition(deposition);
+            configuration.fftw_flags = parse_fftw_flags(fftw_flags);
+            return configuration;
+        }
+    }
+    return std::nullopt;
+}
+
+void append_tuning_profile(const std::string & path, const std::string & host, uint num_cells, size_t num_particles, const TuningConfiguration & configuration){
+    std::ofstream profile(path, std::ios::app);
+    if (!profile){
+        throw std::runtime_error("Error - Failed to open tuning profile " + path + " for writing!");
+    }
+    profile << host << " " << num_cells << " " << num_particles << " " << deposition_name(configuration.deposition) << " " 
+    << configuration.sort_interval << " " << fftw_flags_name(configuration.fftw_flags) << " " << configuration.num_threads << "\n";
+}
+
+}
+
+std::string TuningConfiguration::to_string() const {
+    return "deposition=" + deposition_name(deposition) + " sort_interval=" + std::to_string(sort_interval) + 
+    " fftw=" + fftw_flags_name(fftw_flags) + " threads=" + (num_threads > 0 ? std::to_string(num_threads) : "max") + 
+    " layout=" + (grid_layout == GridLayout::bricked ? "bricked" : "row_major") + 
+    " incremental=" + (incremental_deposition ? std::to_string(full_deposition_interval) : "off");
+}
+
+void Simulation::set_tuning(const TuningConfiguration & configuration){
+    if (configuration.num_threads < 0){
+        throw std::invalid_argument("Error - The number of threads in a tuning configuration must not be negative!");
+    }
+    if (configuration.fftw_flags != tuning.fftw_flags){
+        make_plans(configuration.fftw_flags);
+    }
+    if (configuration.grid_layout == GridLayout::bricked){
+        require_in_memory("The bricked grid layout");
+    }
+    if (configuration.incremental_deposition){
+        require_in_memory("Incremental deposition");
+        if (configuration.max_moved_fraction < 0 || configuration.max_moved_fraction > 1){
+            throw std::invalid_argument("Error - The largest fraction of moved particles for incremental deposition must be between 0 and 1!");
+        }
+    }
+    if (configuration.deposition != DepositionStrategy::private_grids){
+        thread_density.clear(); // release the per thread grids
+    }
+    GridLayout previous_layout = tuning.grid_layout;
+    tuning = configuration;
+    if (tuning.grid_layout != previous_layout){ // the particle facing grids and the cell index cache change their indexing
+        if (field_length() > std::numeric_limits<uint32_t>::max()){
+            tuning.grid_layout = previous_layout;
+            throw std::overflow_error("Error - The number of cells is too large to index the bricked grid with 32 bit cell indices.");
+        }
+        for (std::vector<double> & component : acceleration){
+            component.assign(field_length(), 0);
+        }
+        size_t num_particles = cell_indices.size();
+        #pragma omp parallel for
+        for (size_t particle_index = 0; particle_index < num_particles; particle_index++){
+            cell_indices[particle_index] = cell_index_of(particle_collection.particles[particle_index]);
+        }
+    }
+    counts_valid = false; // the cell index cache may have been replaced, e.g. by the autotuner
+    forces_valid = false;
+    if (!tuning.incremental_deposition){
+        cell_counts = std::vector<uint32_t>();
+        thread_moves.clear();
+    }
+    if (!bricked_layout() || tuning.deposition == DepositionStrategy::private_grids){
+        bricked_density.clear();
+    }
+    else if (bricked_density.size() != field_length()){
+        bricked_density.assign(field_length(), 0);
+    }
+}
+
+const TuningConfiguration & Simulation::get_tuning() const {
+    return tuning;
+}
+
+double Simulation::time_configuration(const TuningConfiguration & configuration, uint trial_steps, const particle_group & initial_particles, const std::vector<uint32_t> & initial_cells, double initial_width){
+    particle_collection = initial_particles;
+    velocity_scale = 1;
+    cell_indices = initial_cells;
+    box_width = initial_width;
+    set_tuning(configuration);
+
+    // the sort is timed once and amortised over its interval instead of waiting for it to come round during the trial
+    double sort_cost = 0;
+    if (configuration.sort_interval > 0){
+        auto sort_start = std::chrono::steady_clock::now();
+        sort_particles();
+        sort_cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - sort_start).count() / configuration.sort_interval;
+        tuning.sort_interval = 0;
+    }
+
+    step(); // warm up, allocates per thread grids and touches the new plans
+    std::vector<double> step_times;
+    for (uint i = 0; i < trial_steps; i++){
+        auto step_start = std::chrono::steady_clock::now();
+        step();
+        step_times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - step_start).count());
+    }
+    std::sort(step_times.begin(), step_times.end());
+    return step_times[step_times.size() / 2] + sort_cost;
+}
+
+TuningConfiguration Simulation::autotune(uint trial_steps, std::optional<std::string> profile_path){
+    if (trial_steps == 0){
+        throw std::invalid_argument("Error - The autotuner needs at least one trial step!");
+    }
+    require_in_memory("The autotuner");
+    require_single_domain("The autotuner");
+    std::string host = HostName();
+    size_t num_particles = cell_indices.size();
+
+    if (profile_path){
+        std::optional<TuningConfiguration> cached = read_tuning_profile(*profile_path, host, number_of_cells, num_particles);
+        if (cached){
+            // not part of the profile, the layout and incremental deposition are not tuned
+            cached->grid_layout = tuning.grid_layout;
+            cached->incremental_deposition = tuning.incremental_deposition;
+            cached->full_deposition_interval = tuning.full_deposition_interval;
+            cached->max_moved_fraction = tuning.max_moved_fraction;
+            set_tuning(*cached);
+            std::cout << "Autotune: using cached profile " << *profile_path << " for " << host << " - " << tuning.to_string() << std::endl;
+            return tuning;
+        }
+    }
+
+    // state every trial starts from, restored once tuning is finished
+    particle_group initial_particles = get_particle_collection(); // physical velocities, trials restart from a scale of 1
+    std::vector<uint32_t> initial_cells = cell_indices;
+    size_t initial_statistics = run_statistics.size();
+    double initial_width = box_width;
+    uint64_t initial_steps = steps_taken;
+    double initial_time = current_time;
+    uint64_t initial_force_solves = force_solves; // the counters report the run, not the trials
+    uint64_t initial_incremental_depositions = incremental_depositions;
+
+    TuningConfiguration best = tuning;
+    double best_time = time_configuration(best, trial_steps, initial_particles, initial_cells, initial_width);
+    auto try_candidate = [&](const TuningConfiguration & candidate){
+        double candidate_time = time_configuration(candidate, trial_steps, initial_particles, initial_cells, initial_width);
+        if (candidate_time < best_time){
+            best_time = candidate_time;
+            best = candidate;
+        }
+    };
+
+    // options are tuned one at a time, each search starts from the best configuration found so far
+    for (DepositionStrategy deposition : {DepositionStrategy::atomic, DepositionStrategy::coalesced, DepositionStrategy::private_grids}){
+        if (deposition != best.deposition){
+            TuningConfiguration candidate = best;
+            candidate.deposition = deposition;
+            try_candidate(candidate);
+        }
+    }
+    for (uint sort_interval : {0u, 5u, 20u}){
+        if (sort_interval != best.sort_interval){
+            TuningConfiguration candidate = best;
+            candidate.sort_interval = sort_interval;
+            try_candidate(candidate);
+        }
+    }
+    for (unsigned fftw_flags : {FFTW_ESTIMATE, FFTW_MEASURE}){
+        if (fftw_flags != best.fftw_flags){
+            TuningConfiguration candidate = best;
+            candidate.fftw_flags = fftw_flags;
+            try_candidate(candidate);
+        }
+    }
+    int max_threads = omp_get_max_threads();
+    for (int threads : {max_threads, max_threads / 2, max_threads / 4}){
+        if (threads >= 1 && threads != (best.num_threads > 0 ? best.num_threads : max_threads)){
+            TuningConfiguration candidate = best;
+            candidate.num_threads = threads;
+            try_candidate(candidate);
+        }
+    }
+
+    particle_collection = initial_particles;
+    velocity_scale = 1;
+    cell_indices = initial_cells;
+    box_width = initial_width;
+    steps_taken = initial_steps;
+    current_time = initial_time;
+    force_solves = initial_force_solves;
+    incremental_depositions = initial_incremental_depositions;
+    run_statistics.resize(initial_statistics); // drop any diagnostics recorded by the trial steps
+    set_tuning(best);
+
+    if (profile_path){
+        append_tuning_profile(*profile_path, host, number_of_cells, num_particles, best);
+    }
+    std::cout << "Autotune: " << host << " with " << number_of_cells << " cells per length and " << num_particles << " particles - " 
+    << best.to_string() << " (" << best_time << " s per step)" << std::endl;
+    return best;
+}
+
+const fftw_complex* Simulation::get_density_buffer() const {
+    return density_buffer;
+}
+
+const fftw_complex* Simulation::get_potential_buffer() const{
+    return potential_buffer;
+}
+
+const particle_group & Simulation::get_particle_collection() const {
+    fold_velocity_scale();
+    return particle_collection;
+}
+
+void Simulation::fold_velocity_scale() const {
+    if (velocity_scale == 1){
+        return;
+    }
+    size_t num_particles = particle_collection.particles.size();
+    #pragma omp parallel for
+    for (size_t i = 0; i < num_particles; i++){
+        particle_collection.particles[i].velocity[0] *= velocity_scale;
+        particle_collection.particles[i].velocity[1] *= velocity_scale;
+        particle_collection.particles[i].velocity[2] *= velocity_scale;
+    }
+    velocity_scale = 1;
+}
+
+const std::array<std::vector<double>, 3> & Simulation::get_acceleration() const {
+    return acceleration;
+}
+
+const std::vector<uint32_t> & Simulation::get_cell_indices() const {
+    return cell_indices;
+}
+
+uint64_t Simulation::particle_count() const {
+    return particle_file ? particle_file->size() : particle_collection.particles.size();
+}
+
+void Simulation::require_in_memory(const std::string & operation) const {
+    if (particle_file){
+        throw std::runtime_error("Error - " + operation + " is not available when the particles are streamed from a file!");
+    }
+}
+
+void Simulation::require_single_domain(const std::string & operation) const {
+    if (num_domains > 1){
+        throw std::runtime_error("Error - " + operation + " is not available when the particles are distributed over several ranks!");
+    }
+}
+
+size_t Simulation::buffer_size() const {
+    return static_cast<size_t>(number_of_cells) * number_of_cells * number_of_cells;
+}
+
+uint32_t Simulation::cell_index_of(const particle & current_particle) const {
+    return cell_index_of(current_particle, dynamic_grid{number_of_cells});
+}
+
+template <typename Grid>
+uint32_t Simulation::cell_index_of(const particle & current_particle, Grid grid) const {
+    const uint n = grid.size();
+    // positions are never negative so truncation is equivalent to std::floor
+    uint i = std::min(static_cast<uint>(current_particle.position[0] * n), n - 1);
+    uint j = std::min(static_cast<uint>(current_particle.position[1] * n), n - 1);
+    uint k = std::min(static_cast<uint>(current_particle.position[2] * n), n - 1);
+    if (bricked_layout()){
+        return brickedIndex(grid, i, j, k);
+    }
+    return k + n * (j + n * i);
+}
+
+size_t Simulation::field_index(uint i, uint j, uint k) const {
+    if (i >= number_of_cells || j >= number_of_cells || k >= number_of_cells){
+        throw std::out_of_range("Error - The cell is outside the grid!");
+    }
+    if (bricked_layout()){
+        return brickedIndex(dynamic_grid{number_of_cells}, i, j, k);
+    }
+    return k + number_of_cells * (j + static_cast<size_t>(number_of_cells) * i);
+}
+
+double Simulation::get_moved_fraction() const {
+    return moved_fraction;
+}
+
+uint64_t Simulation::get_incremental_depositions() const {
+    return incremental_depositions;
+}
+
+bool Simulation::bricked_layout() const {
+    return tuning.grid_layout == GridLayout::bricked;
+}
+
+size_t Simulation::field_length() const {
+    if (!bricked_layout()){
+        return buffer_size();
+    }
+    size_t padded = (number_of_cells + brick_length - 1) / brick_length * brick_length;
+    return padded * padded * padded;
+}
+void SaveRunStatistics(const std::vector<StepStatistics> & statistics, const std::string & filename)
+{
+    std::ofstream file(filename);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    file << "time,step,px,py,pz,kinetic_energy,potential_energy,max_speed,local_particles,particle_time,load_imbalance,"
+    "step_allocations,step_allocated_bytes,output_allocations,output_allocated_bytes,resident_bytes,peak_resident_bytes";
+    for (const char * phase : step_phase_names){
+        file << "," << phase << "_allocations," << phase << "_allocated_bytes," << phase << "_resident_bytes";
+    }
+    file << "\n";
+    for (const StepStatistics & current : statistics){
+        file << current.time << "," << current.step << ","
+        << current.momentum[0] << "," << current.momentum[1] << "," << current.momentum[2] << ","
+        << current.kinetic_energy << "," << current.potential_energy << "," << current.max_speed << ","
+        << current.local_particles << "," << current.particle_time << "," << current.load_imbalance << ","
+        << current.step_allocations.allocations << "," << current.step_allocations.bytes << ","
+        << current.output_allocations.allocations << "," << current.output_allocations.bytes << ","
+        << current.memory.current_bytes << "," << current.memory.peak_bytes;
+        for (const PhaseMemory & phase : current.phase_memory){
+            file << "," << phase.allocations.allocations << "," << phase.allocations.bytes << "," << phase.memory.current_bytes;
+        }
+        file << "\n";
+    }
+}
+
+void SaveDensityStatistics(const std::vector<StepStatistics> & statistics, const std::string & filename)
+{
+    std::ofstream file(filename);
+    if (!file.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    file << "time,step,variance,min_density,max_density,empty_cells";
+    for (uint bin = 0; bin < density_histogram_bins; bin++){
+        file << ",bin_" << bin;
+    }
+    file << "\n";
+    for (const StepStatistics & current : statistics){
+        const DensityStatistics & density = current.density;
+        file << current.time << "," << current.step << "," << density.variance << "," << density.min_density << "," << density.max_density << "," << density.empty_cells;
+        for (uint64_t count : density.histogram){
+            file << "," << count;
+        }
+        file << "\n";
+    }
+}
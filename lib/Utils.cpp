@@ -9,63 +9,397 @@
 #include <fstream>
 #include <fftw3.h>
 #include <iomanip>
+#include <unistd.h>
 
 using std::fstream;
 using std::vector;
 using std::string;
 
-void SaveToFile(fftw_complex* density_map, const size_t n_cells, const string &filename)
+ColourMap::ColourMap(const string &name, double max_density) : name(name), max_density(max_density), table(table_size)
 {
-    //Write the file header
-    fstream image_file;
-    image_file.open(filename, fstream::out);
+    if (max_density <= 0)
+    {
+        throw std::invalid_argument("Colour map maximum density must be positive.");
+    }
+    scale = (table_size - 1) / max_density;
+    for(size_t i = 0; i < table_size; i++)
+    {
+        double fraction = static_cast<double>(i) / (table_size - 1);
+        // value on the original 0 to 805 ramp, 255 per channel
+        int value = static_cast<int>(fraction * 805);
+        int low = std::min(value, 255);
+        int mid = std::min(std::max(value - 255, 0), 255);
+        int high = std::min(std::max(value - 550, 0), 255);
+        if (name == "classic")
+        {
+            table[i] = {static_cast<unsigned char>(low), static_cast<unsigned char>(mid), static_cast<unsigned char>(high)};
+        }
+        else if (name == "cool")
+        {
+            table[i] = {static_cast<unsigned char>(high), static_cast<unsigned char>(mid), static_cast<unsigned char>(low)};
+        }
+        else if (name == "grey")
+        {
+            unsigned char grey = static_cast<unsigned char>(fraction * 255);
+            table[i] = {grey, grey, grey};
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown colour map " + name + ".");
+        }
+    }
+}
+
+const string &ColourMap::get_name() const
+{
+    return name;
+}
+
+double ColourMap::get_max_density() const
+{
+    return max_density;
+}
+
+vector<double> ProjectDensity(const fftw_complex* density_map, const size_t n_cells)
+{
+    vector<double> density_xy(n_cells*n_cells, 0.0);
+    ProjectDensity(density_map, n_cells, density_xy.data());
+    return density_xy;
+}
+
+void ProjectDensity(const fftw_complex* density_map, const size_t n_cells, double* density_xy)
+{
+    #pragma omp parallel for
+    for(size_t i = 0; i < n_cells; i++)
+    {
+        for(size_t j = 0; j < n_cells; j++)
+        {
+            double column = 0;
+            const fftw_complex* cells = density_map + n_cells*(j + n_cells*i);
+            for(size_t k = 0; k < n_cells; k++)
+            {
+                column += cells[k][0];
+            }
+            density_xy[i*n_cells + j] = column;
+        }
+    }
+}
+
+vector<image_level> BuildProjectionPyramid(const vector<double> &projection, size_t size, size_t min_size)
+{
+    if (projection.size() != size*size)
+    {
+        throw std::invalid_argument("Projection does not have size*size pixels.");
+    }
+    vector<image_level> levels = {{size, projection}};
+    while (levels.back().size > std::max<size_t>(min_size, 1))
+    {
+        const image_level &fine = levels.back();
+        size_t coarse_size = (fine.size + 1) / 2;
+        image_level coarse = {coarse_size, vector<double>(coarse_size*coarse_size)};
+
+        #pragma omp parallel for
+        for(size_t i = 0; i < coarse_size; i++)
+        {
+            for(size_t j = 0; j < coarse_size; j++)
+            {
+                double total = 0;
+                int count = 0;
+                for(size_t fi = 2*i; fi < std::min(2*i + 2, fine.size); fi++)
+                {
+                    for(size_t fj = 2*j; fj < std::min(2*j + 2, fine.size); fj++)
+                    {
+                        total += fine.pixels[fi*fine.size + fj];
+                        count++;
+                    }
+                }
+                coarse.pixels[i*coarse_size + j] = total / count;
+            }
+        }
+        levels.push_back(std::move(coarse));
+    }
+    return levels;
+}
+
+namespace
+{
+/**
+ * @brief: Colours the pixels of a square image in parallel and writes them as a binary ppm (P6) image.
+ * @param normalise: Converts a pixel value into the normalised density passed to the colour map.
+ */
+template <typename Normaliser>
+void SaveImageToPPM(const vector<double> &pixels, size_t size, Normaliser normalise, const ColourMap &colour_map, const string &filename)
+{
+    std::ofstream image_file(filename, std::ios::binary);
     if(!image_file)
     {
         throw std::runtime_error("File failed to open");
     }
-    image_file << "P3\n" << n_cells << " " << n_cells << "\n255\n";
+    image_file << "P6\n" << size << " " << size << "\n255\n";
+
+    vector<unsigned char> bytes(3*pixels.size());
+    #pragma omp parallel for
+    for(size_t i = 0; i < pixels.size(); i++)
+    {
+        const array<unsigned char, 3> &colour = colour_map(normalise(pixels[i]));
+        bytes[3*i] = colour[0];
+        bytes[3*i + 1] = colour[1];
+        bytes[3*i + 2] = colour[2];
+    }
+    image_file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
 
-    vector<double> density_xy(n_cells*n_cells);
+void SaveLevelToPPM(const image_level &level, double mean, const ColourMap &colour_map, const string &filename)
+{
+    double norm = mean > 0 ? 1/mean : 0;
+    SaveImageToPPM(level.pixels, level.size, [norm](double value){ return value*norm; }, colour_map, filename);
+}
 
-    for(size_t i = 0; i < n_cells*n_cells; i++)
+/**
+ * @brief: Cubic spline smoothing kernel of a distance given as a fraction of the kernel radius, unnormalised.
+ */
+double SplineKernel(double u)
+{
+    double q = 2*u;
+    if (q < 1)
     {
-        density_xy[i] = 0;
+        return 1 - 1.5*q*q + 0.75*q*q*q;
     }
-    for(size_t i = 0; i < n_cells; i++)
+    if (q < 2)
     {
-        for(size_t j = 0; j < n_cells; j++)
+        return 0.25*(2 - q)*(2 - q)*(2 - q);
+    }
+    return 0;
+}
+
+/**
+ * @brief: Tiles covered by the wrapped pixel range [low, high] along one axis of the image. At most two segments as the range is shorter than the image.
+ * @return number of tiles written to tiles.
+ */
+size_t TilesInRange(long low, long high, long resolution, long tile_size, array<long, 8> &tiles)
+{
+    size_t count = 0;
+    auto add_segment = [&](long start, long end)
+    {
+        for(long tile = start/tile_size; tile <= end/tile_size && count < tiles.size(); tile++)
         {
-            for(size_t k = 0; k < n_cells; k++)
+            tiles[count++] = tile;
+        }
+    };
+    if (low < 0)
+    {
+        add_segment(low + resolution, resolution - 1);
+        add_segment(0, high);
+    }
+    else if (high >= resolution)
+    {
+        add_segment(low, resolution - 1);
+        add_segment(0, high - resolution);
+    }
+    else
+    {
+        add_segment(low, high);
+    }
+    return count;
+}
+}
+
+vector<double> RenderParticles(const particle_group &particles, const render_settings &settings)
+{
+    long resolution = settings.resolution;
+    long tile_size = settings.tile_size;
+    double radius = settings.smoothing_radius;
+    if (resolution == 0 || tile_size == 0)
+    {
+        throw std::invalid_argument("Render resolution and tile size must be positive.");
+    }
+    if (radius < 0 || 2*radius >= resolution)
+    {
+        throw std::invalid_argument("Smoothing radius must be between 0 and half the render resolution.");
+    }
+    // tiles must be at least as wide as the kernel so a footprint covers at most a few tiles per axis
+    tile_size = std::max(tile_size, static_cast<long>(std::ceil(2*radius + 1)));
+    long tiles_per_side = (resolution + tile_size - 1)/tile_size;
+    size_t num_tiles = tiles_per_side*tiles_per_side;
+    size_t num_particles = particles.particles.size();
+    long reach = static_cast<long>(std::ceil(radius));
+
+    // pixel range [low, high] covered by a particle along one axis, unwrapped
+    auto footprint = [&](double coordinate, long &low, long &high)
+    {
+        double pixel = coordinate*resolution;
+        if (radius == 0)
+        {
+            low = high = std::min(static_cast<long>(pixel), resolution - 1);
+        }
+        else
+        {
+            low = static_cast<long>(std::floor(pixel - radius));
+            high = static_cast<long>(std::floor(pixel + radius));
+        }
+    };
+    auto for_each_tile = [&](const particle &current_particle, auto function)
+    {
+        long x_low, x_high, y_low, y_high;
+        footprint(current_particle.position[0], x_low, x_high);
+        footprint(current_particle.position[1], y_low, y_high);
+        array<long, 8> x_tiles, y_tiles;
+        size_t x_count = TilesInRange(x_low, x_high, resolution, tile_size, x_tiles);
+        size_t y_count = TilesInRange(y_low, y_high, resolution, tile_size, y_tiles);
+        for(size_t a = 0; a < x_count; a++)
+        {
+            for(size_t b = 0; b < y_count; b++)
             {
-                density_xy[i*n_cells + j] += density_map[k + n_cells*(j + n_cells*i)][0];
+                function(x_tiles[a]*tiles_per_side + y_tiles[b]);
             }
         }
+    };
+
+    // bin particles into every tile their kernel touches
+    vector<size_t> tile_start(num_tiles + 1, 0);
+    #pragma omp parallel for
+    for(size_t p = 0; p < num_particles; p++)
+    {
+        for_each_tile(particles.particles[p], [&](size_t tile)
+        {
+            #pragma omp atomic
+            tile_start[tile + 1]++;
+        });
     }
-    auto max = std::max_element(density_xy.begin(), density_xy.end());
-    double mean = std::accumulate(density_xy.begin(), density_xy.end(), 0.0) / (n_cells*n_cells);
-    double norm = 255/mean;
-    for(size_t i = 0; i < n_cells*n_cells; i++)
+    std::partial_sum(tile_start.begin(), tile_start.end(), tile_start.begin());
+    vector<size_t> fill(tile_start.begin(), tile_start.end() - 1);
+    vector<size_t> tile_members(tile_start.back());
+    #pragma omp parallel for
+    for(size_t p = 0; p < num_particles; p++)
     {
-        density_xy[i] *= norm;
+        for_each_tile(particles.particles[p], [&](size_t tile)
+        {
+            size_t slot;
+            #pragma omp atomic capture
+            slot = fill[tile]++;
+            tile_members[slot] = p;
+        });
     }
 
+    vector<double> image(resolution*resolution, 0.0);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t tile = 0; tile < num_tiles; tile++)
+    {
+        vector<double> weights((2*reach + 1)*(2*reach + 1)); // kernel weights of one particle's footprint
+        long tile_x = (tile/tiles_per_side)*tile_size;
+        long tile_y = (tile%tiles_per_side)*tile_size;
+        auto deposit = [&](long i, long j, double value)
+        {
+            i = (i + resolution) % resolution;
+            j = (j + resolution) % resolution;
+            if (i >= tile_x && i < tile_x + tile_size && j >= tile_y && j < tile_y + tile_size)
+            {
+                image[i*resolution + j] += value; // only this thread renders pixels of this tile
+            }
+        };
+        for(size_t slot = tile_start[tile]; slot < tile_start[tile + 1]; slot++)
+        {
+            const particle &current_particle = particles.particles[tile_members[slot]];
+            double px = current_particle.position[0]*resolution;
+            double py = current_particle.position[1]*resolution;
+            long centre_i = std::min(static_cast<long>(px), resolution - 1);
+            long centre_j = std::min(static_cast<long>(py), resolution - 1);
+
+            // normalise over the whole footprint so the particle deposits its full mass however it is split between tiles
+            double total_weight = 0;
+            size_t count = 0;
+            for(long i = centre_i - reach; i <= centre_i + reach && radius > 0; i++)
+            {
+                for(long j = centre_j - reach; j <= centre_j + reach; j++)
+                {
+                    double dx = i + 0.5 - px;
+                    double dy = j + 0.5 - py;
+                    weights[count] = SplineKernel(std::sqrt(dx*dx + dy*dy)/radius);
+                    total_weight += weights[count++];
+                }
+            }
+            if (total_weight == 0)
+            {
+                deposit(centre_i, centre_j, particles.mass);
+                continue;
+            }
+            double scale = particles.mass/total_weight;
+            count = 0;
+            for(long i = centre_i - reach; i <= centre_i + reach; i++)
+            {
+                for(long j = centre_j - reach; j <= centre_j + reach; j++)
+                {
+                    double weight = weights[count++];
+                    if (weight > 0)
+                    {
+                        deposit(i, j, weight*scale);
+                    }
+                }
+            }
+        }
+    }
+    return image;
+}
+
+void SaveRenderToFile(const vector<double> &image, const render_settings &settings, const ColourMap &colour_map, const string &filename)
+{
+    if (image.size() != settings.resolution*settings.resolution)
+    {
+        throw std::invalid_argument("Image does not match the render resolution.");
+    }
+    double mean = std::accumulate(image.begin(), image.end(), 0.0)/image.size();
+    double norm = mean > 0 ? 1/mean : 0;
+    if (settings.log_scale)
+    {
+        double max = *std::max_element(image.begin(), image.end());
+        double log_norm = max > 0 ? colour_map.get_max_density()/std::log1p(max*norm) : 0; // brightest pixel maps to the end of the colour map
+        SaveImageToPPM(image, settings.resolution, [norm, log_norm](double value){ return std::log1p(value*norm)*log_norm; }, colour_map, filename);
+    }
+    else
+    {
+        SaveImageToPPM(image, settings.resolution, [norm](double value){ return value*norm; }, colour_map, filename);
+    }
+}
+
+void SaveToFile(fftw_complex* density_map, const size_t n_cells, const string &filename, const ColourMap &colour_map)
+{
+    //Write the file header
+    fstream image_file;
+    image_file.open(filename, fstream::out);
+    if(!image_file)
+    {
+        throw std::runtime_error("File failed to open");
+    }
+    image_file << "P3\n" << n_cells << " " << n_cells << "\n255\n";
+
+    vector<double> density_xy = ProjectDensity(density_map, n_cells);
+    double mean = std::accumulate(density_xy.begin(), density_xy.end(), 0.0) / (n_cells*n_cells);
+    double norm = mean > 0 ? 1/mean : 0;
+
     for (size_t i = 0; i < n_cells; i++)
     {
         for (size_t j = 0; j < n_cells; j++)
         {
-            // r
-            image_file << std::min(static_cast<int>(density_xy[i * n_cells + j]), 255) << " ";
-            // g
-            image_file << std::min(std::max(static_cast<int>(density_xy[i * n_cells + j] - 255), 0), 255) << " ";
-            // b
-            image_file << std::min(std::max(static_cast<int>(density_xy[i * n_cells + j] - 550), 0), 255) << " ";
+            const array<unsigned char, 3> &colour = colour_map(density_xy[i * n_cells + j] * norm);
+            image_file << static_cast<int>(colour[0]) << " " << static_cast<int>(colour[1]) << " " << static_cast<int>(colour[2]) << " ";
 
             image_file << "\n";
         }
     }
 }
 
-vector<double> correlationFunction(particle_group particles, int n_bins)
+void SavePyramidToFiles(const fftw_complex* density_map, const size_t n_cells, const string &base_filename, const ColourMap &colour_map, size_t min_size)
+{
+    vector<double> density_xy = ProjectDensity(density_map, n_cells);
+    double mean = std::accumulate(density_xy.begin(), density_xy.end(), 0.0) / (n_cells*n_cells); // every level is normalised by the full resolution mean
+    vector<image_level> levels = BuildProjectionPyramid(density_xy, n_cells, min_size);
+    for(size_t level = 0; level < levels.size(); level++)
+    {
+        SaveLevelToPPM(levels[level], mean, colour_map, base_filename + "_level_" + std::to_string(level) + ".ppm");
+    }
+}
+
+vector<double> correlationFunction(const particle_group &particles, int n_bins)
 {
     if(n_bins <= 0)
     {
@@ -225,4 +559,12 @@ std::string removeTrailingDecimalPlaces(double value, uint max_dp){
         idx.emplace(max_dp - 1);
     }
     return formatREALToNDecimalPlaces(value,idx.value());
-}
\ No newline at end of file
+}
+
+std::string HostName(){
+    char name[256] = {0};
+    if (gethostname(name, sizeof(name) - 1) != 0){
+        return "unknown";
+    }
+    return name;
+}
@@ -2,7 +2,38 @@
 #include <random>
 #include <stdexcept>
 #include <iostream>
+#include <string>
+#include <utility>
 
+namespace {
+
+/**
+ * @brief: Checks coordinates against the unit cube in one vectorised parallel pass, throwing the same error as the particle constructor for the first bad value.
+*/
+void validatePositions(const double *coordinates, size_t count){
+    bool valid = true;
+    #pragma omp parallel for simd reduction(&&: valid)
+    for (size_t i = 0; i < count; i++){
+        valid = valid && coordinates[i] >= 0 && coordinates[i] <= 1;
+    }
+    if (valid){
+        return;
+    }
+    for (size_t i = 0; i < count; i++){ // only reached for bad input, so a serial search for the message is fine
+        if (!(coordinates[i] >= 0 && coordinates[i] <= 1)){
+            throw std::range_error("Error - Element in vector " + std::to_string(coordinates[i]) + " is outside of boundary conditions!");
+        }
+    }
+}
+
+const double *flatPositions(const std::vector<std::array<double,3>> &positions, size_t num_particles){
+    if (num_particles != positions.size()){
+        throw std::invalid_argument("Error - The number of particles does not match the size of the given position vector!");
+    }
+    return positions.empty() ? nullptr : positions.data()->data();
+}
+
+}
 
 
 particle::particle(const std::array<double, 3> &initial_position){
@@ -18,23 +49,46 @@ particle::particle(const std::array<double, 3> &initial_position){
 }
 
 
-particle_group::particle_group(double mass, uint num_particles, const std::vector<std::array<double,3>> &positions) : 
-                            mass(mass), num_particles(num_particles) 
+particle_group::particle_group(double mass, size_t num_particles, const std::vector<std::array<double,3>> &positions) : 
+                            particle_group(mass, flatPositions(positions, num_particles), num_particles) {}
+
+particle_group::particle_group(double mass, const double *positions, size_t num_particles) : mass(mass)
 {
+    static_assert(sizeof(std::array<double, 3>) == 3 * sizeof(double), "position arrays are read as a flat buffer");
     if (mass <= 0){
         throw std::invalid_argument("Error - The particle masses must be larger than 0!");
     }
-    if (num_particles != positions.size()){
+    if (num_particles > 0 && positions == nullptr){
         throw std::invalid_argument("Error - The number of particles does not match the size of the given position vector!");
     }
-    for (uint i = 0; i < num_particles; i++){
-        particles.push_back(particle(positions[i]));
+    validatePositions(positions, 3 * num_particles);
+    particles.resize(num_particles); // at rest, only the positions are left to copy
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < num_particles; i++){
+        particles[i].position = {positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]};
+    }
+}
+
+particle_group::particle_group(double mass, std::vector<particle> &&collection) : mass(mass), particles(std::move(collection))
+{
+    if (mass <= 0){
+        throw std::invalid_argument("Error - The particle masses must be larger than 0!");
+    }
+    bool valid = true;
+    #pragma omp parallel for reduction(&&: valid)
+    for (size_t i = 0; i < particles.size(); i++){
+        const std::array<double, 3> &position = particles[i].position;
+        valid = valid && position[0] >= 0 && position[0] <= 1 && position[1] >= 0 && position[1] <= 1 && position[2] >= 0 && position[2] <= 1;
+    }
+    if (!valid){
+        for (const particle &current_particle : particles){
+            validatePositions(current_particle.position.data(), 3);
+        }
     }
 }
 
 
-particle_group::particle_group(double mass, uint num_particles, uint random_seed) :
-                            mass(mass), num_particles(num_particles)
+particle_group::particle_group(double mass, size_t num_particles, uint random_seed) : mass(mass)
 {
     if (mass <= 0){
         throw std::invalid_argument("Error - The particle masses must be larger than 0!");
@@ -45,7 +99,8 @@ particle_group::particle_group(double mass, uint num_particles, uint random_seed
     std::default_random_engine generator(random_seed);
     std::uniform_real_distribution<double> initial_dist(0, 1);
     std::array<double, 3> initial_position;
-    for (uint i = 0; i < num_particles; i++){
+    particles.reserve(num_particles);
+    for (size_t i = 0; i < num_particles; i++){
         for (uint j = 0; j < 3; j++){
             initial_position[j] = initial_dist(generator);
         }
@@ -53,7 +108,6 @@ particle_group::particle_group(double mass, uint num_particles, uint random_seed
     }
 }
 
-size_t particle_group::get_num_particles(){
-    num_particles = particles.size();
-    return num_particles;
+size_t particle_group::get_num_particles() const {
+    return particles.size();
 }
\ No newline at end of file
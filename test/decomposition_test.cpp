@@ -0,0 +1,109 @@
+#include <iostream>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <mpi.h>
+#include "Simulation.hpp"
+
+/**
+ * Two rank test of the domain decomposition. The ranks step a decomposed simulation with an expanding box, so the stored velocities are relative to a
+ * velocity scale other than 1, fold the scale on one rank only and then migrate every particle to the other rank. The gathered particles must match a
+ * simulation of all the particles on a single rank.
+ *
+ * Usage: mpiexec -n 2 DecompositionTest, returns 77 (skipped) with any other number of ranks.
+*/
+
+namespace {
+
+std::vector<particle> gatherParticles(const std::vector<particle> & local, MPI_Comm communicator, int num_ranks){
+    int local_bytes = local.size() * sizeof(particle);
+    std::vector<int> bytes(num_ranks), offsets(num_ranks, 0);
+    MPI_Allgather(&local_bytes, 1, MPI_INT, bytes.data(), 1, MPI_INT, communicator);
+    for (int r = 1; r < num_ranks; r++){
+        offsets[r] = offsets[r - 1] + bytes[r - 1];
+    }
+    std::vector<particle> gathered((offsets.back() + bytes.back()) / sizeof(particle), particle({0, 0, 0}));
+    MPI_Allgatherv(local.data(), local_bytes, MPI_BYTE, gathered.data(), bytes.data(), offsets.data(), MPI_BYTE, communicator);
+    return gathered;
+}
+
+void sortByPosition(std::vector<particle> & particles){
+    std::sort(particles.begin(), particles.end(), [](const particle & a, const particle & b){ return a.position[0] < b.position[0]; });
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+    int rank, num_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    if (num_ranks != 2){
+        if (rank == 0){
+            std::cout << "DecompositionTest needs 2 ranks, skipped." << std::endl;
+        }
+        MPI_Finalize();
+        return 77;
+    }
+
+    double mass = 0.01;
+    uint num_particles = 2000;
+    uint num_cells = 16;
+    double expansion = 1.1;
+    particle_group particles(mass, num_particles, 7);
+    Simulation reference_sim(1, 0.01, particle_group(particles), 1, num_cells, expansion);
+    // rank 0 hands out the initial particles
+    Simulation decomposed_sim(1, 0.01, rank == 0 ? particles : particle_group(mass, std::vector<particle>()), 1, num_cells, expansion);
+    decomposition_settings settings;
+    settings.rebalance_interval = 0;
+    decomposed_sim.set_domain_decomposition(MPI_COMM_WORLD, settings);
+    for (uint i = 0; i < 3; i++){
+        reference_sim.step();
+        decomposed_sim.step();
+    }
+    if (decomposed_sim.view().velocity_scale == 1){
+        std::cerr << "FAILED: the expansion left the velocity scale at 1, the test does not cover the migration of scaled velocities." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (rank == 1){
+        decomposed_sim.get_particle_collection(); // folds the velocity scale of this rank only
+    }
+    // the reversed ranks own each other's segments of the curve, so every particle migrates
+    MPI_Comm reversed;
+    MPI_Comm_split(MPI_COMM_WORLD, 0, num_ranks - 1 - rank, &reversed);
+    decomposed_sim.set_domain_decomposition(reversed, settings);
+    reference_sim.step();
+    decomposed_sim.step();
+
+    std::vector<particle> expected = reference_sim.get_particle_collection().particles;
+    std::vector<particle> gathered = gatherParticles(decomposed_sim.get_particle_collection().particles, reversed, num_ranks);
+    sortByPosition(expected);
+    sortByPosition(gathered);
+    int failures = 0;
+    if (gathered.size() != expected.size()){
+        std::cerr << "FAILED: " << gathered.size() << " particles gathered, " << expected.size() << " expected." << std::endl;
+        failures++;
+    }
+    for (size_t p = 0; p < std::min(gathered.size(), expected.size()) && failures == 0; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            double tolerance = 1e-9 * (std::abs(expected[p].velocity[axis]) + 1e-12);
+            if (std::abs(gathered[p].position[axis] - expected[p].position[axis]) > 1e-12 || std::abs(gathered[p].velocity[axis] - expected[p].velocity[axis]) > tolerance){
+                std::cerr << "FAILED: particle " << p << " differs from the single rank simulation on axis " << axis << ", velocity "
+                          << gathered[p].velocity[axis] << " instead of " << expected[p].velocity[axis] << "." << std::endl;
+                failures++;
+                break;
+            }
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &failures, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0 && failures == 0){
+        std::cout << "DecompositionTest passed." << std::endl;
+    }
+    MPI_Comm_free(&reversed);
+    MPI_Finalize();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <omp.h>
+#include "Simulation.hpp"
+
+/**
+ * Performance regression test. Times fixed size workloads of every Simulation phase, takes the median over repeats and compares it with the
+ * baseline recorded for this host and thread count. Phases slower than tolerance times their baseline fail the test, unless they are slower by less than
+ * the noise floor, which keeps phases that take microseconds from failing on scheduling noise.
+ * The baseline file is only written with --update, which records the current timings of this host. Without a baseline for every phase the test
+ * is skipped (exit code 77), so a new machine cannot pass without ever having been compared.
+ *
+ * Usage: PerformanceTest --baseline <file> [--tolerance <factor>] [--repeats <n>] [--cells <n>] [--ppc <n>] [--floor <seconds>] [--update]
+ * Each baseline line is "<host> <num_threads> <num_cells> <particles_per_cell> <phase> <median_seconds>", lines starting with # are ignored.
+*/
+
+namespace {
+
+struct phase_timing
+{
+    std::string name;
+    double median;
+};
+
+/**
+ * @brief: Median of repeated timings of an operation, after one untimed warm up run. Setup runs before every repeat and is not timed.
+*/
+double median_time(uint repeats, const std::function<void()> & setup, const std::function<void()> & operation){
+    setup();
+    operation();
+    std::vector<double> times;
+    for (uint r = 0; r < repeats; r++){
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        operation();
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+std::vector<phase_timing> time_phases(uint num_cells, uint particles_per_cell, uint repeats){
+    size_t num_particles = static_cast<size_t>(num_cells) * num_cells * num_cells * particles_per_cell;
+    double mass = 10.0 * 10.0 * 10.0 * 10.0 * 10.0/num_particles;
+    double width = 100.0;
+    Simulation sim(1.5, 0.01, particle_group(mass, num_particles, 42), width, num_cells, 1.02);
+    sim.step(); // every buffer holds a realistic state before the phases are timed
+    auto nothing = [](){};
+
+    std::vector<phase_timing> timings;
+    timings.push_back({"fill_density_buffer", median_time(repeats, nothing, [&](){ sim.fill_density_buffer(); })});
+    // the potential transform reads the density, refill it so every repeat starts from the same input
+    timings.push_back({"fill_potential_buffer", median_time(repeats, [&](){ sim.fill_density_buffer(); }, [&](){ sim.fill_potential_buffer(); })});
+    timings.push_back({"calculate_gradient", median_time(repeats, nothing, [&](){ sim.calculate_gradient(sim.get_potential_buffer()); })});
+    timings.push_back({"update_particles", median_time(repeats, nothing, [&](){ sim.update_particles(); })});
+    timings.push_back({"step", median_time(repeats, nothing, [&](){ sim.step(); })});
+    return timings;
+}
+
+std::string baseline_key(const std::string & host, int threads, uint num_cells, uint particles_per_cell, const std::string & phase){
+    return host + " " + std::to_string(threads) + " " + std::to_string(num_cells) + " " + std::to_string(particles_per_cell) + " " + phase;
+}
+
+/**
+ * @brief: Reads every baseline entry, keyed by host, thread count, workload and phase.
+*/
+std::map<std::string, double> read_baseline(const std::string & path){
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)){
+        if (line.empty() || line[0] == '#'){
+            continue;
+        }
+        std::istringstream entry(line);
+        std::string host, phase;
+        int threads;
+        uint num_cells, particles_per_cell;
+        double seconds;
+        if (entry >> host >> threads >> num_cells >> particles_per_cell >> phase >> seconds){
+            baseline[baseline_key(host, threads, num_cells, particles_per_cell, phase)] = seconds;
+        }
+    }
+    return baseline;
+}
+
+/**
+ * @brief: Rewrites the baseline file keeping every comment and every entry except the ones being replaced, then appends the new entries.
+*/
+void write_baseline(const std::string & path, const std::vector<std::string> & replaced_keys, const std::vector<std::string> & new_lines){
+    std::vector<std::string> kept;
+    std::ifstream input(path);
+    std::string line;
+    while (std::getline(input, line)){
+        bool replaced = std::any_of(replaced_keys.begin(), replaced_keys.end(), [&](const std::string & key){ return line.rfind(key + " ", 0) == 0; });
+        if (!replaced){
+            kept.push_back(line);
+        }
+    }
+    input.close();
+    std::ofstream output(path);
+    if (!output.is_open()){
+        throw std::runtime_error("Failed to open the file.");
+    }
+    for (const std::string & kept_line : kept){
+        output << kept_line << "\n";
+    }
+    for (const std::string & new_line : new_lines){
+        output << new_line << "\n";
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::string baseline_path;
+    double tolerance = 1.5;
+    uint repeats = 7;
+    uint num_cells = 64;
+    uint particles_per_cell = 4;
+    double noise_floor = 5e-4;
+    bool update = false;
+
+    for (int i = 1; i < argc; i++){
+        std::string arg(argv[i]);
+        bool has_value = i + 1 < argc;
+        if (arg == "--baseline" && has_value){
+            baseline_path = argv[++i];
+        }
+        else if (arg == "--tolerance" && has_value){
+            tolerance = std::stod(argv[++i]);
+        }
+        else if (arg == "--repeats" && has_value){
+            repeats = std::stoul(argv[++i]);
+        }
+        else if (arg == "--cells" && has_value){
+            num_cells = std::stoul(argv[++i]);
+        }
+        else if (arg == "--ppc" && has_value){
+            particles_per_cell = std::stoul(argv[++i]);
+        }
+        else if (arg == "--floor" && has_value){
+            noise_floor = std::stod(argv[++i]);
+        }
+        else if (arg == "--update"){
+            update = true;
+        }
+        else{
+            std::cerr << "Usage: " << argv[0] << " --baseline <file> [--tolerance <factor>] [--repeats <n>] [--cells <n>] [--ppc <n>] [--floor <seconds>] [--update]" << std::endl;
+            return 2;
+        }
+    }
+    if (baseline_path.empty() || tolerance < 1 || repeats == 0 || num_cells == 0 || particles_per_cell == 0){
+        std::cerr << "Error - A baseline file is required, the tolerance must be at least 1 and the repeats and workload sizes must be larger than 0." << std::endl;
+        return 2;
+    }
+
+    std::string host = HostName();
+    int threads = omp_get_max_threads();
+    std::vector<phase_timing> timings = time_phases(num_cells, particles_per_cell, repeats);
+    std::map<std::string, double> baseline = read_baseline(baseline_path);
+
+    std::cout << std::setprecision(4);
+    std::cout << "Performance of " << host << " with " << threads << " threads, " << num_cells << " cells per length, " << particles_per_cell
+    << " particles per cell, median of " << repeats << " repeats, tolerance " << tolerance << "x above a noise floor of " << noise_floor << " s" << std::endl;
+    std::cout << std::left << std::setw(24) << "phase" << std::setw(14) << "baseline (s)" << std::setw(14) << "median (s)" << std::setw(10) << "ratio" << "result" << std::endl;
+
+    bool failed = false;
+    bool missing = false;
+    std::vector<std::string> keys;
+    std::vector<std::string> new_lines;
+    for (const phase_timing & timing : timings){
+        std::string key = baseline_key(host, threads, num_cells, particles_per_cell, timing.name);
+        std::ostringstream new_line;
+        new_line << key << " " << std::setprecision(6) << timing.median;
+        keys.push_back(key);
+        new_lines.push_back(new_line.str());
+
+        std::cout << std::left << std::setw(24) << timing.name;
+        auto entry = baseline.find(key);
+        if (entry == baseline.end()){
+            std::cout << std::setw(14) << "-" << std::setw(14) << timing.median << std::setw(10) << "-" << "NO BASELINE" << std::endl;
+            missing = true;
+            continue;
+        }
+        double ratio = timing.median / entry->second;
+        bool slow = ratio > tolerance && timing.median - entry->second > noise_floor;
+        failed = failed || slow;
+        std::cout << std::setw(14) << entry->second << std::setw(14) << timing.median << std::setw(10) << ratio << (slow ? "FAIL" : "PASS") << std::endl;
+    }
+
+    if (update){
+        write_baseline(baseline_path, keys, new_lines);
+        std::cout << "Baseline for " << host << " written to " << baseline_path << std::endl;
+        return 0;
+    }
+
+    if (failed){
+        std::cout << "Performance regression - at least one phase is more than " << tolerance << " times slower than its baseline." << std::endl;
+        return 1;
+    }
+    if (missing){
+        std::cout << "Skipped - no baseline for every phase of " << host << ", record one with --update." << std::endl;
+        return 77;
+    }
+    return 0;
+}
@@ -5,6 +5,10 @@
 #include "Utils.hpp"
 #include <iostream>
 #include <algorithm>
+#include <numeric>
+#include <fstream>
+#include <filesystem>
+#include <type_traits>
 
 using namespace Catch::Matchers;
 
@@ -15,16 +19,19 @@ TEST_CASE("Test Simulation constructor for error handling with invalid arguments
     particle_group particles(mass, number_particles, {});
     uint num_cells = 100;
     double cell_width = width/num_cells;
-    REQUIRE_THROWS(Simulation(-1, 0.1, particles, width, num_cells, 2));
-    REQUIRE_THROWS(Simulation(1, -0.1, particles, width, num_cells, 2));
-    REQUIRE_THROWS(Simulation(1, 0.1, particles, width, num_cells,-2));
-    REQUIRE_THROWS(Simulation(1, 0.1, particles, width,-1 * num_cells,2));
-    REQUIRE_THROWS(Simulation(1, 0.1, particles, -1 * width, num_cells,2));
+    REQUIRE_THROWS(Simulation(-1, 0.1, particle_group(particles), width, num_cells, 2));
+    REQUIRE_THROWS(Simulation(1, -0.1, particle_group(particles), width, num_cells, 2));
+    REQUIRE_THROWS(Simulation(1, 0.1, particle_group(particles), width, num_cells,-2));
+    REQUIRE_THROWS(Simulation(1, 0.1, particle_group(particles), width,-1 * num_cells,2));
+    REQUIRE_THROWS(Simulation(1, 0.1, particle_group(particles), -1 * width, num_cells,2));
 }
 
 TEST_CASE("Test particle constructor for error handling with invalid arguments", "[particle_constructor]"){
     REQUIRE_THROWS(particle({-1,-1,-1}));
     REQUIRE_THROWS(particle({2,2,2}));
+    REQUIRE(particle().position == std::array<double, 3>{0, 0, 0});
+    REQUIRE(particle().velocity == std::array<double, 3>{0, 0, 0});
+    REQUIRE(std::vector<particle>(3)[2].velocity == std::array<double, 3>{0, 0, 0});
 }
 
 TEST_CASE("Test particle group constructor for error handling with invalid arguments","[particle_constructor]"){
@@ -34,6 +41,32 @@ TEST_CASE("Test particle group constructor for error handling with invalid argum
 }
 
 
+TEST_CASE("Test particle groups adopt and move particles without copying and validate bulk positions","[particle_constructor]"){
+    std::vector<particle> loaded(100, particle({0.5, 0.25, 0.75}));
+    const particle * storage = loaded.data();
+    particle_group adopted(0.1, std::move(loaded));
+    REQUIRE(adopted.particles.data() == storage);
+    REQUIRE(adopted.get_num_particles() == 100);
+
+    Simulation sim(1, 0.1, std::move(adopted), 1, 4, 1);
+    REQUIRE(sim.get_particle_collection().particles.data() == storage); // ownership moved into the simulation
+    // an lvalue group is not copied implicitly, a copy has to be spelled out
+    static_assert(!std::is_constructible_v<Simulation, double, double, particle_group &, double, uint, double>);
+    static_assert(std::is_constructible_v<Simulation, double, double, particle_group &&, double, uint, double>);
+
+    std::vector<double> coordinates = {0.1, 0.2, 0.3, 0.4, 0.5, 0.6};
+    particle_group bulk(0.1, coordinates.data(), 2);
+    REQUIRE(bulk.particles[1].position == std::array<double, 3>{0.4, 0.5, 0.6});
+    REQUIRE(bulk.particles[1].velocity == std::array<double, 3>{0, 0, 0});
+
+    coordinates[4] = 1.5;
+    REQUIRE_THROWS_AS(particle_group(0.1, coordinates.data(), 2), std::range_error);
+    std::vector<particle> bad(10, particle({0.5, 0.5, 0.5}));
+    bad[7].position[2] = -0.1;
+    REQUIRE_THROWS_AS(particle_group(0.1, std::move(bad)), std::range_error);
+    REQUIRE_THROWS_AS(particle_group(0.1, 3, std::vector<std::array<double,3>>{{0.5, 0.5, 0.5}}), std::invalid_argument);
+}
+
 TEST_CASE("Test density calculation function for no particles","[Density_Calc]"){
     double mass = 0.01;
     double width = 1;
@@ -41,7 +74,7 @@ TEST_CASE("Test density calculation function for no particles","[Density_Calc]")
     particle_group particles(mass, number_particles, {});
     uint num_cells = 100;
     double cell_width = width/num_cells;
-    Simulation sim(10, 0.1, particles, width, num_cells, 2);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
     sim.fill_density_buffer();
     const fftw_complex* density_buffer = sim.get_density_buffer();
     for (uint i = 0; i < num_cells * num_cells * num_cells; i++){
@@ -58,7 +91,7 @@ TEST_CASE("Test density calculation function for a single particle","[Density_Ca
     particle_group particles(mass, number_particles, {{0.45, 0.45, 0.45}});
     uint num_cells = 100;
     double cell_width = width/num_cells;
-    Simulation sim(10, 0.1, particles, width, num_cells, 2);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
     sim.fill_density_buffer();
     const fftw_complex* density_buffer = sim.get_density_buffer();
     for (uint i = 0; i < num_cells * num_cells * num_cells; i++){
@@ -81,7 +114,7 @@ TEST_CASE("Test density calculation function for multiple particles","[Density_C
     std::vector<std::array<double, 3>> particle_pos = {{0.45,0.45,0.45},{0.42,0.44,0.43},{0.45,0.49,0.41},{0.1,0.2,0.3},{0.6,0.6,0.6},
     {0.9,0.9,0.9},{0.8,0.8,0.8},{0.5,0.5,0.5},{0.2,0.2,0.2},{0.3,0.2,0.1}};
     particle_group particles(mass, number_particles, particle_pos);
-    Simulation sim(10, 0.1, particles, width, num_cells, 2);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
     sim.fill_density_buffer();
     const fftw_complex* density_buffer = sim.get_density_buffer();
     for (uint i = 0; i < num_cells * num_cells * num_cells; i++){
@@ -109,6 +142,32 @@ TEST_CASE("Test density calculation function for multiple particles","[Density_C
 }
 
 
+TEST_CASE("Test cell index cache matches particle positions after each drift","[Cell_Index]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 200;
+    uint num_cells = 10;
+    particle_group particles(mass, number_particles, 7);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 1.01);
+
+    for (uint step = 0; step < 5; step++){
+        const particle_group & particle_collection = sim.get_particle_collection();
+        const std::vector<uint32_t> & cell_indices = sim.get_cell_indices();
+        REQUIRE(cell_indices.size() == number_particles);
+        for (uint p = 0; p < number_particles; p++){
+            uint i = std::floor(particle_collection.particles[p].position[0] * num_cells);
+            uint j = std::floor(particle_collection.particles[p].position[1] * num_cells);
+            uint k = std::floor(particle_collection.particles[p].position[2] * num_cells);
+            REQUIRE(cell_indices[p] == k + num_cells * (j + num_cells * i));
+        }
+        sim.fill_density_buffer();
+        sim.fill_potential_buffer();
+        sim.update_particles();
+        sim.box_expansion();
+    }
+}
+
+
 /**
  * @brief Fill out this test function by filling in the TODOs
  * Tests the calculation of the gravitational potential due to a single particle
@@ -126,7 +185,7 @@ TEST_CASE("Test potential function for single particle", "[Potential_Calc]")
     int ncells = 101;
 
     //Declare simulation with particle setup, width, and number of cells. 
-    Simulation sim(10, 0.1, particles, width, ncells, 1);
+    Simulation sim(10, 0.1, particle_group(particles), width, ncells, 1);
     sim.fill_density_buffer();
     sim.fill_potential_buffer();
 
@@ -196,16 +255,61 @@ TEST_CASE("Test gradient function for periodic f(x) = sin(x) + cos(y) + sin(z)",
         test_grad.push_back(test_grad_jk);
     }
     particle_group particles(1, 1, {{0.5, 0.5, 0.5}});
-    Simulation sim(10, 1, particles, width, num_cells, 3);
+    Simulation sim(10, 1, particle_group(particles), width, num_cells, 3);
+
+    sim.calculate_gradient(test_func_buffer);
+    const std::array<std::vector<double>, 3> & acceleration = sim.get_acceleration(); // acceleration is the negative gradient
+    
+    for (uint i = 0; i < num_cells; i++){
+        for (uint j = 0; j < num_cells; j++){
+            for (uint k = 0; k < num_cells; k++){
+                REQUIRE_THAT(-acceleration[0][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][0], 1e-3));
+                REQUIRE_THAT(-acceleration[1][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][1], 1e-3));
+                REQUIRE_THAT(-acceleration[2][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][2], 1e-3));
+            }
+        }
+    }
+    
+    fftw_free(test_func_buffer);
+}
+
+
+TEST_CASE("Test fourth order gradient for periodic f(x) = sin(x) + cos(y) + sin(z)", "[Gradient_Function]"){
+    uint num_cells = 100;
+    double width = 2*M_PI;
+
+    uint buffer_length = num_cells * num_cells * num_cells;
+    fftw_complex * test_func_buffer = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) * buffer_length);
+    std::memset(test_func_buffer, 0, sizeof(fftw_complex) * buffer_length);
+    
+    for (uint i = 0; i < num_cells; i++){
+        for (uint j = 0; j < num_cells; j++){
+            for (uint k = 0; k < num_cells; k++){
+                double x = width * (i + 0.5)/num_cells;
+                double y = width * (j + 0.5)/num_cells;
+                double z = width * (k + 0.5)/num_cells;
+                test_func_buffer[k + num_cells * (j + num_cells * i)][0] = std::sin(x) + std::cos(y) + std::sin(z);
+            }
+        }
+    }
+    particle_group particles(1, 1, {{0.5, 0.5, 0.5}});
+    Simulation sim(10, 1, particle_group(particles), width, num_cells, 3);
+    REQUIRE_THROWS(sim.set_gradient_order(3));
+    sim.set_gradient_order(4);
 
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> grad = sim.calculate_gradient(test_func_buffer);
+    sim.calculate_gradient(test_func_buffer);
+    const std::array<std::vector<double>, 3> & acceleration = sim.get_acceleration();
     
     for (uint i = 0; i < num_cells; i++){
         for (uint j = 0; j < num_cells; j++){
             for (uint k = 0; k < num_cells; k++){
-                REQUIRE_THAT(grad[i][j][k][0], WithinRel(test_grad[i][j][k][0], 1e-3));
-                REQUIRE_THAT(grad[i][j][k][1], WithinRel(test_grad[i][j][k][1], 1e-3));
-                REQUIRE_THAT(grad[i][j][k][2], WithinRel(test_grad[i][j][k][2], 1e-3));
+                uint index = k + num_cells * (j + num_cells * i);
+                double x = width * (i + 0.5)/num_cells;
+                double y = width * (j + 0.5)/num_cells;
+                double z = width * (k + 0.5)/num_cells;
+                REQUIRE_THAT(-acceleration[0][index], WithinRel(std::cos(x), 2e-5)); // five point stencil error scales with h^4
+                REQUIRE_THAT(-acceleration[1][index], WithinRel(-std::sin(y), 2e-5));
+                REQUIRE_THAT(-acceleration[2][index], WithinRel(std::cos(z), 2e-5));
             }
         }
     }
@@ -245,16 +349,17 @@ TEST_CASE("Test gradient function for periodic f(x) = sin(x) + sin(y) + sin(z)",
         test_grad.push_back(test_grad_jk);
     }
     particle_group particles(1, 1, {{0.5, 0.5, 0.5}});
-    Simulation sim(10, 1, particles, width, num_cells, 3);
+    Simulation sim(10, 1, particle_group(particles), width, num_cells, 3);
 
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> grad = sim.calculate_gradient(test_func_buffer);
+    sim.calculate_gradient(test_func_buffer);
+    const std::array<std::vector<double>, 3> & acceleration = sim.get_acceleration(); // acceleration is the negative gradient
     
     for (uint i = 0; i < num_cells; i++){
         for (uint j = 0; j < num_cells; j++){
             for (uint k = 0; k < num_cells; k++){
-                REQUIRE_THAT(grad[i][j][k][0], WithinRel(test_grad[i][j][k][0], 1e-3));
-                REQUIRE_THAT(grad[i][j][k][1], WithinRel(test_grad[i][j][k][1], 1e-3));
-                REQUIRE_THAT(grad[i][j][k][2], WithinRel(test_grad[i][j][k][2], 1e-3));
+                REQUIRE_THAT(-acceleration[0][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][0], 1e-3));
+                REQUIRE_THAT(-acceleration[1][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][1], 1e-3));
+                REQUIRE_THAT(-acceleration[2][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][2], 1e-3));
             }
         }
     }
@@ -294,16 +399,17 @@ TEST_CASE("Test gradient function for periodic f(x) = cos^2(x) + sin^2(y) + cos(
         test_grad.push_back(test_grad_jk);
     }
     particle_group particles(1, 1, {{0.5, 0.5, 0.5}});
-    Simulation sim(10, 1, particles, width, num_cells, 3);
+    Simulation sim(10, 1, particle_group(particles), width, num_cells, 3);
 
-    std::vector<std::vector<std::vector<std::array<double, 3>>>> grad = sim.calculate_gradient(test_func_buffer);
+    sim.calculate_gradient(test_func_buffer);
+    const std::array<std::vector<double>, 3> & acceleration = sim.get_acceleration(); // acceleration is the negative gradient
     
     for (uint i = 0; i < num_cells; i++){
         for (uint j = 0; j < num_cells; j++){
             for (uint k = 0; k < num_cells; k++){
-                REQUIRE_THAT(grad[i][j][k][0], WithinRel(test_grad[i][j][k][0], 0.3));
-                REQUIRE_THAT(grad[i][j][k][1], WithinRel(test_grad[i][j][k][1], 0.3));
-                REQUIRE_THAT(grad[i][j][k][2], WithinRel(test_grad[i][j][k][2], 0.3));
+                REQUIRE_THAT(-acceleration[0][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][0], 0.3));
+                REQUIRE_THAT(-acceleration[1][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][1], 0.3));
+                REQUIRE_THAT(-acceleration[2][k + num_cells * (j + num_cells * i)], WithinRel(test_grad[i][j][k][2], 0.3));
             }
         }
     }
@@ -318,7 +424,7 @@ TEST_CASE("Ensure two particles approach each other:","[Update_Particle]"){
     particle_group particles(mass, number_particles, {{0.4, 0.4, 0.4}, {0.8, 0.8, 0.8}});
     uint num_cells = 100;
     double cell_width = width/num_cells;
-    Simulation sim(10, 0.1, particles, width, num_cells, 2);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
     
     double prev_distance = std::sqrt(0.4 * 0.4 * 3);
 
@@ -345,7 +451,7 @@ TEST_CASE("Ensure displacement is centered around 0", "[Update_Particle]"){
     particle_group particles(mass, number_particles, {{0.30, 0.30, 0.30}, {0.70, 0.70, 0.70}});
     uint num_cells = 10;
     double cell_width = width/num_cells;
-    Simulation sim(10, 0.01, particles, width, num_cells, 2);
+    Simulation sim(10, 0.01, particle_group(particles), width, num_cells, 2);
     
     std::vector<double> distances_x = {0.4};
     std::vector<double> distances_y = {0.4};
@@ -408,7 +514,7 @@ TEST_CASE("Ensure particles remain stationary when distance between them through
     particle_group particles(mass, number_particles, {{0.25, 0.25, 0.25}, {0.75, 0.75, 0.75}});
     uint num_cells = 10;
     double cell_width = width/num_cells;
-    Simulation sim(10, 0.01, particles, width, num_cells, 2);
+    Simulation sim(10, 0.01, particle_group(particles), width, num_cells, 2);
     
 
 
@@ -435,4 +541,1206 @@ TEST_CASE("Ensure particles remain stationary when distance between them through
         REQUIRE_THAT(particle_collection.particles[1].velocity[2], WithinAbs(0,1e-6));
     }
 
-}
\ No newline at end of file
+}
+
+TEST_CASE("Ensure a fused time step matches the separate phase functions","[Step]"){
+    double mass = 0.1;
+    double width = 1;
+    uint number_particles = 100;
+    uint num_cells = 10;
+    particle_group particles(mass, number_particles, 3);
+    Simulation phase_sim(10, 0.01, particle_group(particles), width, num_cells, 1.02);
+    Simulation step_sim(10, 0.01, particle_group(particles), width, num_cells, 1.02);
+
+    for (uint i = 0; i < 20; i++){
+        phase_sim.fill_density_buffer();
+        phase_sim.fill_potential_buffer();
+        phase_sim.update_particles();
+        phase_sim.box_expansion();
+        step_sim.step();
+    }
+
+    const particle_group & phase_particles = phase_sim.get_particle_collection();
+    const particle_group & step_particles = step_sim.get_particle_collection();
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE_THAT(step_particles.particles[p].position[axis], WithinAbs(phase_particles.particles[p].position[axis], 1e-12));
+            REQUIRE_THAT(step_particles.particles[p].velocity[axis], WithinAbs(phase_particles.particles[p].velocity[axis], 1e-12));
+        }
+    }
+}
+
+TEST_CASE("Test velocities kept relative to the velocity scale match explicit expansion, including renormalisation","[Step]"){
+    double mass = 0.05;
+    double width = 1;
+    uint number_particles = 50;
+    uint num_cells = 8;
+    double time_step = 0.01;
+    double e_factor = 1e25; // the scale leaves [1e-100, 1e100] by the fifth step and is folded back into the velocities
+    particle_group particles(mass, number_particles, 9);
+    Simulation sim(10, time_step, particle_group(particles), width, num_cells, e_factor);
+
+    bool renormalised = false;
+    for (uint i = 0; i < 6; i++){
+        StepView before = sim.view();
+        std::vector<uint32_t> cells = before.cell_indices;
+        std::vector<std::array<double, 3>> expected(number_particles);
+        for (uint p = 0; p < number_particles; p++){
+            for (uint axis = 0; axis < 3; axis++){
+                expected[p][axis] = before.particles.particles[p].velocity[axis] * before.velocity_scale;
+            }
+        }
+        sim.step();
+        StepView after = sim.view();
+        renormalised = renormalised || (i > 0 && after.velocity_scale == 1);
+        const std::array<std::vector<double>, 3> & acceleration = sim.get_acceleration();
+        for (uint p = 0; p < number_particles; p++){
+            for (uint axis = 0; axis < 3; axis++){
+                double physical = (expected[p][axis] + acceleration[axis][cells[p]] * time_step) / e_factor;
+                REQUIRE_THAT(after.particles.particles[p].velocity[axis] * after.velocity_scale, WithinRel(physical, 1e-12));
+            }
+        }
+    }
+    REQUIRE(renormalised);
+
+    // accessors fold the scale into the stored velocities
+    double scale = sim.view().velocity_scale;
+    double stored = sim.view().particles.particles[0].velocity[0];
+    REQUIRE_THAT(sim.get_particle_collection().particles[0].velocity[0], WithinRel(stored * scale, 1e-15));
+    REQUIRE(sim.view().velocity_scale == 1);
+}
+
+TEST_CASE("Test conservation diagnostics conserve momentum and do not change the trajectory","[Diagnostics]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 500;
+    uint num_cells = 12;
+    uint num_steps = 15;
+    particle_group particles(mass, number_particles, 11);
+    Simulation monitored_sim(10, 0.01, particle_group(particles), width, num_cells, 1);
+    Simulation plain_sim(10, 0.01, particle_group(particles), width, num_cells, 1);
+    monitored_sim.set_diagnostics(true);
+
+    for (uint i = 0; i < num_steps; i++){
+        monitored_sim.step();
+        plain_sim.step();
+    }
+
+    const std::vector<StepStatistics> & statistics = monitored_sim.get_run_statistics();
+    REQUIRE(statistics.size() == num_steps);
+    REQUIRE(plain_sim.get_run_statistics().empty());
+
+    const particle_group & final_particles = monitored_sim.get_particle_collection();
+    const particle_group & plain_particles = plain_sim.get_particle_collection();
+    double kinetic_energy = 0;
+    double max_speed = 0;
+    for (uint p = 0; p < number_particles; p++){
+        double speed_squared = 0;
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE(final_particles.particles[p].position[axis] == plain_particles.particles[p].position[axis]);
+            speed_squared += final_particles.particles[p].velocity[axis] * final_particles.particles[p].velocity[axis];
+        }
+        kinetic_energy += 0.5 * mass * speed_squared;
+        max_speed = std::max(max_speed, std::sqrt(speed_squared));
+    }
+
+    const StepStatistics & last = statistics.back();
+    REQUIRE(last.step == num_steps);
+    REQUIRE_THAT(last.kinetic_energy, WithinRel(kinetic_energy, 1e-10));
+    REQUIRE_THAT(last.max_speed, WithinRel(max_speed, 1e-12));
+    REQUIRE(last.kinetic_energy > 0);
+    REQUIRE(last.potential_energy < 0); // bound system, the zero mode of the potential is removed
+
+    // the antisymmetric stencil and symmetric Green's function give equal and opposite mesh forces, the particles start at rest
+    for (const StepStatistics & current : statistics){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE_THAT(current.momentum[axis], WithinAbs(0, 1e-10 * std::sqrt(2 * mass * number_particles * current.kinetic_energy)));
+        }
+    }
+}
+
+TEST_CASE("Test density statistics of the step match statistics computed directly from the deposited grid","[Diagnostics]"){
+    uint num_cells = 16;
+    std::vector<std::array<double, 3>> positions;
+    std::default_random_engine generator(9);
+    std::uniform_real_distribution<double> uniform(0, 1), clump(0.4, 0.6);
+    for (uint i = 0; i < 3000; i++){
+        positions.push_back({uniform(generator), uniform(generator), uniform(generator)});
+        positions.push_back({clump(generator), clump(generator), clump(generator)});
+    }
+    particle_group particles(1.0, positions.size(), positions);
+    Simulation sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    sim.set_diagnostics(true);
+    sim.step();
+    sim.step();
+
+    size_t num_grid_cells = static_cast<size_t>(num_cells) * num_cells * num_cells;
+    const fftw_complex * density = sim.view().density;
+    double mean = 0;
+    for (size_t index = 0; index < num_grid_cells; index++){
+        mean += density[index][0] / num_grid_cells;
+    }
+    double variance = 0, min_density = std::numeric_limits<double>::max(), max_density = 0;
+    uint64_t empty_cells = 0;
+    std::array<uint64_t, density_histogram_bins> histogram{};
+    for (size_t index = 0; index < num_grid_cells; index++){
+        double relative = density[index][0] / mean;
+        variance += (relative - 1) * (relative - 1) / num_grid_cells;
+        min_density = std::min(min_density, relative);
+        max_density = std::max(max_density, relative);
+        if (relative <= 0){
+            empty_cells++;
+            continue;
+        }
+        int bin = static_cast<int>(std::floor((std::log10(relative) - density_histogram_start) / density_histogram_width));
+        histogram[std::clamp(bin, 0, static_cast<int>(density_histogram_bins) - 1)]++;
+    }
+
+    const DensityStatistics & statistics = sim.get_run_statistics().back().density;
+    REQUIRE(empty_cells > 0);
+    REQUIRE_THAT(statistics.variance, WithinRel(variance, 1e-9));
+    REQUIRE_THAT(statistics.min_density, WithinAbs(min_density, 1e-12));
+    REQUIRE_THAT(statistics.max_density, WithinRel(max_density, 1e-12));
+    REQUIRE(statistics.empty_cells == empty_cells);
+    REQUIRE(statistics.histogram == histogram);
+    REQUIRE(empty_cells + std::accumulate(histogram.begin(), histogram.end(), uint64_t(0)) == num_grid_cells);
+
+    std::string filename = "test_density_statistics.csv";
+    SaveDensityStatistics(sim.get_run_statistics(), filename);
+    std::ifstream file(filename);
+    std::string line;
+    uint rows = 0;
+    std::getline(file, line);
+    REQUIRE(line.rfind("time,step,variance,min_density,max_density,empty_cells,bin_0,", 0) == 0);
+    while (std::getline(file, line)){
+        rows++;
+        REQUIRE(std::count(line.begin(), line.end(), ',') == 5 + density_histogram_bins);
+    }
+    REQUIRE(rows == 2);
+    std::filesystem::remove(filename);
+
+    // with block time steps the statistics describe the density at the start of the step, like the potential energy
+    Simulation single_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    Simulation block_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    block_step_settings block_settings;
+    block_settings.max_level = 2;
+    block_sim.set_block_time_steps(block_settings);
+    single_sim.set_diagnostics(true);
+    block_sim.set_diagnostics(true);
+    single_sim.step();
+    block_sim.step();
+    const StepStatistics & single_step = single_sim.get_run_statistics().back();
+    const StepStatistics & block_step = block_sim.get_run_statistics().back();
+    REQUIRE(block_step.density.histogram == single_step.density.histogram);
+    REQUIRE(block_step.density.empty_cells == single_step.density.empty_cells);
+    REQUIRE_THAT(block_step.density.variance, WithinRel(single_step.density.variance, 1e-12));
+    REQUIRE_THAT(block_step.potential_energy, WithinRel(single_step.potential_energy, 1e-12));
+}
+
+TEST_CASE("Test allocation counts and resident memory are recorded with the step statistics","[Diagnostics]"){
+    allocation_counts start = CountAllocations();
+    void * memory = ::operator new(4096); // a direct call, new expressions may be elided by the compiler
+    allocation_counts counted = CountAllocations() - start;
+    ::operator delete(memory);
+    if (AllocationCountingEnabled()){
+        REQUIRE(counted.allocations == 1);
+        REQUIRE(counted.bytes == 4096);
+    }
+    else{
+        REQUIRE(counted.allocations == 0);
+        REQUIRE(counted.bytes == 0);
+    }
+
+    particle_group particles(0.01, 1000, 4);
+    Simulation sim(0.095, 0.01, particle_group(particles), 1, 12, 1);
+    sim.set_diagnostics(true);
+    sim.run("test_memory_statistics");
+    std::filesystem::remove_all("test_memory_statistics");
+    const std::vector<StepStatistics> & statistics = sim.get_run_statistics();
+    REQUIRE(statistics.size() == 10);
+    for (const StepStatistics & current : statistics){
+        REQUIRE(current.memory.current_bytes > 0);
+        REQUIRE(current.memory.peak_bytes >= current.memory.current_bytes);
+        allocation_counts phase_total;
+        for (const PhaseMemory & phase : current.phase_memory){
+            REQUIRE(phase.memory.current_bytes > 0); // every phase runs when the forces are solved every step
+            phase_total += phase.allocations;
+        }
+        REQUIRE(phase_total.allocations <= current.step_allocations.allocations);
+        REQUIRE(phase_total.bytes <= current.step_allocations.bytes);
+    }
+    if (AllocationCountingEnabled()){
+        REQUIRE(statistics.back().output_allocations.allocations > 0); // the image written after the tenth step
+    }
+    std::string filename = "test_run_statistics.csv";
+    SaveRunStatistics(statistics, filename);
+    std::ifstream file(filename);
+    std::string header, row;
+    std::getline(file, header);
+    std::getline(file, row);
+    REQUIRE(header.find(",local_particles,particle_time,load_imbalance,") != std::string::npos);
+    REQUIRE(header.find(",deposit_allocations,deposit_allocated_bytes,deposit_resident_bytes,fft_allocations,") != std::string::npos);
+    REQUIRE(header.rfind(",push_resident_bytes") == header.size() - std::string(",push_resident_bytes").size());
+    REQUIRE(std::count(row.begin(), row.end(), ',') == std::count(header.begin(), header.end(), ','));
+    REQUIRE(row.find(",1000,") != std::string::npos); // every particle is local without a decomposition
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("Test a simulation streamed from a particle file matches the in memory simulation","[Particle_File]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 2000;
+    uint num_cells = 10;
+    uint num_steps = 12;
+    std::string filename = "streamed_test_particles.bin";
+    particle_group particles(mass, number_particles, 5);
+    CreateUniformParticleFile(filename, mass, number_particles, 5);
+    {
+        MappedParticleFile particle_file(filename);
+        REQUIRE(particle_file.size() == number_particles);
+        REQUIRE(particle_file.get_mass() == mass);
+        for (uint p = 0; p < number_particles; p++){
+            REQUIRE(particle_file.data()[p].position == particles.particles[p].position);
+        }
+    }
+
+    Simulation memory_sim(10, 0.01, particle_group(particles), width, num_cells, 1.02);
+    Simulation streamed_sim(10, 0.01, filename, width, num_cells, 1.02, 300); // uneven chunks
+    REQUIRE_THROWS_AS(streamed_sim.update_particles(), std::runtime_error);
+    for (uint i = 0; i < num_steps; i++){
+        memory_sim.step();
+        streamed_sim.step();
+    }
+    REQUIRE(streamed_sim.get_particle_collection().particles.empty());
+
+    MappedParticleFile particle_file(filename); // the file holds the state of the streamed simulation
+    const particle_group & memory_particles = memory_sim.get_particle_collection();
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE_THAT(particle_file.data()[p].position[axis], WithinAbs(memory_particles.particles[p].position[axis], 1e-10));
+            REQUIRE_THAT(particle_file.data()[p].velocity[axis], WithinAbs(memory_particles.particles[p].velocity[axis], 1e-10));
+        }
+    }
+    std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Test every deposition strategy gives the same density","[Density_Calc]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 1000;
+    uint num_cells = 10;
+    uint buffer_length = num_cells * num_cells * num_cells;
+    particle_group particles(mass, number_particles, 11);
+    Simulation reference(10, 0.1, particle_group(particles), width, num_cells, 2);
+    reference.fill_density_buffer();
+
+    for (DepositionStrategy deposition : {DepositionStrategy::coalesced, DepositionStrategy::private_grids}){
+        Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
+        TuningConfiguration configuration;
+        configuration.deposition = deposition;
+        sim.set_tuning(configuration);
+        sim.sort_particles();
+        sim.fill_density_buffer();
+        for (uint i = 0; i < buffer_length; i++){
+            CHECK(sim.get_density_buffer()[i][1] == 0);
+            CHECK_THAT(sim.get_density_buffer()[i][0], WithinRel(reference.get_density_buffer()[i][0], 1e-10));
+        }
+    }
+}
+
+TEST_CASE("Test sorting groups particles by cell and keeps the cell index cache consistent","[Sort]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 500;
+    uint num_cells = 10;
+    particle_group particles(mass, number_particles, 5);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 2);
+    sim.sort_particles();
+
+    const particle_group & particle_collection = sim.get_particle_collection();
+    const std::vector<uint32_t> & cell_indices = sim.get_cell_indices();
+    REQUIRE(particle_collection.particles.size() == number_particles);
+    REQUIRE(std::is_sorted(cell_indices.begin(), cell_indices.end()));
+    for (uint p = 0; p < number_particles; p++){
+        uint i = std::floor(particle_collection.particles[p].position[0] * num_cells);
+        uint j = std::floor(particle_collection.particles[p].position[1] * num_cells);
+        uint k = std::floor(particle_collection.particles[p].position[2] * num_cells);
+        REQUIRE(cell_indices[p] == k + num_cells * (j + num_cells * i));
+    }
+}
+
+TEST_CASE("Test autotuner restores the simulation state and reuses its profile","[Autotune]"){
+    double mass = 0.01;
+    double width = 1;
+    uint number_particles = 100;
+    uint num_cells = 10;
+    particle_group particles(mass, number_particles, 9);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 1.01);
+    std::string profile = "autotune_test_profile.txt";
+    std::remove(profile.c_str());
+
+    TuningConfiguration tuned = sim.autotune(1, profile);
+    REQUIRE(sim.get_force_solves() == 0); // the trial steps are not counted
+    const particle_group & particle_collection = sim.get_particle_collection();
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE(particle_collection.particles[p].position[axis] == particles.particles[p].position[axis]);
+            REQUIRE(particle_collection.particles[p].velocity[axis] == 0);
+        }
+    }
+
+    Simulation cached_sim(10, 0.1, particle_group(particles), width, num_cells, 1.01);
+    TuningConfiguration cached = cached_sim.autotune(1, profile);
+    REQUIRE(cached.deposition == tuned.deposition);
+    REQUIRE(cached.sort_interval == tuned.sort_interval);
+    REQUIRE(cached.fftw_flags == tuned.fftw_flags);
+    REQUIRE(cached.num_threads == tuned.num_threads);
+    std::remove(profile.c_str());
+
+    Simulation stepped_sim(10, 0.1, particle_group(particles), width, num_cells, 1.01);
+    stepped_sim.step();
+    stepped_sim.autotune(1);
+    REQUIRE(stepped_sim.get_force_solves() == 1);
+    REQUIRE(stepped_sim.get_steps_taken() == 1);
+}
+
+
+TEST_CASE("Test step range yields the state after every step and can be resumed","[Step]"){
+    double mass = 0.1;
+    double width = 1;
+    uint number_particles = 50;
+    uint num_cells = 10;
+    particle_group particles(mass, number_particles, 13);
+    Simulation driven_sim(1, 0.1, particle_group(particles), width, num_cells, 1.02);
+    Simulation reference_sim(1, 0.1, particle_group(particles), width, num_cells, 1.02);
+
+    uint yielded = 0;
+    double previous_time = 0;
+    for (const StepView & view : driven_sim.steps(0.45)){
+        yielded++;
+        REQUIRE(view.step == yielded);
+        REQUIRE(view.time > previous_time);
+        REQUIRE(&view.particles == &driven_sim.view().particles); // views refer to the live state
+        previous_time = view.time;
+    }
+    REQUIRE(yielded == 5);
+    REQUIRE_THAT(driven_sim.get_time(), WithinAbs(0.5, 1e-12));
+
+    driven_sim.advance_to(0.75); // resumes where the range stopped
+    REQUIRE(driven_sim.get_steps_taken() == 8);
+
+    for (uint i = 0; i < 8; i++){
+        reference_sim.step();
+    }
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE(driven_sim.get_particle_collection().particles[p].position[axis] == reference_sim.get_particle_collection().particles[p].position[axis]);
+        }
+    }
+}
+
+
+TEST_CASE("Test frame ring hands frames to a reader and detects frames that were overwritten","[Frame_Ring]"){
+    std::string name = "/pm_test_frame_ring";
+    REQUIRE_THROWS_AS(FramePublisher(name, 1, 16), std::invalid_argument);
+    FramePublisher publisher(name, 3, 16);
+    FrameSubscriber subscriber(name);
+    REQUIRE(subscriber.get_num_slots() == 3);
+    REQUIRE(subscriber.get_frames_published() == 0);
+    REQUIRE_FALSE(subscriber.is_finished());
+    REQUIRE_THROWS_AS(publisher.publish(std::vector<double>(25, 1), 5, 0, 0, 1), std::invalid_argument); // larger than a slot
+
+    for (uint frame = 0; frame < 5; frame++){
+        publisher.publish(std::vector<double>(16, frame), 4, 0.1 * frame, frame, 1);
+    }
+    publisher.finish();
+    REQUIRE(subscriber.get_frames_published() == 5);
+    REQUIRE(subscriber.is_finished());
+
+    frame_info info;
+    std::vector<double> pixels;
+    REQUIRE_FALSE(subscriber.read(1, info, pixels)); // overwritten by frame 4
+    REQUIRE_FALSE(subscriber.read(5, info, pixels)); // not published yet
+    for (uint frame = 2; frame < 5; frame++){
+        REQUIRE(subscriber.read(frame, info, pixels));
+        REQUIRE(info.frame == frame);
+        REQUIRE(info.step == frame);
+        REQUIRE(info.size == 4);
+        REQUIRE(pixels == std::vector<double>(16, frame));
+    }
+    // a visit that the writer laps is reported as torn
+    bool intact = subscriber.view(4, [&](const frame_info &, const double *){
+        for (uint frame = 5; frame < 8; frame++){
+            publisher.publish(std::vector<double>(16, frame), 4, 0.1 * frame, frame, 1);
+        }
+    });
+    REQUIRE_FALSE(intact);
+
+    // frames can also be written in place
+    publisher.publish(4, 0.8, 8, 1, [](double * slot_pixels){
+        std::fill(slot_pixels, slot_pixels + 16, 8.0);
+    });
+    REQUIRE(subscriber.read(8, info, pixels));
+    REQUIRE(pixels == std::vector<double>(16, 8.0));
+}
+
+TEST_CASE("Test frame publisher refuses a segment name that is in use unless told to overwrite it","[Frame_Ring]"){
+    std::string name = "/pm_test_frame_ring_taken";
+    FramePublisher first(name, 2, 4);
+    REQUIRE_THROWS_AS(FramePublisher(name, 2, 4), std::runtime_error);
+    first.publish(std::vector<double>(4, 1), 2, 0, 0, 1); // untouched by the failed attempt
+    FrameSubscriber subscriber(name);
+    REQUIRE(subscriber.get_frames_published() == 1);
+
+    FramePublisher second(name, 2, 4, true);
+    FrameSubscriber replaced(name);
+    REQUIRE(replaced.get_frames_published() == 0);
+}
+
+TEST_CASE("Test run publishes the projected density of every step to the frame ring","[Frame_Ring]"){
+    double mass = 0.01;
+    uint num_cells = 8;
+    Simulation sim(0.05, 0.01, particle_group(mass, 500, 3), 1, num_cells, 1.0);
+    REQUIRE_THROWS_AS(sim.set_frame_publishing("no_slash"), std::invalid_argument);
+    sim.set_frame_publishing("/pm_test_run_frames", 4);
+    sim.run();
+    FrameSubscriber subscriber("/pm_test_run_frames");
+    uint64_t frames = subscriber.get_frames_published();
+    REQUIRE(frames == sim.get_steps_taken());
+    REQUIRE(subscriber.is_finished());
+
+    frame_info info;
+    std::vector<double> pixels;
+    REQUIRE(subscriber.read(frames - 1, info, pixels));
+    REQUIRE(info.size == num_cells);
+    REQUIRE(pixels == ProjectDensity(sim.get_density_buffer(), num_cells));
+    REQUIRE(info.step == sim.get_steps_taken());
+}
+
+TEST_CASE("Test a simulation continued from a checkpoint matches the simulation that saved it","[Branch]"){
+    double mass = 0.1;
+    double width = 1;
+    uint number_particles = 200;
+    uint num_cells = 10;
+    std::string filename = "branch_test_checkpoint.bin";
+    Simulation trunk(2, 0.05, particle_group(mass, number_particles, 21), width, num_cells, 1.05);
+    trunk.set_gradient_order(4);
+    for (uint i = 0; i < 6; i++){
+        trunk.step();
+    }
+    trunk.save_checkpoint(filename);
+    std::unique_ptr<Simulation> restored = Simulation::load_checkpoint(filename);
+    REQUIRE(restored->get_steps_taken() == 6);
+    REQUIRE(restored->get_time() == trunk.get_time());
+    REQUIRE(restored->view().box_width == trunk.view().box_width);
+
+    for (uint i = 0; i < 6; i++){
+        trunk.step();
+        restored->step();
+    }
+    for (uint p = 0; p < number_particles; p++){
+        REQUIRE(restored->get_particle_collection().particles[p].position == trunk.get_particle_collection().particles[p].position);
+        REQUIRE(restored->get_particle_collection().particles[p].velocity == trunk.get_particle_collection().particles[p].velocity);
+    }
+
+    // a truncated file is rejected before its stated particles are allocated
+    std::filesystem::resize_file(filename, std::filesystem::file_size(filename) - 1);
+    REQUIRE_THROWS_AS(Simulation::load_checkpoint(filename), std::invalid_argument);
+    std::remove(filename.c_str());
+
+    std::ofstream not_a_checkpoint(filename);
+    not_a_checkpoint << "time,step\n";
+    not_a_checkpoint.close();
+    REQUIRE_THROWS_AS(Simulation::load_checkpoint(filename), std::invalid_argument);
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Test branches continue from the state of the trunk with their own parameters","[Branch]"){
+    double mass = 0.1;
+    double width = 1;
+    uint number_particles = 200;
+    uint num_cells = 10;
+    Simulation trunk(1, 0.05, particle_group(mass, number_particles, 8), width, num_cells, 1.05);
+    for (uint i = 0; i < 5; i++){
+        trunk.step();
+    }
+    particle_group trunk_state = trunk.get_particle_collection();
+
+    branch_parameters faster_expansion;
+    faster_expansion.expansion_factor = 1.2;
+    branch_parameters perturbed;
+    perturbed.position_perturbation = 0.1;
+    perturbed.perturbation_seed = 4;
+    branch_parameters negative_step;
+    negative_step.time_step = -0.1;
+    REQUIRE_THROWS_AS(trunk.branch(negative_step), std::invalid_argument);
+
+    std::unique_ptr<Simulation> same = trunk.branch();
+    std::unique_ptr<Simulation> expanded = trunk.branch(faster_expansion);
+    std::unique_ptr<Simulation> shifted = trunk.branch(perturbed);
+    REQUIRE(shifted->get_steps_taken() == 5);
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){
+            double shift = std::abs(shifted->get_particle_collection().particles[p].position[axis] - trunk_state.particles[p].position[axis]);
+            REQUIRE(std::min(shift, 1 - shift) <= 0.1 / num_cells);
+        }
+        const std::array<double, 3> & position = shifted->get_particle_collection().particles[p].position;
+        uint i = std::min(uint(position[0] * num_cells), num_cells - 1), j = std::min(uint(position[1] * num_cells), num_cells - 1), k = std::min(uint(position[2] * num_cells), num_cells - 1);
+        REQUIRE(shifted->get_cell_indices()[p] == k + num_cells * (j + num_cells * i));
+    }
+
+    for (uint i = 0; i < 5; i++){
+        trunk.step();
+        same->step();
+        expanded->step();
+    }
+    REQUIRE(expanded->view().box_width > trunk.view().box_width);
+    for (uint p = 0; p < number_particles; p++){
+        REQUIRE(same->get_particle_collection().particles[p].position == trunk.get_particle_collection().particles[p].position);
+    }
+
+    trunk.run_ensemble({faster_expansion, perturbed}, "BranchTestOutput");
+    REQUIRE(std::filesystem::exists("BranchTestOutput/branch_0"));
+    REQUIRE(std::filesystem::exists("BranchTestOutput/branch_1"));
+    REQUIRE(trunk.get_steps_taken() == 10); // the ensemble does not advance the trunk
+    std::filesystem::remove_all("BranchTestOutput");
+}
+
+TEST_CASE("Test kernels specialised for the grid size match the generic kernels","[Grid_Specialisation]"){
+    uint num_cells = 64; // one of Simulation::specialised_grid_sizes
+    REQUIRE(std::find(Simulation::specialised_grid_sizes.begin(), Simulation::specialised_grid_sizes.end(), num_cells) != Simulation::specialised_grid_sizes.end());
+    uint number_particles = 20000;
+    particle_group particles(1e-3, number_particles, 17);
+    Simulation specialised_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    Simulation generic_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    TuningConfiguration generic = generic_sim.get_tuning();
+    generic.specialise_grid = false;
+    generic_sim.set_tuning(generic);
+    specialised_sim.set_gradient_order(4);
+    generic_sim.set_gradient_order(4);
+
+    for (uint i = 0; i < 3; i++){
+        specialised_sim.step();
+        generic_sim.step();
+    }
+    REQUIRE(specialised_sim.get_cell_indices() == generic_sim.get_cell_indices());
+    for (uint axis = 0; axis < 3; axis++){
+        REQUIRE(specialised_sim.get_acceleration()[axis] == generic_sim.get_acceleration()[axis]);
+    }
+    for (uint p = 0; p < number_particles; p++){
+        REQUIRE(specialised_sim.get_particle_collection().particles[p].position == generic_sim.get_particle_collection().particles[p].position);
+    }
+}
+
+TEST_CASE("Test the bricked grid layout gives the same particles as the row major layout","[Grid_Layout]"){
+    uint number_particles = 20000;
+    particle_group particles(1e-3, number_particles, 23);
+    for (uint num_cells : {20u, 64u}){ // a partial brick at the upper faces, and a specialised grid size
+        for (DepositionStrategy deposition : {DepositionStrategy::atomic, DepositionStrategy::coalesced, DepositionStrategy::private_grids}){
+            Simulation row_major_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+            Simulation bricked_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+            TuningConfiguration configuration = row_major_sim.get_tuning();
+            configuration.deposition = deposition;
+            configuration.num_threads = 1; // the coalesced and private grid sums depend on how the particles are split between threads, one thread makes them exact
+            row_major_sim.set_tuning(configuration);
+            configuration.grid_layout = GridLayout::bricked;
+            bricked_sim.set_tuning(configuration);
+
+            for (uint i = 0; i < 3; i++){
+                row_major_sim.step();
+                bricked_sim.step();
+            }
+            for (size_t index = 0; index < static_cast<size_t>(num_cells) * num_cells * num_cells; index++){
+                REQUIRE(row_major_sim.get_density_buffer()[index][0] == bricked_sim.get_density_buffer()[index][0]);
+            }
+
+            // with every thread the densities agree up to the order of the sums
+            Simulation threaded_row_major_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+            Simulation threaded_bricked_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+            configuration.num_threads = 0;
+            threaded_bricked_sim.set_tuning(configuration);
+            configuration.grid_layout = GridLayout::row_major;
+            threaded_row_major_sim.set_tuning(configuration);
+            threaded_row_major_sim.step();
+            threaded_bricked_sim.step();
+            for (size_t index = 0; index < static_cast<size_t>(num_cells) * num_cells * num_cells; index++){
+                REQUIRE_THAT(threaded_bricked_sim.get_density_buffer()[index][0], WithinRel(threaded_row_major_sim.get_density_buffer()[index][0], 1e-12));
+            }
+            for (uint i = 0; i < num_cells; i += 3){
+                for (uint j = 0; j < num_cells; j++){
+                    for (uint k = 0; k < num_cells; k++){
+                        for (uint axis = 0; axis < 3; axis++){
+                            REQUIRE(row_major_sim.get_acceleration()[axis][row_major_sim.field_index(i, j, k)] == bricked_sim.get_acceleration()[axis][bricked_sim.field_index(i, j, k)]);
+                        }
+                    }
+                }
+            }
+            for (uint p = 0; p < number_particles; p++){
+                REQUIRE(row_major_sim.get_particle_collection().particles[p].position == bricked_sim.get_particle_collection().particles[p].position);
+            }
+            REQUIRE(row_major_sim.find_halos(0.2, 5).size() == bricked_sim.find_halos(0.2, 5).size());
+        }
+    }
+
+    Simulation sim(1, 0.01, particle_group(particles), 100, 20, 1.02);
+    TuningConfiguration configuration = sim.get_tuning();
+    configuration.grid_layout = GridLayout::bricked;
+    sim.set_tuning(configuration);
+    REQUIRE(sim.field_index(0, 0, 1) == 1);
+    REQUIRE(sim.field_index(0, 1, 0) == Simulation::brick_length);
+    REQUIRE(sim.field_index(0, 0, Simulation::brick_length) == Simulation::brick_length * Simulation::brick_length * Simulation::brick_length);
+    for (uint p = 0; p < number_particles; p += 97){
+        const std::array<double, 3> & position = sim.get_particle_collection().particles[p].position;
+        REQUIRE(sim.get_cell_indices()[p] == sim.field_index(position[0] * 20, position[1] * 20, position[2] * 20));
+    }
+    REQUIRE_THROWS(sim.field_index(20, 0, 0));
+
+    // sorting orders the particles brick by brick instead of row by row, every particle still sees the same forces
+    Simulation row_major_sorted(1, 0.01, particle_group(particles), 100, 20, 1.02);
+    configuration.sort_interval = 1;
+    sim.set_tuning(configuration);
+    configuration.grid_layout = GridLayout::row_major;
+    row_major_sorted.set_tuning(configuration);
+    for (uint i = 0; i < 3; i++){
+        sim.step();
+        row_major_sorted.step();
+    }
+    std::vector<std::array<double, 3>> bricked_positions, row_major_positions;
+    for (uint p = 0; p < number_particles; p++){
+        bricked_positions.push_back(sim.get_particle_collection().particles[p].position);
+        row_major_positions.push_back(row_major_sorted.get_particle_collection().particles[p].position);
+    }
+    REQUIRE(bricked_positions != row_major_positions);
+    std::sort(bricked_positions.begin(), bricked_positions.end());
+    std::sort(row_major_positions.begin(), row_major_positions.end());
+    REQUIRE(bricked_positions == row_major_positions);
+}
+
+TEST_CASE("Test incremental deposition matches full deposition and falls back to it when many particles move","[Incremental_Deposition]"){
+    uint num_cells = 32;
+    uint number_particles = 20000;
+    particle_group particles(1e-3, number_particles, 29);
+    std::default_random_engine generator(5);
+    std::uniform_real_distribution<double> velocity(-0.5, 0.5); // about a tenth of the particles change cell every step
+    for (particle & current : particles.particles){
+        current.velocity = {velocity(generator), velocity(generator), velocity(generator)};
+    }
+
+    Simulation full_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    for (GridLayout layout : {GridLayout::row_major, GridLayout::bricked}){
+        Simulation incremental_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+        TuningConfiguration configuration = incremental_sim.get_tuning();
+        configuration.incremental_deposition = true;
+        configuration.full_deposition_interval = 3;
+        configuration.max_moved_fraction = 1;
+        configuration.sort_interval = 4;
+        configuration.grid_layout = layout;
+        incremental_sim.set_tuning(configuration);
+        Simulation reference_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+
+        for (uint i = 0; i < 10; i++){
+            incremental_sim.step();
+            reference_sim.step();
+            for (size_t index = 0; index < static_cast<size_t>(num_cells) * num_cells * num_cells; index++){
+                REQUIRE_THAT(incremental_sim.get_density_buffer()[index][0], WithinRel(reference_sim.get_density_buffer()[index][0], 1e-12));
+                REQUIRE(incremental_sim.get_density_buffer()[index][1] == 0);
+            }
+        }
+        REQUIRE(incremental_sim.get_moved_fraction() > 0.02);
+        REQUIRE(incremental_sim.get_moved_fraction() < 0.5);
+        REQUIRE(incremental_sim.get_incremental_depositions() == 6); // full depositions at steps 1, 4, 7 and 10
+    }
+
+    Simulation fallback_sim(1, 0.01, particle_group(particles), 100, num_cells, 1.02);
+    TuningConfiguration configuration = fallback_sim.get_tuning();
+    configuration.incremental_deposition = true;
+    configuration.full_deposition_interval = 0;
+    configuration.max_moved_fraction = 0.01;
+    fallback_sim.set_tuning(configuration);
+    for (uint i = 0; i < 5; i++){
+        uint64_t incremental_before = fallback_sim.get_incremental_depositions();
+        fallback_sim.step();
+        full_sim.step();
+        if (fallback_sim.get_moved_fraction() > 0.01){
+            REQUIRE(fallback_sim.get_incremental_depositions() == incremental_before);
+        }
+    }
+    REQUIRE(fallback_sim.get_moved_fraction() > 0.01);
+    for (uint p = 0; p < number_particles; p++){
+        for (uint axis = 0; axis < 3; axis++){ // counts times the particle density may round differently from the sum of the particle densities
+            REQUIRE_THAT(fallback_sim.get_particle_collection().particles[p].position[axis], WithinAbs(full_sim.get_particle_collection().particles[p].position[axis], 1e-12));
+        }
+    }
+
+    configuration.max_moved_fraction = 1.5;
+    REQUIRE_THROWS(fallback_sim.set_tuning(configuration));
+}
+
+TEST_CASE("Test block time steps push each level with its own step and approach a uniformly fine step","[Block_Time_Steps]"){
+    uint num_cells = 32;
+    double time_step = 0.01;
+    std::vector<std::array<double, 3>> positions;
+    std::default_random_engine generator(3);
+    std::uniform_real_distribution<double> uniform(0, 1), clump(0.48, 0.52);
+    for (uint i = 0; i < 10000; i++){
+        positions.push_back({uniform(generator), uniform(generator), uniform(generator)});
+    }
+    for (uint i = 0; i < 10000; i++){ // dense clump whose particles need short steps
+        positions.push_back({clump(generator), clump(generator), clump(generator)});
+    }
+    particle_group particles(1.0, positions.size(), positions);
+    block_step_settings settings;
+    settings.max_level = 3;
+
+    SECTION("Every particle on the top level takes one global step"){
+        Simulation global_sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+        Simulation block_sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+        settings.cell_fraction = 1e9;
+        block_sim.set_block_time_steps(settings);
+        global_sim.set_diagnostics(true);
+        block_sim.set_diagnostics(true);
+        for (uint i = 0; i < 3; i++){
+            global_sim.step();
+            block_sim.step();
+        }
+        REQUIRE(block_sim.get_level_counts() == std::vector<uint64_t>{positions.size(), 0, 0, 0});
+        for (size_t p = 0; p < positions.size(); p++){
+            REQUIRE(block_sim.get_particle_collection().particles[p].position == global_sim.get_particle_collection().particles[p].position);
+            REQUIRE(block_sim.get_particle_collection().particles[p].velocity == global_sim.get_particle_collection().particles[p].velocity);
+        }
+        // the statistics are of the same physical velocities with the box expanding (e = 1.02)
+        for (size_t s = 0; s < 3; s++){
+            const StepStatistics & global_step = global_sim.get_run_statistics()[s];
+            const StepStatistics & block_step = block_sim.get_run_statistics()[s];
+            REQUIRE_THAT(block_step.kinetic_energy, WithinRel(global_step.kinetic_energy, 1e-9));
+            REQUIRE_THAT(block_step.max_speed, WithinRel(global_step.max_speed, 1e-12));
+            REQUIRE_THAT(block_step.potential_energy, WithinRel(global_step.potential_energy, 1e-12));
+            for (uint axis = 0; axis < 3; axis++){
+                REQUIRE_THAT(block_step.momentum[axis], WithinAbs(global_step.momentum[axis], 1e-9 * std::sqrt(global_step.kinetic_energy)));
+            }
+        }
+    }
+
+    SECTION("Every particle on the deepest level takes the substeps"){
+        Simulation fine_sim(1, time_step / 8, particle_group(particles), 100, num_cells, 1);
+        Simulation block_sim(1, time_step, particle_group(particles), 100, num_cells, 1);
+        settings.cell_fraction = 1e-9;
+        block_sim.set_block_time_steps(settings);
+        block_sim.step();
+        for (uint i = 0; i < 8; i++){
+            fine_sim.step();
+        }
+        REQUIRE(block_sim.get_level_counts() == std::vector<uint64_t>{0, 0, 0, positions.size()});
+        REQUIRE(block_sim.get_steps_taken() == 1);
+        for (size_t p = 0; p < positions.size(); p++){
+            REQUIRE(block_sim.get_particle_collection().particles[p].position == fine_sim.get_particle_collection().particles[p].position);
+        }
+    }
+
+    SECTION("Mixed levels are closer to a uniformly fine step than the global step is"){
+        Simulation fine_sim(1, time_step / 8, particle_group(particles), 100, num_cells, 1);
+        Simulation coarse_sim(1, time_step, particle_group(particles), 100, num_cells, 1);
+        Simulation block_sim(1, time_step, particle_group(particles), 100, num_cells, 1);
+        block_sim.set_block_time_steps(settings);
+        block_sim.set_diagnostics(true);
+        for (uint i = 0; i < 4; i++){
+            coarse_sim.step();
+            block_sim.step();
+        }
+        for (uint i = 0; i < 32; i++){
+            fine_sim.step();
+        }
+        const std::vector<uint64_t> & level_counts = block_sim.get_level_counts();
+        REQUIRE(std::accumulate(level_counts.begin(), level_counts.end(), uint64_t(0)) == positions.size());
+        REQUIRE(level_counts[0] > 0);
+        REQUIRE(level_counts[3] > 0);
+        REQUIRE(block_sim.get_run_statistics().size() == 4);
+
+        fine_sim.fill_density_buffer();
+        coarse_sim.fill_density_buffer();
+        block_sim.fill_density_buffer();
+        double coarse_error = 0, block_error = 0;
+        for (size_t index = 0; index < static_cast<size_t>(num_cells) * num_cells * num_cells; index++){
+            coarse_error += std::abs(coarse_sim.get_density_buffer()[index][0] - fine_sim.get_density_buffer()[index][0]);
+            block_error += std::abs(block_sim.get_density_buffer()[index][0] - fine_sim.get_density_buffer()[index][0]);
+        }
+        REQUIRE(block_error < 0.5 * coarse_error);
+
+        block_sim.set_lightcone_output(lightcone_settings());
+        REQUIRE_THROWS(block_sim.run("test_block_steps"));
+        std::filesystem::remove_all("test_block_steps");
+    }
+
+    Simulation sim(1, time_step, particle_group(particles), 100, num_cells, 1);
+    settings.max_level = 11;
+    REQUIRE_THROWS(sim.set_block_time_steps(settings));
+    settings.max_level = 2;
+    settings.cell_fraction = 0;
+    REQUIRE_THROWS(sim.set_block_time_steps(settings));
+}
+
+TEST_CASE("Test force reuse skips mesh solves within the displacement bound and stays close to solving every step","[Force_Reuse]"){
+    uint num_cells = 32;
+    double time_step = 0.01;
+    std::vector<std::array<double, 3>> positions;
+    std::default_random_engine generator(5);
+    std::uniform_real_distribution<double> uniform(0, 1), clump(0.3, 0.7);
+    for (uint i = 0; i < 10000; i++){
+        positions.push_back({uniform(generator), uniform(generator), uniform(generator)});
+        positions.push_back({clump(generator), clump(generator), clump(generator)});
+    }
+    particle_group particles(1.0, positions.size(), positions);
+    Simulation reference_sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+    for (uint i = 0; i < 8; i++){
+        reference_sim.step();
+    }
+    REQUIRE(reference_sim.get_force_solves() == 8);
+    auto max_position_difference = [&](const Simulation & sim){
+        double difference = 0;
+        for (size_t p = 0; p < positions.size(); p++){
+            for (uint axis = 0; axis < 3; axis++){
+                double separation = std::abs(sim.get_particle_collection().particles[p].position[axis] - reference_sim.get_particle_collection().particles[p].position[axis]);
+                difference = std::max(difference, std::min(separation, 1 - separation));
+            }
+        }
+        return difference;
+    };
+    force_reuse_settings settings;
+
+    SECTION("No reuse solves every step"){
+        Simulation sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+        sim.set_force_reuse(settings);
+        for (uint i = 0; i < 8; i++){
+            sim.step();
+        }
+        REQUIRE(sim.get_force_solves() == 8);
+        for (size_t p = 0; p < positions.size(); p++){
+            REQUIRE(sim.get_particle_collection().particles[p].position == reference_sim.get_particle_collection().particles[p].position);
+        }
+    }
+
+    SECTION("Held and extrapolated fields stay close to solving every step"){
+        settings.max_reuse = 3;
+        settings.max_displacement = 1e9;
+        for (bool extrapolate : {false, true}){
+            Simulation sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+            settings.extrapolate = extrapolate;
+            sim.set_force_reuse(settings);
+            for (uint i = 0; i < 8; i++){
+                sim.step();
+            }
+            REQUIRE(sim.get_force_solves() == 2);
+            REQUIRE(max_position_difference(sim) < 0.5 / num_cells);
+        }
+    }
+
+    SECTION("The displacement bound forces a solve"){
+        settings.max_reuse = 3;
+        settings.max_displacement = 1e-12;
+        Simulation sim(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+        sim.set_force_reuse(settings);
+        for (uint i = 0; i < 8; i++){
+            sim.step();
+        }
+        REQUIRE(sim.get_force_solves() == 8);
+        REQUIRE(max_position_difference(sim) == 0);
+    }
+
+    SECTION("A branch keeps reusing the held field"){
+        settings.max_reuse = 3;
+        settings.max_displacement = 1e9;
+        settings.extrapolate = true;
+        Simulation trunk(1, time_step, particle_group(particles), 100, num_cells, 1.02);
+        trunk.set_force_reuse(settings);
+        for (uint i = 0; i < 6; i++){
+            trunk.step(); // solves at steps 0 and 4, the branch is taken while the second field is held
+        }
+        std::unique_ptr<Simulation> branched = trunk.branch();
+        for (uint i = 0; i < 2; i++){
+            trunk.step();
+            branched->step();
+        }
+        REQUIRE(branched->get_force_solves() == 0);
+        for (size_t p = 0; p < positions.size(); p++){
+            REQUIRE(branched->get_particle_collection().particles[p].position == trunk.get_particle_collection().particles[p].position);
+            REQUIRE(branched->get_particle_collection().particles[p].velocity == trunk.get_particle_collection().particles[p].velocity);
+        }
+        branch_parameters shorter_step;
+        shorter_step.time_step = time_step / 2;
+        std::unique_ptr<Simulation> resolved = trunk.branch(shorter_step);
+        resolved->step();
+        REQUIRE(resolved->get_force_solves() == 1);
+    }
+
+    Simulation sim(1, time_step, particle_group(particles), 100, num_cells, 1);
+    settings.max_reuse = 2;
+    settings.max_displacement = 0;
+    REQUIRE_THROWS(sim.set_force_reuse(settings));
+    settings.max_displacement = 0.25;
+    sim.set_force_reuse(settings);
+    block_step_settings block_settings;
+    block_settings.max_level = 2;
+    REQUIRE_THROWS(sim.set_block_time_steps(block_settings));
+    sim.set_force_reuse(force_reuse_settings());
+    sim.set_block_time_steps(block_settings);
+    REQUIRE_THROWS(sim.set_force_reuse(settings));
+}
+
+/**
+ * @brief: Reads the particle stream whose file name starts with prefix from a run() output folder.
+*/
+std::vector<streamed_particle> readStreamWithPrefix(const std::string & folder, const std::string & prefix, ParticleStream::kind & kind){
+    for (const auto & entry : std::filesystem::recursive_directory_iterator(folder)){
+        if (entry.path().filename().string().rfind(prefix, 0) == 0){
+            return ReadParticleStream(entry.path().string(), kind);
+        }
+    }
+    throw std::runtime_error("No particle stream " + prefix + " in " + folder);
+}
+
+TEST_CASE("Test region outputs stream the particles inside their region","[Particle_Stream]"){
+    uint number_particles = 3000;
+    Simulation sim(0.095, 0.01, particle_group(1e-4, number_particles, 31), 1, 10, 1.0); // 10 steps
+    region_settings region;
+    region.lower = {0.1, 0.2, 0.3};
+    region.upper = {0.6, 0.7, 0.9};
+    region.interval = 2;
+    REQUIRE_THROWS_AS(sim.add_region_output(region_settings{{0.5, 0, 0}, {0.4, 1, 1}, 1}), std::invalid_argument);
+    sim.add_region_output(region);
+    std::string folder = "StreamTestOutput";
+    sim.run(folder);
+
+    ParticleStream::kind kind;
+    std::vector<streamed_particle> records = readStreamWithPrefix(folder, "Region_0", kind);
+    REQUIRE(kind == ParticleStream::kind::region);
+    REQUIRE_FALSE(records.empty());
+    for (const streamed_particle & record : records){
+        for (uint axis = 0; axis < 3; axis++){
+            REQUIRE(record.position[axis] >= float(region.lower[axis]));
+            REQUIRE(record.position[axis] <= float(region.upper[axis]));
+        }
+    }
+    // every second step writes the whole region, so the final step's records are the particles in the region now
+    REQUIRE(sim.get_steps_taken() % 2 == 0);
+    size_t final_records = std::count_if(records.begin(), records.end(), [&](const streamed_particle & record){ return std::abs(record.time - sim.get_time()) < 1e-9; });
+    size_t inside = std::count_if(sim.get_particle_collection().particles.begin(), sim.get_particle_collection().particles.end(), [&](const particle & current){
+        for (uint axis = 0; axis < 3; axis++){
+            if (current.position[axis] < region.lower[axis] || current.position[axis] >= region.upper[axis]){
+                return false;
+            }
+        }
+        return true;
+    });
+    REQUIRE(final_records == inside);
+    std::filesystem::remove_all(folder);
+}
+
+TEST_CASE("Test lightcone output writes particles once as the receding shell crosses them","[Particle_Stream]"){
+    uint number_particles = 4000;
+    double t_max = 0.2;
+    std::array<double, 3> observer = {0.3, 0.5, 0.7};
+    particle_group particles(1e-6, number_particles, 12); // light particles that barely move, so the shell sweeps over a static population
+    Simulation sim(t_max, 0.01, particle_group(particles), 1, 10, 1.0);
+    lightcone_settings cone;
+    cone.observer = observer;
+    cone.light_speed = 0.5 / t_max; // the shell shrinks from half the box to the observer over the run
+    REQUIRE_THROWS_AS(sim.set_lightcone_output(lightcone_settings{{0.5, 0.5, 0.5}, 1, 0.7}), std::invalid_argument);
+    sim.set_lightcone_output(cone);
+    std::string folder = "LightconeTestOutput";
+    sim.run(folder);
+
+    ParticleStream::kind kind;
+    std::vector<streamed_particle> records = readStreamWithPrefix(folder, "Lightcone", kind);
+    REQUIRE(kind == ParticleStream::kind::lightcone);
+    auto distance = [&](const std::array<double, 3> & position){
+        double squared = 0;
+        for (uint axis = 0; axis < 3; axis++){
+            double offset = position[axis] - observer[axis];
+            offset -= std::round(offset);
+            squared += offset * offset;
+        }
+        return std::sqrt(squared);
+    };
+    size_t within_half_box = std::count_if(particles.particles.begin(), particles.particles.end(), [&](const particle & current){ return distance(current.position) < 0.5; });
+    REQUIRE(records.size() > 0.98 * within_half_box);
+    REQUIRE(records.size() < 1.02 * within_half_box);
+    for (const streamed_particle & record : records){
+        std::array<double, 3> position = {record.position[0], record.position[1], record.position[2]};
+        REQUIRE_THAT(distance(position), WithinAbs(cone.light_speed * (t_max - record.time), 1e-4)); // written on the shell at its crossing time
+    }
+    std::filesystem::remove_all(folder);
+}
+
+TEST_CASE("Test indexed snapshot box queries return exactly the particles inside the box","[Indexed_Snapshot]"){
+    particle_group particles(0.25, 20000, 42);
+    for (size_t i = 0; i < particles.particles.size(); i++){
+        particles.particles[i].velocity = {double(i), 0, 0}; // tags the particles so the queries can be matched one to one
+    }
+    std::string filename = "test_snapshot.bin";
+    SaveIndexedSnapshot(particles, filename, 3);
+    IndexedSnapshot snapshot(filename);
+    REQUIRE(snapshot.size() == particles.particles.size());
+    REQUIRE(snapshot.get_mass() == 0.25);
+    REQUIRE(snapshot.get_level() == 3);
+
+    size_t total = 0;
+    for (uint64_t key = 0; key < 512; key++){
+        auto [begin, end] = snapshot.block(key);
+        for (const particle * current = begin; current != end; current++){
+            REQUIRE(MortonKey(current->position, 3) == key);
+        }
+        total += end - begin;
+    }
+    REQUIRE(total == particles.particles.size());
+
+    std::vector<std::pair<std::array<double, 3>, std::array<double, 3>>> boxes = {{{0.1, 0.2, 0.3}, {0.45, 0.8, 0.35}}, {{0, 0, 0}, {1, 1, 1}},
+                                                                                 {{0.5, 0.5, 0.5}, {0.625, 0.625, 0.625}}, {{0.9, -1, 0.2}, {2, 0.05, 0.21}}, {{0.3, 0.3, 0.3}, {0.3, 0.6, 0.6}}};
+    for (const auto & [lower, upper] : boxes){
+        std::vector<double> expected;
+        for (const particle & current : particles.particles){
+            bool inside = true;
+            for (uint axis = 0; axis < 3; axis++){
+                inside = inside && current.position[axis] >= lower[axis] && current.position[axis] < upper[axis];
+            }
+            if (inside){
+                expected.push_back(current.velocity[0]);
+            }
+        }
+        std::vector<double> found;
+        for (const particle & current : snapshot.query_box(lower, upper)){
+            found.push_back(current.velocity[0]);
+        }
+        std::sort(found.begin(), found.end());
+        REQUIRE(found == expected);
+    }
+    std::filesystem::remove(filename);
+
+    REQUIRE_THROWS(SaveIndexedSnapshot(particles, filename, 9));
+    REQUIRE_THROWS(IndexedSnapshot("test_snapshot_missing.bin"));
+}
+
+TEST_CASE("Test the space filling curve keys and weighted partition used by the domain decomposition","[Domain_Decomposition]"){
+    // Morton order interleaves x, y and z bits with x most significant
+    REQUIRE(MortonKey({0, 0, 0}, 1) == 0);
+    REQUIRE(MortonKey({0.75, 0, 0}, 1) == 4);
+    REQUIRE(MortonKey({0, 0.75, 0}, 1) == 2);
+    REQUIRE(MortonKey({0, 0, 0.75}, 1) == 1);
+    REQUIRE(MortonKey({0.99, 0.99, 0.99}, 2) == 63);
+    REQUIRE(MortonKey({1, 1, 1}, 3) == 511); // clamped into the last cell
+
+    std::vector<double> uniform(64, 1);
+    std::vector<int> owners = PartitionCurve(uniform, 4);
+    for (size_t bin = 0; bin < owners.size(); bin++){
+        REQUIRE(owners[bin] == static_cast<int>(bin / 16));
+    }
+
+    // a heavy clump takes a rank of its own and the light bins are shared by the others
+    std::vector<double> clustered(64, 1);
+    clustered[40] = 192;
+    owners = PartitionCurve(clustered, 4);
+    REQUIRE(std::is_sorted(owners.begin(), owners.end()));
+    REQUIRE(owners[0] == 0);
+    REQUIRE(owners[40] != owners[39]);
+    REQUIRE(owners[40] != owners[41]);
+    REQUIRE(owners[63] == 3);
+}
+
+TEST_CASE("Test friends-of-friends finds separate clumps including one across the periodic boundary","[Halo_Finder]"){
+    double mass = 0.5;
+    double width = 1;
+    uint num_cells = 10;
+    std::vector<std::array<double, 3>> positions = {
+        {0.501, 0.501, 0.501}, {0.503, 0.502, 0.501}, {0.502, 0.504, 0.503}, {0.504, 0.503, 0.502}, // clump around 0.5025
+        {0.999, 0.2, 0.2}, {0.001, 0.2, 0.2}, {0.998, 0.201, 0.2}, {0.002, 0.199, 0.2}, {0.0, 0.2, 0.201}, // clump across x = 0
+        {0.25, 0.75, 0.25}, {0.75, 0.25, 0.75} // isolated particles
+    };
+    particle_group particles(mass, positions.size(), positions);
+    Simulation sim(10, 0.1, particle_group(particles), width, num_cells, 1);
+
+    std::vector<halo> halos = sim.find_halos(0.2, 3);
+    REQUIRE(halos.size() == 2);
+
+    REQUIRE(halos[0].num_members == 5);
+    CHECK_THAT(halos[0].mass, WithinRel(5 * mass, 1e-12));
+    CHECK((halos[0].centre[0] < 0.01 || halos[0].centre[0] > 0.99)); // wraps around rather than averaging to 0.5
+    CHECK_THAT(halos[0].centre[1], WithinAbs(0.2, 1e-3));
+
+    REQUIRE(halos[1].num_members == 4);
+    CHECK_THAT(halos[1].centre[0], WithinAbs(0.5025, 1e-3));
+    CHECK_THAT(halos[1].velocity[0], WithinAbs(0, 1e-12));
+
+    REQUIRE(sim.find_halos(0.2, 6).empty());
+    REQUIRE_THROWS(sim.find_halos(1.5, 3));
+}
+
+
+TEST_CASE("Test classic colour map reproduces the original colour ramp","[Image_Output]"){
+    ColourMap colour_map("classic");
+    for (double normalised_density : {0.0, 0.3, 0.99, 1.5, 2.2, 2.9, 3.5, 10.0}){
+        double value = normalised_density * 255;
+        int r = std::min(static_cast<int>(value), 255);
+        int g = std::min(std::max(static_cast<int>(value - 255), 0), 255);
+        int b = std::min(std::max(static_cast<int>(value - 550), 0), 255);
+        const std::array<unsigned char, 3> & colour = colour_map(normalised_density);
+        CHECK(std::abs(colour[0] - r) <= 1);
+        CHECK(std::abs(colour[1] - g) <= 1);
+        CHECK(std::abs(colour[2] - b) <= 1);
+    }
+    REQUIRE_THROWS(ColourMap("not_a_colour_map"));
+}
+
+TEST_CASE("Test projection pyramid levels are block averages of the projection","[Image_Output]"){
+    size_t n_cells = 10;
+    fftw_complex * density = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) * n_cells * n_cells * n_cells);
+    for (size_t index = 0; index < n_cells * n_cells * n_cells; index++){
+        density[index][0] = index % 7;
+        density[index][1] = 0;
+    }
+    std::vector<double> projection = ProjectDensity(density, n_cells);
+    for (size_t i = 0; i < n_cells; i++){
+        for (size_t j = 0; j < n_cells; j++){
+            double column = 0;
+            for (size_t k = 0; k < n_cells; k++){
+                column += density[k + n_cells * (j + n_cells * i)][0];
+            }
+            REQUIRE_THAT(projection[i * n_cells + j], WithinRel(column, 1e-12));
+        }
+    }
+
+    std::vector<image_level> levels = BuildProjectionPyramid(projection, n_cells, 2);
+    REQUIRE(levels.size() == 4);
+    REQUIRE(levels[1].size == 5);
+    REQUIRE(levels[2].size == 3);
+    REQUIRE(levels[3].size == 2);
+    REQUIRE_THAT(levels[1].pixels[1 * 5 + 2], WithinRel((projection[2 * 10 + 4] + projection[2 * 10 + 5] + projection[3 * 10 + 4] + projection[3 * 10 + 5]) / 4, 1e-12));
+    REQUIRE_THAT(levels[2].pixels[2 * 3 + 2], WithinRel(levels[1].pixels[4 * 5 + 4], 1e-12)); // partial block in the corner
+    fftw_free(density);
+}
+
+
+TEST_CASE("Test particle renderer conserves mass and wraps kernels around the image edges","[Image_Output]"){
+    double mass = 0.5;
+    particle_group particles(mass, 3, {{0.5, 0.5, 0.1}, {0.001, 0.5, 0.7}, {0.25, 0.999, 0.3}});
+    render_settings settings;
+    settings.resolution = 100;
+    settings.tile_size = 16; // does not divide the resolution
+
+    std::vector<double> points = RenderParticles(particles, settings);
+    REQUIRE(points.size() == 100 * 100);
+    REQUIRE_THAT(std::accumulate(points.begin(), points.end(), 0.0), WithinRel(3 * mass, 1e-12));
+    REQUIRE_THAT(points[50 * 100 + 50], WithinRel(mass, 1e-12));
+    REQUIRE_THAT(points[0 * 100 + 50], WithinRel(mass, 1e-12));
+    REQUIRE_THAT(points[25 * 100 + 99], WithinRel(mass, 1e-12));
+
+    settings.smoothing_radius = 3.5;
+    std::vector<double> smoothed = RenderParticles(particles, settings);
+    REQUIRE_THAT(std::accumulate(smoothed.begin(), smoothed.end(), 0.0), WithinRel(3 * mass, 1e-12));
+    REQUIRE(smoothed[50 * 100 + 50] < mass);
+    REQUIRE(smoothed[50 * 100 + 50] > smoothed[50 * 100 + 52]);
+    REQUIRE(smoothed[99 * 100 + 50] > 0); // particle at x = 0.001 spreads across the edge
+    REQUIRE(smoothed[25 * 100 + 0] > 0); // particle at y = 0.999 spreads across the edge
+
+    settings.smoothing_radius = 60;
+    REQUIRE_THROWS(RenderParticles(particles, settings));
+}